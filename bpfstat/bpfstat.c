@@ -0,0 +1,254 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Live view of the responders loaded in the kernel: packets/s and average ns/run from the
+ * run_cnt/run_time_ns statistics of each program, its JITed size, and the memlock usage
+ * of the xdns maps. The run statistics are only collected while
+ * /proc/sys/kernel/bpf_stats_enabled is 1, which every script.sh sets.
+ *
+ *   sudo ./bpfstat [-i seconds]
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#define MAX_TRACKED_PROGS 16
+#define XDNS_MAP_PREFIX "xdns_"
+
+//Programs of this repository, identified by name and type
+struct responder {
+	const char *label;
+	const char *prog_name;
+	enum bpf_prog_type prog_type;
+};
+
+static const struct responder responders[] = {
+	{"xdp_dns", "xdp_dns", BPF_PROG_TYPE_XDP},
+	{"xdp_icmp", "icmp_serv", BPF_PROG_TYPE_XDP},
+	{"tc_icmp", "icmp_serv", BPF_PROG_TYPE_SCHED_CLS},
+	{"tc_dns", "dns_snoop", BPF_PROG_TYPE_SCHED_CLS},
+};
+
+struct tracked_prog {
+	__u32 id;
+	__u64 run_cnt;
+	__u64 run_time_ns;
+	int seen;
+	unsigned int scan;	//Last scan that found the program loaded
+};
+
+//Number of the current scan of the loaded programs
+static unsigned int scan;
+
+static struct tracked_prog tracked[MAX_TRACKED_PROGS];
+
+static struct tracked_prog *find_tracked(__u32 id)
+{
+	struct tracked_prog *free_slot = NULL;
+
+	for (int i = 0; i < MAX_TRACKED_PROGS; i++) {
+		if (tracked[i].id == id)
+			return &tracked[i];
+		if (!tracked[i].id && !free_slot)
+			free_slot = &tracked[i];
+	}
+	if (free_slot) {
+		memset(free_slot, 0, sizeof(*free_slot));
+		free_slot->id = id;
+	}
+	return free_slot;
+}
+
+//Free the slots of programs that were not found by the current scan, they have been unloaded
+static void untrack_unloaded(void)
+{
+	for (int i = 0; i < MAX_TRACKED_PROGS; i++) {
+		if (tracked[i].id && tracked[i].scan != scan)
+			memset(&tracked[i], 0, sizeof(tracked[i]));
+	}
+}
+
+static const struct responder *match_responder(const struct bpf_prog_info *info)
+{
+	for (int i = 0; i < sizeof(responders) / sizeof(responders[0]); i++) {
+		if (info->type == responders[i].prog_type &&
+			strncmp(info->name, responders[i].prog_name, BPF_OBJ_NAME_LEN) == 0)
+			return &responders[i];
+	}
+	return NULL;
+}
+
+//Print one line per loaded responder with the rates since the previous call
+static void print_progs(double interval)
+{
+	__u32 id = 0;
+
+	scan++;
+	printf("%-10s %6s %12s %10s %10s\n", "program", "id", "packets/s", "ns/run", "jited");
+	while (bpf_prog_get_next_id(id, &id) == 0) {
+		struct bpf_prog_info info;
+		__u32 info_len = sizeof(info);
+		const struct responder *r;
+		struct tracked_prog *t;
+		int fd;
+
+		fd = bpf_prog_get_fd_by_id(id);
+		if (fd < 0)
+			continue;
+		memset(&info, 0, sizeof(info));
+		if (bpf_obj_get_info_by_fd(fd, &info, &info_len)) {
+			close(fd);
+			continue;
+		}
+		close(fd);
+
+		r = match_responder(&info);
+		if (!r)
+			continue;
+
+		t = find_tracked(id);
+		if (!t)
+			continue;
+
+		//The first sample of a program has nothing to compare with
+		if (t->seen) {
+			__u64 runs = info.run_cnt - t->run_cnt;
+			__u64 ns = info.run_time_ns - t->run_time_ns;
+
+			printf("%-10s %6u %12.0f %10.1f %8u B\n", r->label, id, runs / interval,
+				   runs ? (double)ns / runs : 0.0, info.jited_prog_len);
+		} else {
+			printf("%-10s %6u %12s %10s %8u B\n", r->label, id, "-", "-", info.jited_prog_len);
+		}
+		t->run_cnt = info.run_cnt;
+		t->run_time_ns = info.run_time_ns;
+		t->seen = 1;
+		t->scan = scan;
+	}
+	untrack_unloaded();
+}
+
+//Read the memlock line of the fdinfo of a map
+static unsigned long long map_memlock(int fd)
+{
+	char path[64], line[128];
+	unsigned long long memlock = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "memlock: %llu", &memlock) == 1)
+			break;
+	}
+	fclose(f);
+	return memlock;
+}
+
+//Print the memlock usage of every map whose name starts with xdns_
+static void print_maps(void)
+{
+	unsigned long long total = 0;
+	__u32 id = 0;
+
+	printf("%-16s %6s %10s %12s\n", "map", "id", "entries", "memlock");
+	while (bpf_map_get_next_id(id, &id) == 0) {
+		struct bpf_map_info info;
+		__u32 info_len = sizeof(info);
+		unsigned long long memlock;
+		int fd;
+
+		fd = bpf_map_get_fd_by_id(id);
+		if (fd < 0)
+			continue;
+		memset(&info, 0, sizeof(info));
+		if (bpf_obj_get_info_by_fd(fd, &info, &info_len) ||
+			strncmp(info.name, XDNS_MAP_PREFIX, strlen(XDNS_MAP_PREFIX)) != 0) {
+			close(fd);
+			continue;
+		}
+		memlock = map_memlock(fd);
+		close(fd);
+
+		printf("%-16s %6u %10u %9llu KiB\n", info.name, id, info.max_entries, memlock / 1024);
+		total += memlock;
+	}
+	printf("%-16s %6s %10s %9llu KiB\n", "total", "", "", total / 1024);
+}
+
+static int stats_enabled(void)
+{
+	FILE *f = fopen("/proc/sys/kernel/bpf_stats_enabled", "r");
+	int enabled = 0;
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%d", &enabled) != 1)
+		enabled = 0;
+	fclose(f);
+	return enabled;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec last, now;
+	int interval = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:")) != -1) {
+		switch (opt) {
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [-i seconds]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (interval <= 0) {
+		fprintf(stderr, "Invalid interval\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!stats_enabled())
+		fprintf(stderr, "Warning: run statistics are off, run echo 1 > /proc/sys/kernel/bpf_stats_enabled\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	print_progs(interval);
+	while (1) {
+		sleep(interval);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		printf("\n");
+		print_progs((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9);
+		print_maps();
+		fflush(stdout);
+		last = now;
+	}
+
+	return 0;
+}
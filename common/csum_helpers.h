@@ -0,0 +1,47 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+//Internet checksum helpers shared by the XDP programs.
+//All values are summed as they are stored in the packet, so no byte order conversion is needed.
+#ifndef CSUM_HELPERS_H
+#define CSUM_HELPERS_H
+
+#include <linux/types.h>
+
+//Fold a 64-bit one's complement sum into 16 bits
+static __always_inline __u16 csum_fold(__u64 csum)
+{
+    csum = (csum & 0xffffffff) + (csum >> 32);
+    csum = (csum & 0xffffffff) + (csum >> 32);
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+    return (__u16)csum;
+}
+
+//Update a checksum for a 16-bit field that changed from old to new (RFC 1624, eqn. 3):
+//HC' = ~(~HC + ~m + m')
+static __always_inline void csum_replace2(__u16 *sum, __u16 old, __u16 new)
+{
+    __u64 csum = (__u16)~*sum;
+
+    csum += (__u16)~old;
+    csum += new;
+    *sum = ~csum_fold(csum);
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+//Checks the incremental checksum updates of csum_helpers.h against a full re-sum, on random
+//IPv4 headers whose total length changes (xdp_dns) and on random ICMP echo requests turned
+//into replies (xdp_icmp). Run with make check, optionally with the number of rounds and a seed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <linux/icmp.h>
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#include "csum_helpers.h"
+
+//Checksum of len bytes with the checksum field already in place, as a receiver verifies it
+static __u16 csum_full(const void *data, size_t len)
+{
+    const __u16 *words = data;
+    __u64 csum = 0;
+
+    for (size_t i = 0; i < len / 2; i++)
+    {
+        csum += words[i];
+    }
+    return ~csum_fold(csum);
+}
+
+static void fill_random(void *data, size_t len)
+{
+    unsigned char *p = data;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        p[i] = rand();
+    }
+}
+
+//Random IPv4 header with options and a valid checksum, then the length of an answer as xdp_dns sets it
+static int check_ip_tot_len(void)
+{
+    __u32 buf[15];
+    struct iphdr *ip = (struct iphdr *)buf;
+    int ihl = 5 + rand() % 11;
+
+    fill_random(buf, sizeof(buf));
+    ip->version = 4;
+    ip->ihl = ihl;
+    ip->check = 0;
+    ip->check = csum_full(ip, ihl * 4);
+
+    __u16 old_tot_len = ip->tot_len;
+    ip->tot_len = htons(ihl * 4 + 8 + rand() % 1480);
+    csum_replace2(&ip->check, old_tot_len, ip->tot_len);
+
+    return csum_full(ip, ihl * 4) == 0;
+}
+
+//Random ICMP echo request with a valid checksum, turned into a reply as xdp_icmp does
+static int check_icmp_reply(void)
+{
+    __u16 buf[32];
+    struct icmphdr *icmp = (struct icmphdr *)buf;
+    size_t len = 8 + 2 * (rand() % 25);
+
+    fill_random(buf, sizeof(buf));
+    icmp->type = ICMP_ECHO;
+    icmp->code = 0;
+    icmp->checksum = 0;
+    icmp->checksum = csum_full(icmp, len);
+
+    __u16 old_word = *(__u16 *)icmp;
+    icmp->type = ICMP_ECHOREPLY;
+    csum_replace2(&icmp->checksum, old_word, *(__u16 *)icmp);
+
+    return csum_full(icmp, len) == 0;
+}
+
+//The checksum words at the edges of one's complement arithmetic
+static int check_edges(void)
+{
+    static const __u16 values[] = {0x0000, 0x0001, 0x7fff, 0x8000, 0xfffe, 0xffff};
+    int n = sizeof(values) / sizeof(values[0]);
+    int failed = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                //The checksum, the field that changes and another word. Like in every real
+                //header the other word is never zero, an all-zero message has no valid checksum.
+                __u16 msg[3] = {0, values[i], values[k] ^ 0x4500};
+                msg[0] = csum_full(msg, sizeof(msg));
+
+                __u16 old = msg[1];
+                msg[1] = values[j];
+                csum_replace2(&msg[0], old, msg[1]);
+                if (csum_full(msg, sizeof(msg)) != 0)
+                {
+                    printf("FAIL: 0x%04x -> 0x%04x\n", values[i], values[j]);
+                    failed++;
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    long rounds = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    long ip_failed = 0, icmp_failed = 0;
+    int edge_failed;
+
+    srand(seed);
+    for (long i = 0; i < rounds; i++)
+    {
+        ip_failed += !check_ip_tot_len();
+        icmp_failed += !check_icmp_reply();
+    }
+    edge_failed = check_edges();
+
+    printf("IPv4 total length: %ld of %ld headers wrong\n", ip_failed, rounds);
+    printf("ICMP echo reply:   %ld of %ld messages wrong\n", icmp_failed, rounds);
+    printf("Edge values:       %d wrong\n", edge_failed);
+    return ip_failed || icmp_failed || edge_failed ? 1 : 0;
+}
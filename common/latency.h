@@ -0,0 +1,90 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+//Per-packet processing time histograms shared by the responders and the latency tool.
+//Every program pins two maps, <prefix>_lat and <prefix>_lat_on:
+//  <prefix>_lat     per-CPU array with one struct latency_hist
+//  <prefix>_lat_on  array with one __u32, recording is enabled while it is non-zero
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <linux/types.h>
+
+//Slot i counts packets that took [2^i, 2^(i+1)) ns, the last slot everything slower
+#define LATENCY_SLOTS 32
+
+enum latency_outcome {
+    LATENCY_HIT,  //Answered by the program
+    LATENCY_MISS, //Looked up, but nothing to answer with
+    LATENCY_PASS, //Not for this program
+    LATENCY_OUTCOMES
+};
+
+struct latency_hist {
+    __u64 slots[LATENCY_OUTCOMES][LATENCY_SLOTS];
+};
+
+#ifdef __KERNEL__
+//Return the start time of the packet, or 0 if recording is disabled
+static __always_inline __u64 latency_start(void *enabled_map)
+{
+    __u32 key = 0;
+    __u32 *enabled = bpf_map_lookup_elem(enabled_map, &key);
+
+    if (!enabled || !*enabled)
+    {
+        return 0;
+    }
+    return bpf_ktime_get_ns();
+}
+
+//Index of the highest set bit, without a loop
+static __always_inline __u32 latency_slot(__u64 v)
+{
+    __u32 slot = 0;
+
+    if (v >> 32) { v >>= 32; slot += 32; }
+    if (v >> 16) { v >>= 16; slot += 16; }
+    if (v >> 8) { v >>= 8; slot += 8; }
+    if (v >> 4) { v >>= 4; slot += 4; }
+    if (v >> 2) { v >>= 2; slot += 2; }
+    if (v >> 1) { slot += 1; }
+
+    return slot < LATENCY_SLOTS ? slot : LATENCY_SLOTS - 1;
+}
+
+//Add the time since start to the histogram of the outcome
+static __always_inline void latency_record(void *hist_map, __u64 start, __u32 outcome)
+{
+    __u32 key = 0;
+    struct latency_hist *hist;
+
+    if (!start || outcome >= LATENCY_OUTCOMES)
+    {
+        return;
+    }
+
+    hist = bpf_map_lookup_elem(hist_map, &key);
+    if (hist)
+    {
+        hist->slots[outcome][latency_slot(bpf_ktime_get_ns() - start)]++;
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+//Packet header parsing shared by the XDP programs.
+//Every parse_* function checks the header against data_end, stores a pointer to it and moves the
+//cursor past it. The cursor also keeps the offset from the start of the packet, so the programs can
+//find their headers again after bpf_xdp_adjust_tail/head without parsing the packet twice.
+#ifndef PARSING_HELPERS_H
+#define PARSING_HELPERS_H
+
+#include <linux/types.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/icmp.h>
+#include <bpf_endian.h>
+
+//Number of 802.1Q/802.1ad tags followed, two covers QinQ
+#define VLAN_MAX_DEPTH 2
+
+//802.1Q VLAN tag, following the MAC addresses of the Ethernet header
+struct vlan_hdr {
+    __be16 h_vlan_TCI;
+    __be16 h_vlan_encapsulated_proto;
+};
+
+struct hdr_cursor {
+    void *pos;
+    //Offset of pos from the start of the packet, bounded so it can be added to data again
+    __u32 off;
+};
+
+static __always_inline int proto_is_vlan(__u16 h_proto)
+{
+    return h_proto == bpf_htons(ETH_P_8021Q) || h_proto == bpf_htons(ETH_P_8021AD);
+}
+
+//Parse the Ethernet header and up to VLAN_MAX_DEPTH VLAN tags.
+//Returns the protocol of the next header in network byte order, or -1.
+static __always_inline int parse_ethhdr(struct hdr_cursor *nh, void *data_end, struct ethhdr **ethhdr)
+{
+    struct ethhdr *eth = nh->pos;
+    struct vlan_hdr *vlh;
+    __u16 h_proto;
+    int i;
+
+    if ((void *)eth + sizeof(*eth) > data_end)
+    {
+        return -1;
+    }
+
+    nh->pos += sizeof(*eth);
+    nh->off += sizeof(*eth);
+    *ethhdr = eth;
+    h_proto = eth->h_proto;
+
+    #pragma unroll
+    for (i = 0; i < VLAN_MAX_DEPTH; i++)
+    {
+        if (!proto_is_vlan(h_proto))
+        {
+            break;
+        }
+
+        vlh = nh->pos;
+        if ((void *)vlh + sizeof(*vlh) > data_end)
+        {
+            return -1;
+        }
+
+        h_proto = vlh->h_vlan_encapsulated_proto;
+        nh->pos += sizeof(*vlh);
+        nh->off += sizeof(*vlh);
+    }
+
+    //More tags than we follow
+    if (proto_is_vlan(h_proto))
+    {
+        return -1;
+    }
+
+    return h_proto;
+}
+
+//Parse an IPv4 header including its options (IHL > 5).
+//Returns the protocol of the next header, or -1.
+static __always_inline int parse_iphdr(struct hdr_cursor *nh, void *data_end, struct iphdr **iphdr)
+{
+    struct iphdr *iph = nh->pos;
+    int hdrsize;
+
+    if ((void *)iph + sizeof(*iph) > data_end)
+    {
+        return -1;
+    }
+
+    hdrsize = iph->ihl * 4;
+    if (hdrsize < sizeof(*iph))
+    {
+        return -1;
+    }
+
+    //Variable-length IPv4 header, the options must be in the packet as well
+    if (nh->pos + hdrsize > data_end)
+    {
+        return -1;
+    }
+
+    nh->pos += hdrsize;
+    nh->off += hdrsize;
+    *iphdr = iph;
+
+    return iph->protocol;
+}
+
+//Parse a fixed IPv6 header. Extension headers are not followed.
+//Returns the next header, or -1.
+static __always_inline int parse_ip6hdr(struct hdr_cursor *nh, void *data_end, struct ipv6hdr **ip6hdr)
+{
+    struct ipv6hdr *ip6h = nh->pos;
+
+    if ((void *)ip6h + sizeof(*ip6h) > data_end)
+    {
+        return -1;
+    }
+
+    nh->pos += sizeof(*ip6h);
+    nh->off += sizeof(*ip6h);
+    *ip6hdr = ip6h;
+
+    return ip6h->nexthdr;
+}
+
+//Parse a UDP header. Returns the length of the UDP payload, or -1.
+static __always_inline int parse_udphdr(struct hdr_cursor *nh, void *data_end, struct udphdr **udphdr)
+{
+    struct udphdr *h = nh->pos;
+    int len;
+
+    if ((void *)h + sizeof(*h) > data_end)
+    {
+        return -1;
+    }
+
+    len = bpf_ntohs(h->len) - sizeof(*h);
+    if (len < 0)
+    {
+        return -1;
+    }
+
+    nh->pos += sizeof(*h);
+    nh->off += sizeof(*h);
+    *udphdr = h;
+
+    return len;
+}
+
+//Parse an ICMP header. Returns the ICMP type, or -1.
+static __always_inline int parse_icmphdr(struct hdr_cursor *nh, void *data_end, struct icmphdr **icmphdr)
+{
+    struct icmphdr *icmph = nh->pos;
+
+    if ((void *)icmph + sizeof(*icmph) > data_end)
+    {
+        return -1;
+    }
+
+    nh->pos += sizeof(*icmph);
+    nh->off += sizeof(*icmph);
+    *icmphdr = icmph;
+
+    return icmph->type;
+}
+
+#endif
@@ -0,0 +1,157 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+//Per-RX-queue packet counters of the XDP programs, to see how RSS spreads the load.
+//Every program pins a per-CPU array <prefix>_rxq with one struct rxq_stats per queue.
+#ifndef RXQ_STATS_H
+#define RXQ_STATS_H
+
+#include <linux/types.h>
+
+//Queues with a higher index are counted in the last entry
+#define MAX_RX_QUEUES 64
+
+struct rxq_stats {
+    __u64 packets;
+    __u64 hits;
+};
+
+#ifdef __KERNEL__
+//Count a packet (and whether it was answered) for the RX queue it arrived on
+static __always_inline void rxq_count(void *rxq_map, struct xdp_md *ctx, int hit)
+{
+    __u32 queue = ctx->rx_queue_index;
+    struct rxq_stats *stats;
+
+    if (queue >= MAX_RX_QUEUES)
+    {
+        queue = MAX_RX_QUEUES - 1;
+    }
+
+    stats = bpf_map_lookup_elem(rxq_map, &queue);
+    if (stats)
+    {
+        stats->packets++;
+        stats->hits += hit;
+    }
+}
+#else
+#include <stdlib.h>
+
+//Cumulative counters of every queue, and the CPU that handled most of its packets since
+//the previous read
+struct rxq_totals {
+    __u64 packets[MAX_RX_QUEUES];
+    __u64 hits[MAX_RX_QUEUES];
+    int top_cpu[MAX_RX_QUEUES];
+    __u64 *cpu_packets;     //Packets of queue q on CPU c at [q * nr_cpus + c]
+};
+
+//Sum the per-CPU counters of every queue. The top CPU of a queue is the one with the most
+//packets since prev (since the program was loaded without one), so it follows IRQ affinity changes.
+static inline int rxq_read(int map_fd, int nr_cpus, struct rxq_totals *totals, const struct rxq_totals *prev)
+{
+    struct rxq_stats values[nr_cpus];
+
+    totals->cpu_packets = calloc(MAX_RX_QUEUES * nr_cpus, sizeof(*totals->cpu_packets));
+    if (!totals->cpu_packets)
+    {
+        return -1;
+    }
+    for (__u32 q = 0; q < MAX_RX_QUEUES; q++)
+    {
+        __u64 cpu_max = 0;
+
+        if (bpf_map_lookup_elem(map_fd, &q, values))
+        {
+            free(totals->cpu_packets);
+            totals->cpu_packets = NULL;
+            return -1;
+        }
+        totals->packets[q] = 0;
+        totals->hits[q] = 0;
+        totals->top_cpu[q] = -1;
+        for (int cpu = 0; cpu < nr_cpus; cpu++)
+        {
+            __u64 delta = values[cpu].packets;
+
+            if (prev && prev->cpu_packets)
+            {
+                delta -= prev->cpu_packets[q * nr_cpus + cpu];
+            }
+            totals->cpu_packets[q * nr_cpus + cpu] = values[cpu].packets;
+            totals->packets[q] += values[cpu].packets;
+            totals->hits[q] += values[cpu].hits;
+            if (delta > cpu_max)
+            {
+                cpu_max = delta;
+                totals->top_cpu[q] = cpu;
+            }
+        }
+    }
+    return 0;
+}
+
+//Print the rate of the busiest queue and the skew since the previous report.
+//The skew is the rate of the busiest queue over the mean rate of the queues that have
+//received packets since the program was loaded, 1.00 means the load is evenly spread.
+static inline void rxq_report(int map_fd, int nr_cpus, struct rxq_totals *prev, double interval)
+{
+    struct rxq_totals cur;
+    __u64 total = 0, top_packets = 0;
+    int active = 0, top = -1;
+
+    if (rxq_read(map_fd, nr_cpus, &cur, prev))
+    {
+        return;
+    }
+
+    for (int q = 0; q < MAX_RX_QUEUES; q++)
+    {
+        __u64 delta = cur.packets[q] - prev->packets[q];
+
+        if (!cur.packets[q])
+        {
+            continue;
+        }
+        active++;
+        total += delta;
+        if (top < 0 || delta > top_packets)
+        {
+            top = q;
+            top_packets = delta;
+        }
+    }
+
+    if (!total)
+    {
+        printf("rxq: idle\n");
+    }
+    else
+    {
+        printf("rxq: %d queues %.0f pkt/s, top queue %d (cpu %d) %.0f pkt/s %.0f hit/s %.1f%%, skew %.2f\n",
+               active, total / interval, top, cur.top_cpu[top], top_packets / interval,
+               (cur.hits[top] - prev->hits[top]) / interval, 100.0 * top_packets / total,
+               (double)top_packets * active / total);
+    }
+    free(prev->cpu_packets);
+    *prev = cur;
+}
+#endif
+
+#endif
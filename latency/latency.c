@@ -0,0 +1,205 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Enables, resets and reads the processing time histograms of the responders.
+ * The prefix selects the program: xdns (xdp_dns), xicmp (xdp_icmp) or tcicmp (tc_icmp).
+ *
+ *   ./latency xdns on
+ *   ./latency xdns 5      p50/p99/p999 of the last 5 seconds, repeated
+ *   ./latency xdns        p50/p99/p999 since the histogram was reset
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/limits.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "latency.h"
+
+#define BPF_SYSFS_ROOT "/sys/fs/bpf"
+
+static const char *outcome_names[LATENCY_OUTCOMES] = {
+	[LATENCY_HIT] = "hit",
+	[LATENCY_MISS] = "miss",
+	[LATENCY_PASS] = "pass",
+};
+
+static int nr_cpus = 0;
+
+static int open_map(const char *prefix, const char *suffix)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s_%s", BPF_SYSFS_ROOT, prefix, suffix);
+	fd = bpf_obj_get(path);
+	if (fd < 0)
+		fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+	return fd;
+}
+
+//Sum the per-CPU histograms
+static int read_hist(int map_fd, struct latency_hist *total)
+{
+	struct latency_hist values[nr_cpus];
+	__u32 key = 0;
+
+	memset(total, 0, sizeof(*total));
+	if (bpf_map_lookup_elem(map_fd, &key, values)) {
+		fprintf(stderr, "Error: Failed to read histogram: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (int cpu = 0; cpu < nr_cpus; cpu++)
+		for (int o = 0; o < LATENCY_OUTCOMES; o++)
+			for (int i = 0; i < LATENCY_SLOTS; i++)
+				total->slots[o][i] += values[cpu].slots[o][i];
+
+	return 0;
+}
+
+//Upper bound in ns of the slot holding the given fraction of the packets
+static __u64 percentile(const __u64 *slots, __u64 count, double fraction)
+{
+	__u64 target = count * fraction;
+	__u64 seen = 0;
+
+	for (int i = 0; i < LATENCY_SLOTS; i++) {
+		seen += slots[i];
+		if (seen > target)
+			return 1ULL << (i + 1);
+	}
+	return 1ULL << LATENCY_SLOTS;
+}
+
+static void print_hist(const struct latency_hist *cur, const struct latency_hist *prev)
+{
+	printf("%-6s %12s %10s %10s %10s\n", "", "packets", "p50 ns", "p99 ns", "p999 ns");
+	for (int o = 0; o < LATENCY_OUTCOMES; o++) {
+		__u64 slots[LATENCY_SLOTS];
+		__u64 count = 0;
+
+		for (int i = 0; i < LATENCY_SLOTS; i++) {
+			slots[i] = cur->slots[o][i] - (prev ? prev->slots[o][i] : 0);
+			count += slots[i];
+		}
+
+		if (!count) {
+			printf("%-6s %12d %10s %10s %10s\n", outcome_names[o], 0, "-", "-", "-");
+			continue;
+		}
+		//Values are the upper bound of the log2 slot
+		printf("%-6s %12llu %10llu %10llu %10llu\n", outcome_names[o], count,
+			   percentile(slots, count, 0.5), percentile(slots, count, 0.99),
+			   percentile(slots, count, 0.999));
+	}
+	fflush(stdout);
+}
+
+static int set_enabled(const char *prefix, __u32 enabled)
+{
+	__u32 key = 0;
+	int fd = open_map(prefix, "lat_on");
+
+	if (fd < 0)
+		return 1;
+	if (bpf_map_update_elem(fd, &key, &enabled, BPF_ANY)) {
+		fprintf(stderr, "Error: Failed to update %s_lat_on: %s\n", prefix, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int reset_hist(const char *prefix)
+{
+	struct latency_hist values[nr_cpus];
+	__u32 key = 0;
+	int fd = open_map(prefix, "lat");
+
+	if (fd < 0)
+		return 1;
+	memset(values, 0, sizeof(values));
+	if (bpf_map_update_elem(fd, &key, values, BPF_ANY)) {
+		fprintf(stderr, "Error: Failed to reset %s_lat: %s\n", prefix, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s <xdns|xicmp|tcicmp> [on|off|reset|interval]\n", progname);
+	fprintf(stderr, "  on, off  enable or disable recording in the program\n");
+	fprintf(stderr, "  reset    clear the histograms\n");
+	fprintf(stderr, "  interval print p50/p99/p999 of every <interval> seconds\n");
+	fprintf(stderr, "Without an argument, p50/p99/p999 since the last reset are printed.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct latency_hist prev, cur;
+	const char *prefix;
+	int interval = 0;
+	int fd;
+
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	prefix = argv[1];
+	nr_cpus = libbpf_num_possible_cpus();
+
+	if (argc == 3) {
+		if (strcmp(argv[2], "on") == 0)
+			return set_enabled(prefix, 1);
+		if (strcmp(argv[2], "off") == 0)
+			return set_enabled(prefix, 0);
+		if (strcmp(argv[2], "reset") == 0)
+			return reset_hist(prefix);
+
+		interval = atoi(argv[2]);
+		if (interval <= 0) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	fd = open_map(prefix, "lat");
+	if (fd < 0 || read_hist(fd, &cur))
+		return 1;
+
+	if (!interval) {
+		print_hist(&cur, NULL);
+		return 0;
+	}
+
+	while (1) {
+		prev = cur;
+		sleep(interval);
+		if (read_hist(fd, &cur))
+			return 1;
+		print_hist(&cur, &prev);
+	}
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+tc filter del dev eth0 egress
+tc qdisc del dev eth0 clsact
+pkill tc_dns
+rm /sys/fs/bpf/dns_snoop
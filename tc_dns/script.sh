@@ -0,0 +1,7 @@
+#!/bin/bash
+echo 1 > /proc/sys/kernel/bpf_stats_enabled
+mount -t bpf none /sys/fs/bpf/
+./tc_dns &
+sleep 5
+tc qdisc add dev eth0 clsact
+tc filter add dev eth0 egress bpf object-pinned /sys/fs/bpf/dns_snoop
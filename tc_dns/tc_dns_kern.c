@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#define KBUILD_MODNAME "tc_dns"
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <stddef.h>
+
+#include <bpf_helpers.h>
+#include <bpf_endian.h>
+
+#include "parsing_helpers.h"
+#include "common.h"
+
+/*
+ * Egress classifier that watches the answers of a resolver on this host (UDP source port 53)
+ * and keeps the cacheable A and AAAA RRsets in LRU maps that xdp_dns answers from, so
+ * repeated queries for names outside the zone no longer reach the resolver. Packets are
+ * never modified or dropped. The question name is written to xdns_names, which xdp_dns
+ * compares the question with before answering.
+ */
+
+/* Bytes of a DNS message that are copied for parsing, enough for the question and a full RRset */
+#define SNOOP_MSG_SIZE 768
+
+/* Longest TTL a snooped RRset is kept for, whatever the resolver announced */
+#define SNOOP_MAX_TTL 3600
+
+#define IP_FRAGMENT 0x3fff
+
+/* Answers are kept per (name hash, type) like the zone records, see xdns_snoop_* in
+ * xdp_dns_kern.c. The declarations must match so both programs share the pinned maps.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct dns_key);
+	__type(value, struct a_record);
+	__uint(max_entries, XDNS_SNOOP_ENTRIES);
+	__uint(pinning, 1);
+} xdns_snoop_a SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct dns_key);
+	__type(value, struct aaaa_record);
+	__uint(max_entries, XDNS_SNOOP_ENTRIES);
+	__uint(pinning, 1);
+} xdns_snoop_aaaa SEC(".maps");
+
+/* Names of the records, see xdns_names in xdp_dns_kern.c. xdp_dns sizes it at load time,
+ * tc_dns_user reuses the pinned map instead of creating one from this declaration.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct dns_key);
+	__type(value, struct dns_name);
+	__uint(max_entries, XDNS_ZONE_SLOTS * XDNS_DEFAULT_RECORDS + XDNS_SNOOP_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, 1);
+} xdns_names SEC(".maps");
+
+/* Per-CPU scratch space, the message, the name and the record are too large for the stack */
+struct snoop_scratch {
+	union {
+		struct a_record a;
+		struct aaaa_record aaaa;
+	} rec;
+	struct dns_name name;
+	__u8 msg[SNOOP_MSG_SIZE];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct snoop_scratch);
+	__uint(max_entries, 1);
+} tcdns_scratch SEC(".maps");
+
+static __always_inline __u16 get16(const __u8 *p)
+{
+	return (__u16)p[0] << 8 | p[1];
+}
+
+static __always_inline __u32 get32(const __u8 *p)
+{
+	return (__u32)p[0] << 24 | (__u32)p[1] << 16 | (__u32)p[2] << 8 | p[3];
+}
+
+/* Hash and check the question name of the message the way xdp_dns parses queries:
+ * lowercase, zero padded, word by word. The name is copied the same way to s->name.
+ * Returns the length of the name including its terminating zero octet, or -1.
+ */
+static __always_inline int snoop_name(struct snoop_scratch *s, int len, uint64_t *name_hash,
+				      uint64_t *name_check)
+{
+	uint64_t hash = DNS_NAME_HASH_SEED;
+	uint64_t check = DNS_NAME_CHECK_SEED;
+	uint64_t word = 0;
+	int i;
+
+	__builtin_memset(s->name.name, 0, sizeof(s->name.name));
+	for (i = 0; i < MAX_DNS_NAME_LENGTH; i++) {
+		int idx = sizeof(struct dns_hdr) + i;
+
+		if (idx >= len)
+			return -1;
+
+		__u8 c = s->msg[idx];
+		if (c == 0) {
+			*name_hash = dns_name_hash_word(hash, word);
+			*name_check = dns_name_check_word(check, word);
+			return i + 1;
+		}
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+		s->name.name[i] = c;
+		word |= (uint64_t)c << ((i & 7) * 8);
+		if ((i & 7) == 7) {
+			hash = dns_name_hash_word(hash, word);
+			check = dns_name_check_word(check, word);
+			word = 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Copy the answer section into the record of the queried type. Every answer must belong to
+ * the question name (compressed owner pointing at offset 12) and carry the queried type, so
+ * CNAME chains and anything else the record cannot hold are left alone.
+ * Returns the lowest TTL of the RRset, or 0 when the answer is not taken.
+ */
+static __always_inline __u32 snoop_answers(struct snoop_scratch *s, int len, int off,
+					   __u16 ans_count, __u16 qtype)
+{
+	__u16 rdlen = qtype == A_RECORD_TYPE ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+	__u32 ttl = SNOOP_MAX_TTL;
+	int i;
+
+	for (i = 0; i < MAX_RRSET_SIZE; i++) {
+		if (i >= ans_count)
+			break;
+
+		/* Bound the offset for the verifier, then check it against the copied length */
+		if (off < 0 || off > SNOOP_MSG_SIZE - 12 - sizeof(struct in6_addr))
+			return 0;
+		if (off + 12 + rdlen > len)
+			return 0;
+
+		__u8 *rr = &s->msg[off];
+		if (get16(rr) != 0xc00c || get16(rr + 2) != qtype || get16(rr + 4) != DNS_CLASS_IN ||
+		    get16(rr + 10) != rdlen)
+			return 0;
+
+		__u32 rr_ttl = get32(rr + 6);
+		if (rr_ttl < ttl)
+			ttl = rr_ttl;
+
+		if (qtype == A_RECORD_TYPE)
+			__builtin_memcpy(&s->rec.a.ip_addr[i], rr + 12, sizeof(struct in_addr));
+		else
+			__builtin_memcpy(&s->rec.aaaa.ip_addr[i], rr + 12, sizeof(struct in6_addr));
+
+		off += 12 + rdlen;
+	}
+
+	return ttl;
+}
+
+SEC("classifier")
+int dns_snoop(struct __sk_buff *skb)
+{
+	void *data_end = (void *)(long)skb->data_end;
+	void *data = (void *)(long)skb->data;
+	struct hdr_cursor nh = { .pos = data, .off = 0 };
+	struct ethhdr *eth;
+	struct iphdr *ip;
+	struct ipv6hdr *ip6;
+	struct udphdr *udp;
+	int protocol;
+	int len;
+
+	int eth_proto = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_proto == bpf_htons(ETH_P_IP)) {
+		protocol = parse_iphdr(&nh, data_end, &ip);
+		/* Only whole datagrams can be parsed */
+		if (protocol >= 0 && (ip->frag_off & bpf_htons(IP_FRAGMENT)))
+			return TC_ACT_OK;
+	} else if (eth_proto == bpf_htons(ETH_P_IPV6)) {
+		protocol = parse_ip6hdr(&nh, data_end, &ip6);
+	} else {
+		return TC_ACT_OK;
+	}
+
+	if (protocol != IPPROTO_UDP)
+		return TC_ACT_OK;
+	len = parse_udphdr(&nh, data_end, &udp);
+	if (len < 0 || udp->source != bpf_htons(53))
+		return TC_ACT_OK;
+
+	__u32 zero = 0;
+	struct snoop_scratch *s = bpf_map_lookup_elem(&tcdns_scratch, &zero);
+	if (!s)
+		return TC_ACT_OK;
+
+	/* The payload may sit in the paged part of the skb, copy it out in one go */
+	if (len > SNOOP_MSG_SIZE)
+		len = SNOOP_MSG_SIZE;
+	if (len < sizeof(struct dns_hdr) + 5)
+		return TC_ACT_OK;
+	if (bpf_skb_load_bytes(skb, nh.off, s->msg, len) < 0)
+		return TC_ACT_OK;
+
+	/* A complete, successful answer to a single standard query */
+	struct dns_hdr *hdr = (struct dns_hdr *)s->msg;
+	__u16 ans_count = bpf_ntohs(hdr->ans_count);
+	if (hdr->qr != 1 || hdr->opcode != 0 || hdr->rcode != 0 || hdr->tc ||
+	    bpf_ntohs(hdr->q_count) != 1 || ans_count < 1 || ans_count > MAX_RRSET_SIZE)
+		return TC_ACT_OK;
+
+	struct dns_key key = {0};
+	uint64_t name_check;
+	int name_len = snoop_name(s, len, &key.name_hash, &name_check);
+	if (name_len < 1)
+		return TC_ACT_OK;
+
+	int off = sizeof(struct dns_hdr) + name_len;
+	if (off > SNOOP_MSG_SIZE - 4 || off + 4 > len)
+		return TC_ACT_OK;
+	__u16 qtype = get16(&s->msg[off]);
+	if ((qtype != A_RECORD_TYPE && qtype != AAAA_RECORD_TYPE) || get16(&s->msg[off + 2]) != DNS_CLASS_IN)
+		return TC_ACT_OK;
+
+	__u32 ttl = snoop_answers(s, len, off + 4, ans_count, qtype);
+	if (ttl == 0)
+		return TC_ACT_OK;
+
+	/* The name goes in first, xdp_dns does not answer the record without it */
+	s->name.name_check = name_check;
+	if (bpf_map_update_elem(&xdns_names, &key, &s->name, BPF_ANY))
+		return TC_ACT_OK;
+
+	key.record_type = qtype;
+	key.class = DNS_CLASS_IN;
+
+	/* The record expires with the TTL, xdp_dns counts the TTL of its answers down to it */
+	__u64 expires = bpf_ktime_get_boot_ns() + (__u64)ttl * 1000000000ULL;
+	if (qtype == A_RECORD_TYPE) {
+		s->rec.a.ttl = ttl;
+		s->rec.a.count = ans_count;
+		s->rec.a.flags = 0;
+		s->rec.a.expires = expires;
+		s->rec.a.name_check = name_check;
+		bpf_map_update_elem(&xdns_snoop_a, &key, &s->rec.a, BPF_ANY);
+	} else {
+		s->rec.aaaa.ttl = ttl;
+		s->rec.aaaa.count = ans_count;
+		s->rec.aaaa.flags = 0;
+		s->rec.aaaa.expires = expires;
+		s->rec.aaaa.name_check = name_check;
+		bpf_map_update_elem(&xdns_snoop_aaaa, &key, &s->rec.aaaa, BPF_ANY);
+	}
+
+	return TC_ACT_OK;
+}
+
+char __license[] SEC("license") = "GPL";
@@ -0,0 +1,152 @@
+/*
+ *  Software Name : bmc-cache
+ *  SPDX-FileCopyrightText: Copyright (c) 2021 Orange
+ *  SPDX-License-Identifier: LGPL-2.1-only
+ *
+ *  This software is distributed under the
+ *  GNU Lesser General Public License v2.1 only.
+ *
+ *  Author: Yoann GHIGOFF <yoann.ghigoff@orange.com> et al.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <linux/if_link.h>
+#include <linux/limits.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#define BPF_SYSFS_ROOT "/sys/fs/bpf"
+
+static int print_bpf_verifier(enum libbpf_print_level level,
+							const char *format, va_list args)
+{
+	return vfprintf(stdout, format, args);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	struct bpf_program *prog;
+	struct bpf_object *obj;
+	char filename[PATH_MAX];
+	int err;
+	int ret = 0;
+
+	snprintf(filename, sizeof(filename), "%s_kern.o", argv[0]);
+
+	sigset_t signal_mask;
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	sigaddset(&signal_mask, SIGUSR1);
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		perror("setrlimit failed");
+		return 1;
+	}
+	libbpf_set_print(print_bpf_verifier);
+
+	obj = bpf_object__open(filename);
+	if (!obj) {
+		fprintf(stderr, "Error: bpf_object__open failed\n");
+		return 1;
+	}
+
+	/* xdns_names is sized by xdp_dns, share its map rather than pinning one of our own */
+	int names_fd = bpf_obj_get(BPF_SYSFS_ROOT "/xdns_names");
+	if (names_fd < 0) {
+		fprintf(stderr, "Error: Failed to open %s/xdns_names, start xdp_dns first\n", BPF_SYSFS_ROOT);
+		return 1;
+	}
+	struct bpf_map *names = bpf_object__find_map_by_name(obj, "xdns_names");
+	if (!names || bpf_map__reuse_fd(names, names_fd)) {
+		fprintf(stderr, "Error: Failed to reuse xdns_names\n");
+		return 1;
+	}
+	close(names_fd);
+
+	err = bpf_object__load(obj);
+	if (err) {
+		fprintf(stderr, "Error: bpf_object__load failed\n");
+		return 1;
+	}
+
+	prog = bpf_object__find_program_by_name(obj, "dns_snoop");
+	if (!prog) {
+		fprintf(stderr, "Error: bpf_object__find_program_by_name failed\n");
+		return 1;
+	}
+
+	int len = snprintf(filename, PATH_MAX, "%s/%s", BPF_SYSFS_ROOT, "dns_snoop");
+	if (len < 0) {
+		fprintf(stderr, "Error: Program name '%s' is invalid\n", "dns_snoop");
+		return -1;
+	} else if (len >= PATH_MAX) {
+		fprintf(stderr, "Error: Program name '%s' is too long\n", "dns_snoop");
+		return -1;
+	}
+retry:
+	if (bpf_program__pin(prog, filename)) {
+		fprintf(stderr, "Error: Failed to pin program '%s' to path %s\n", "dns_snoop", filename);
+		if (errno == EEXIST) {
+			fprintf(stdout, "BPF program '%s' already pinned, unpinning it to reload it\n", "dns_snoop");
+			if (bpf_program__unpin(prog, filename)) {
+				fprintf(stderr, "Error: Fail to unpin program '%s' at %s\n", "dns_snoop", filename);
+				return -1;
+			}
+			goto retry;
+		}
+		return -1;
+	}
+
+	int sig, quit = 0;
+	FILE *fp = NULL;
+
+	err = sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+	if (err != 0) {
+		fprintf(stderr, "Error: Failed to set signal mask\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (!quit) {
+		err = sigwait(&signal_mask, &sig);
+		if (err != 0) {
+			fprintf(stderr, "Error: Failed to wait for signal\n");
+			exit(EXIT_FAILURE);
+		}
+
+		switch (sig) {
+			case SIGINT:
+			case SIGTERM:
+				quit = 1;
+				break;
+
+			case SIGALRM:
+				if (fp != NULL) {
+					fclose(fp);
+				}
+				quit = 1;
+				break;
+
+			case SIGUSR1:
+				quit = ret;
+				break;
+
+			default:
+				fprintf(stderr, "Unknown signal\n");
+				break;
+		}
+	}
+
+	return ret;
+}
@@ -8,6 +8,7 @@
 #include <stddef.h>
 
 #include "bpf_helpers.h"
+#include "latency.h"
 
 /* compiler workaround */
 #define bpf_htonl __builtin_bswap32
@@ -22,8 +23,24 @@
 #define ICMP_TYPE_OFF (ETH_HLEN + sizeof(struct iphdr) + offsetof(struct icmphdr, type))
 #define ICMP_CSUM_SIZE sizeof(__u16)
 
-SEC("classifier")
-int icmp_serv(struct __sk_buff *skb)
+/* Processing time histograms, recorded while tcicmp_lat_on is set (see the latency tool) */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct latency_hist);
+	__uint(max_entries, 1);
+	__uint(pinning, 1);
+} tcicmp_lat SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, 1);
+	__uint(pinning, 1);
+} tcicmp_lat_on SEC(".maps");
+
+static __always_inline int process_packet(struct __sk_buff *skb)
 {
 	/* We will access all data through pointers to structs */
 	void *data = (void *)(long)skb->data;
@@ -95,4 +112,15 @@ int icmp_serv(struct __sk_buff *skb)
 	return TC_ACT_SHOT;
 }
 
+SEC("classifier")
+int icmp_serv(struct __sk_buff *skb)
+{
+	__u64 start = latency_start(&tcicmp_lat_on);
+	int action = process_packet(skb);
+
+	/* Echo requests are answered, everything else is passed on */
+	latency_record(&tcicmp_lat, start, action == TC_ACT_SHOT ? LATENCY_HIT : LATENCY_PASS);
+	return action;
+}
+
 char __license[] SEC("license") = "GPL";
\ No newline at end of file
@@ -1,7 +1,15 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef XDP_DNS_COMMON_H
+#define XDP_DNS_COMMON_H
 
 #define A_RECORD_TYPE 0x0001
+#define NS_RECORD_TYPE 2
+#define CNAME_RECORD_TYPE 5
+#define PTR_RECORD_TYPE 12
+#define MX_RECORD_TYPE 15
+#define TXT_RECORD_TYPE 16
 #define AAAA_RECORD_TYPE 28
+#define SRV_RECORD_TYPE 33
 #define DNS_CLASS_IN 0x0001
 //RFC1034: the total number of octets that represent a domain name is limited to 255.
 //We need to be aligned so the struct does not include padding bytes. We'll set the length to 256.
@@ -37,10 +45,51 @@ struct ar_hdr {
 } __attribute__((packed));
 #endif
 
-//Used as key in our hashmap
+//Seed of the 64-bit name hash, see dns_name_hash_word
+#define DNS_NAME_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+//Fold one word of a wire-format name into the running name hash.
+//A name is hashed as little-endian 64-bit words of the zero-padded name, up to and including
+//the word that holds the terminating zero octet. The kernel and xdp_dns_update must agree on this.
+static inline uint64_t dns_name_hash_word(uint64_t hash, uint64_t word)
+{
+    hash ^= word;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+//Seed of the 64-bit name check, see dns_name_check_word
+#define DNS_NAME_CHECK_SEED 0x6a09e667f3bcc909ULL
+
+//Fold one word of a wire-format name into the running name check. It covers the same words as
+//dns_name_hash_word with another seed and multiplier, so names whose hashes collide still have
+//different checks. Records keep the check of their name, xdns_names keeps the name itself.
+static inline uint64_t dns_name_check_word(uint64_t check, uint64_t word)
+{
+    check ^= word;
+    check *= 0xc4ceb9fe1a85ec53ULL;
+    check ^= check >> 29;
+    return check;
+}
+
+//Used as key in our hashmaps. Only the hash of the name is stored in the key,
+//the value holds the name check, which is compared on a hit.
+struct dns_key {
+    uint64_t name_hash;
+    uint16_t record_type;
+    uint16_t class;
+    uint32_t pad;       //Explicit padding, must be zero
+};
+
+//Parsed DNS query. name is 8-byte aligned so it can be hashed and compared word by word.
 struct dns_query {
+    uint64_t name_hash;
+    uint64_t name_check;
     uint16_t record_type;
     uint16_t class;
+    uint16_t name_len;  //Length of the wire-format name, including the terminating zero octet
+    uint16_t pad;
     char name[MAX_DNS_NAME_LENGTH];
 };
 
@@ -53,14 +102,160 @@ struct dns_response {
    uint16_t data_length;
 } __attribute__((packed));
 
-//Used as value of our A record hashmap
+//Maximum number of addresses in an A or AAAA RRset. Must be a power of two.
+#define MAX_RRSET_SIZE 8
+
+//Flag of the RRsets written from a file by load, swap, sync or xdp_dns_zone. sync only deletes
+//RRsets that carry it, the ones added at runtime (add, serve, xdp_dns_fill) are left alone.
+#define XDNS_RECORD_FILE 0x1
+
+//Flag of the RRsets whose expiry was given as +seconds. The deadline depends on when the file
+//was read, so sync keeps the one in the map instead of rewriting an otherwise unchanged RRset.
+#define XDNS_RECORD_RELATIVE 0x2
+
+//Used as value of our A record hashmap.
+//Holds the whole RRset of a name, all addresses share one TTL.
 struct a_record {
-    struct in_addr ip_addr;
     uint32_t ttl;
+    uint16_t count;     //Number of valid entries in ip_addr
+    uint16_t flags;     //XDNS_RECORD_*, never read by the kernel
+    uint64_t expires;   //CLOCK_BOOTTIME ns from which the RRset is not answered, 0 for never
+    uint64_t name_check;
+    struct in_addr ip_addr[MAX_RRSET_SIZE];
 };
 
 //Used as value of our AAAA record hashmap
 struct aaaa_record {
-    struct in6_addr ip_addr;
     uint32_t ttl;
-};
\ No newline at end of file
+    uint16_t count;     //Number of valid entries in ip_addr
+    uint16_t flags;     //See a_record
+    uint64_t expires;   //See a_record
+    uint64_t name_check;
+    struct in6_addr ip_addr[MAX_RRSET_SIZE];
+};
+
+//Maximum number of CNAMEs followed in the kernel before a query is passed on
+#define MAX_CNAME_DEPTH 4
+
+//Number of zones the record maps are double buffered in, a power of two (see xdp_dns_kern.c)
+#define XDNS_ZONE_SLOTS 2
+
+//Entries of every record map unless xdp_dns -n says otherwise
+#define XDNS_DEFAULT_RECORDS 65536
+
+//Entries of each of the LRU maps tc_dns fills with the answers of a resolver on this host
+//(xdns_snoop_a, xdns_snoop_aaaa). Both programs declare the maps, so they must agree on it.
+#define XDNS_SNOOP_ENTRIES 16384
+
+//Maximum size of the pre-serialized answer section of a generic record. Must be a multiple of 8.
+#define MAX_RR_DATA_LENGTH 384
+
+//Used as value of the generic record hashmap, for every type without a map of its own.
+//data holds the answer section for the name in wire format, ready to be copied into the
+//response: ans_count RRs whose owner name is a compression pointer to the question (0xc00c).
+//For a CNAME, target_hash and target_check are the name hash and check of the canonical name,
+//so the chain can be followed and verified without parsing the RDATA.
+struct rr_record {
+    uint16_t ans_count;
+    uint16_t data_length;
+    uint16_t flags;     //See a_record
+    uint16_t pad;
+    uint64_t target_hash;
+    uint64_t target_check;
+    uint64_t expires;   //See a_record, answers carry at most the time left as TTL
+    uint64_t name_check;
+    char data[MAX_RR_DATA_LENGTH];
+};
+
+//Value of xdns_names, the names of the records. Keyed like the records with record_type and
+//class zero, so every name is kept once whatever the types it holds. Written by the userspace
+//tools and tc_dns. xdp_dns compares the question with it before answering, the hash and the
+//check can be matched by a crafted name, the name itself cannot.
+struct dns_name {
+    uint64_t name_check;
+    char name[MAX_DNS_NAME_LENGTH];
+};
+
+//Decisions taken by xdp_dns, counted per CPU in the xdns_stats map
+enum xdns_stat {
+    XDNS_STAT_NON_IP,           //Not IPv4/IPv6 (or more VLAN tags than parsed)
+    XDNS_STAT_NON_UDP,          //Not UDP, or IPv6 with extension headers
+    XDNS_STAT_WRONG_PORT,       //UDP, but not to port 53
+    XDNS_STAT_NOT_QUERY,        //Not a standard query
+    XDNS_STAT_PARSE_FAIL,       //Malformed or truncated question
+    XDNS_STAT_ANSWER_FAIL,      //Record found, but the answer could not be built
+    XDNS_STAT_ADJUST_TAIL_FAIL, //bpf_xdp_adjust_tail failed
+    XDNS_STAT_TX,               //Answered with XDP_TX
+    XDNS_STAT_EXPIRED,          //Record found, but past its expiry (also counted as a miss)
+    XDNS_STAT_SNOOPED,          //Answered from a snooped resolver answer (also counted as a hit)
+    XDNS_STAT_TRUNCATED,        //Answers beyond 512 bytes, sent empty with TC set (also counted as a hit)
+    XDNS_STAT_NAME_MISMATCH,    //Records found, but the question is not their name (also counted as a miss)
+    XDNS_STAT_MAX
+};
+
+//Query types with their own hit and miss counters, all other types are counted as other
+enum xdns_qtype {
+    XDNS_QTYPE_A,
+    XDNS_QTYPE_NS,
+    XDNS_QTYPE_CNAME,
+    XDNS_QTYPE_PTR,
+    XDNS_QTYPE_MX,
+    XDNS_QTYPE_TXT,
+    XDNS_QTYPE_AAAA,
+    XDNS_QTYPE_SRV,
+    XDNS_QTYPE_OTHER,
+    XDNS_QTYPE_MAX
+};
+
+//Value of the per-CPU xdns_stats map. Only ever incremented, readers compute rates from deltas.
+struct xdns_stats {
+    uint64_t counters[XDNS_STAT_MAX];
+    uint64_t hit[XDNS_QTYPE_MAX];
+    uint64_t miss[XDNS_QTYPE_MAX];
+};
+
+static inline uint32_t xdns_qtype_index(uint16_t record_type)
+{
+    switch (record_type)
+    {
+    case A_RECORD_TYPE:
+        return XDNS_QTYPE_A;
+    case NS_RECORD_TYPE:
+        return XDNS_QTYPE_NS;
+    case CNAME_RECORD_TYPE:
+        return XDNS_QTYPE_CNAME;
+    case PTR_RECORD_TYPE:
+        return XDNS_QTYPE_PTR;
+    case MX_RECORD_TYPE:
+        return XDNS_QTYPE_MX;
+    case TXT_RECORD_TYPE:
+        return XDNS_QTYPE_TXT;
+    case AAAA_RECORD_TYPE:
+        return XDNS_QTYPE_AAAA;
+    case SRV_RECORD_TYPE:
+        return XDNS_QTYPE_SRV;
+    default:
+        return XDNS_QTYPE_OTHER;
+    }
+}
+
+//Runtime options of xdp_dns, the single value of the xdns_config map
+struct xdns_config {
+    //Send one in sample_rate parsed queries to xdns_events, 0 disables sampling
+    uint32_t sample_rate;
+    uint32_t pad;
+};
+
+//Sampled query sent through the xdns_events ring buffer
+struct xdns_event {
+    uint64_t timestamp;   //bpf_ktime_get_ns() when the query was parsed
+    uint8_t client[16];   //Client address, an IPv4 address takes the first 4 bytes
+    uint16_t record_type;
+    uint8_t family;       //4 or 6
+    uint8_t outcome;      //enum latency_outcome: hit, miss or pass
+    uint16_t name_len;    //Length of name including the terminating zero octet
+    uint16_t pad;
+    char name[MAX_DNS_NAME_LENGTH]; //Query name in wire format, lowercase
+};
+
+#endif
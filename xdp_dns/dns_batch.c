@@ -0,0 +1,977 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include "common.h"
+#include "dns_util.h"
+#include "dns_batch.h"
+
+#define INDEX_SIZE (DNS_BATCH_MAPS * DNS_BATCH_SIZE * 2)
+
+//Returned by kernels that do not implement batch operations for a map type
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+static uint64_t key_mix(const struct dns_key *key)
+{
+    uint64_t h = key->name_hash ^ ((uint64_t)key->record_type << 48) ^ key->class;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+struct dns_batch *dns_batch_new(int a_records_fd, int aaaa_records_fd, int rr_records_fd)
+{
+    struct dns_batch *b = calloc(1, sizeof(*b));
+    int fds[DNS_BATCH_MAPS] = {a_records_fd, aaaa_records_fd, rr_records_fd};
+    size_t sizes[DNS_BATCH_MAPS] = {sizeof(struct a_record), sizeof(struct aaaa_record), sizeof(struct rr_record)};
+    size_t check_offsets[DNS_BATCH_MAPS] = {offsetof(struct a_record, name_check),
+                                            offsetof(struct aaaa_record, name_check),
+                                            offsetof(struct rr_record, name_check)};
+    size_t flags_offsets[DNS_BATCH_MAPS] = {offsetof(struct a_record, flags), offsetof(struct aaaa_record, flags),
+                                            offsetof(struct rr_record, flags)};
+    int i;
+
+    if (!b)
+    {
+        return NULL;
+    }
+
+    b->names_fd = dns_names_open();
+    b->names = calloc(DNS_BATCH_MAPS * DNS_BATCH_SIZE, sizeof(*b->names));
+    if (!b->names)
+    {
+        dns_batch_free(b);
+        return NULL;
+    }
+    for (i = 0; i < DNS_BATCH_MAPS; i++)
+    {
+        b->maps[i].fd = fds[i];
+        b->maps[i].value_size = sizes[i];
+        b->maps[i].check_offset = check_offsets[i];
+        b->maps[i].flags_offset = flags_offsets[i];
+        b->maps[i].values = calloc(DNS_BATCH_SIZE, sizes[i]);
+        if (!b->maps[i].values)
+        {
+            dns_batch_free(b);
+            return NULL;
+        }
+    }
+
+    return b;
+}
+
+void dns_batch_free(struct dns_batch *b)
+{
+    int i;
+
+    if (!b)
+    {
+        return;
+    }
+    for (i = 0; i < DNS_BATCH_MAPS; i++)
+    {
+        free(b->maps[i].values);
+    }
+    if (b->names_fd >= 0)
+    {
+        close(b->names_fd);
+    }
+    free(b->names);
+    free(b->written);
+    free(b);
+}
+
+static int written_insert(uint64_t *table, size_t size, uint64_t h)
+{
+    size_t i = h & (size - 1);
+
+    while (table[i] && table[i] != h)
+    {
+        i = (i + 1) & (size - 1);
+    }
+    if (table[i])
+    {
+        return 0;
+    }
+    table[i] = h;
+    return 1;
+}
+
+static int written_contains(struct dns_batch *b, uint64_t h)
+{
+    size_t i;
+
+    if (!b->written)
+    {
+        return 0;
+    }
+    for (i = h & (b->written_size - 1); b->written[i]; i = (i + 1) & (b->written_size - 1))
+    {
+        if (b->written[i] == h)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Remember a written key, the table is kept at most half full
+static int written_add(struct dns_batch *b, uint64_t h)
+{
+    if ((b->written_count + 1) * 2 > b->written_size)
+    {
+        size_t size = b->written_size ? b->written_size * 2 : 65536;
+        uint64_t *table = calloc(size, sizeof(*table));
+        size_t i;
+
+        if (!table)
+        {
+            return -ENOMEM;
+        }
+        for (i = 0; i < b->written_size; i++)
+        {
+            if (b->written[i])
+            {
+                written_insert(table, size, b->written[i]);
+            }
+        }
+        free(b->written);
+        b->written = table;
+        b->written_size = size;
+    }
+
+    b->written_count += written_insert(b->written, b->written_size, h);
+    return 0;
+}
+
+struct dns_table *dns_table_new(size_t value_size)
+{
+    struct dns_table *t = calloc(1, sizeof(*t));
+
+    if (!t)
+    {
+        return NULL;
+    }
+    t->value_size = value_size;
+    return t;
+}
+
+void dns_table_free(struct dns_table *t)
+{
+    if (!t)
+    {
+        return;
+    }
+    free(t->keys);
+    free(t->values);
+    free(t->flags);
+    free(t);
+}
+
+static size_t table_slot(const struct dns_table *t, const struct dns_key *key)
+{
+    size_t i = key_mix(key) & (t->size - 1);
+
+    while (t->flags[i] && memcmp(&t->keys[i], key, sizeof(*key)) != 0)
+    {
+        i = (i + 1) & (t->size - 1);
+    }
+    return i;
+}
+
+//Return the value of key and its flags, or NULL
+char *dns_table_lookup(struct dns_table *t, const struct dns_key *key, uint8_t **flags)
+{
+    size_t i;
+
+    if (t->count == 0)
+    {
+        return NULL;
+    }
+    i = table_slot(t, key);
+    if (!t->flags[i])
+    {
+        return NULL;
+    }
+    if (flags)
+    {
+        *flags = &t->flags[i];
+    }
+    return t->values + i * t->value_size;
+}
+
+//Set the value of key, the table is kept at most half full
+int dns_table_put(struct dns_table *t, const struct dns_key *key, const void *value)
+{
+    size_t i;
+
+    if ((t->count + 1) * 2 > t->size)
+    {
+        struct dns_table grown = *t;
+        size_t j;
+
+        grown.size = t->size ? t->size * 2 : 4096;
+        grown.count = 0;
+        grown.keys = malloc(grown.size * sizeof(*grown.keys));
+        grown.values = malloc(grown.size * t->value_size);
+        grown.flags = calloc(grown.size, 1);
+        if (!grown.keys || !grown.values || !grown.flags)
+        {
+            free(grown.keys);
+            free(grown.values);
+            free(grown.flags);
+            return -ENOMEM;
+        }
+        for (j = 0; j < t->size; j++)
+        {
+            if (t->flags[j])
+            {
+                i = table_slot(&grown, &t->keys[j]);
+                grown.keys[i] = t->keys[j];
+                memcpy(grown.values + i * t->value_size, t->values + j * t->value_size, t->value_size);
+                grown.flags[i] = t->flags[j];
+                grown.count++;
+            }
+        }
+        free(t->keys);
+        free(t->values);
+        free(t->flags);
+        *t = grown;
+    }
+
+    i = table_slot(t, key);
+    if (!t->flags[i])
+    {
+        t->keys[i] = *key;
+        t->flags[i] = DNS_TABLE_USED;
+        t->count++;
+    }
+    memcpy(t->values + i * t->value_size, value, t->value_size);
+    return 0;
+}
+
+//Read the current RRset of key into value, from the table or the map. Returns 0 if there is one.
+static int read_back(struct dns_batch *b, int map, const struct dns_key *key, char *value)
+{
+    struct dns_batch_map *m = &b->maps[map];
+    const char *found;
+
+    if (b->tables[map])
+    {
+        found = dns_table_lookup(b->tables[map], key, NULL);
+        if (!found)
+        {
+            return -1;
+        }
+        memcpy(value, found, m->value_size);
+        return 0;
+    }
+    if (!b->merge && !written_contains(b, key_mix(key)))
+    {
+        return -1;
+    }
+    return bpf_map_lookup_elem(m->fd, key, value);
+}
+
+//Return the staged value of key, staging a new one if needed. The new value is read back from
+//the tables, from the map in merge mode or if the key was written earlier in this load, and
+//zeroed with the name check set otherwise. A different name under the same key is an error,
+//in the map as well: a load replaces the RRsets of its own names only. Outside merge mode the
+//RRset comes from a file and is flagged XDNS_RECORD_FILE. The name of a newly staged RRset is
+//staged for xdns_names.
+static char *stage_value(struct dns_batch *b, int map, const struct dns_key *key, const char *dns_name,
+                         uint64_t name_check, int *err)
+{
+    struct dns_batch_map *m = &b->maps[map];
+    uint64_t h = key_mix(key);
+    size_t i = h & (INDEX_SIZE - 1);
+    char *value;
+    uint64_t check;
+
+    for (; b->index[i]; i = (i + 1) & (INDEX_SIZE - 1))
+    {
+        uint32_t entry = b->index[i];
+        uint32_t slot = (entry & 0xffff) - 1;
+
+        if ((int)(entry >> 16) == map && memcmp(&m->keys[slot], key, sizeof(*key)) == 0)
+        {
+            value = m->values + slot * m->value_size;
+            memcpy(&check, value + m->check_offset, sizeof(check));
+            if (check != name_check)
+            {
+                *err = -EEXIST;
+                return NULL;
+            }
+            return value;
+        }
+    }
+
+    if (m->count == DNS_BATCH_SIZE)
+    {
+        *err = dns_batch_flush(b);
+        if (*err)
+        {
+            return NULL;
+        }
+        return stage_value(b, map, key, dns_name, name_check, err);
+    }
+
+    value = m->values + m->count * m->value_size;
+    if (read_back(b, map, key, value) != 0)
+    {
+        //The tables of a sync hold the whole file, a load checks what the map holds under the key
+        if (!b->merge && !b->tables[map] && bpf_map_lookup_elem(m->fd, key, value) == 0 &&
+            (memcpy(&check, value + m->check_offset, sizeof(check)), check != name_check))
+        {
+            *err = -EEXIST;
+            return NULL;
+        }
+        memset(value, 0, m->value_size);
+        memcpy(value + m->check_offset, &name_check, sizeof(name_check));
+    }
+    else if (memcpy(&check, value + m->check_offset, sizeof(check)), check != name_check)
+    {
+        *err = -EEXIST;
+        return NULL;
+    }
+    if (!b->merge)
+    {
+        uint16_t flags;
+
+        memcpy(&flags, value + m->flags_offset, sizeof(flags));
+        flags |= XDNS_RECORD_FILE;
+        memcpy(value + m->flags_offset, &flags, sizeof(flags));
+    }
+    m->keys[m->count] = *key;
+    b->index[i] = (uint32_t)map << 16 | ++m->count;
+
+    if (b->names_fd >= 0)
+    {
+        dns_names_entry(dns_name, &b->name_keys[b->name_count], &b->names[b->name_count]);
+        b->name_count++;
+    }
+    return value;
+}
+
+//One record in binary form
+struct batch_record {
+    int map;
+    struct in_addr ip_addr;
+    struct in6_addr ip6_addr;
+    char rdata[MAX_RR_DATA_LENGTH];
+    int rdata_len;
+};
+
+//Parse the value of a record and stage the RRset it belongs to
+static char *stage_record(struct dns_batch *b, uint16_t type, const char *name, const char *value,
+                          struct batch_record *r, int *err)
+{
+    char dns_name[MAX_DNS_NAME_LENGTH];
+    struct dns_key key;
+
+    *err = -EINVAL;
+    if (strnlen(name, DNS_NAME_TEXT_LENGTH) >= DNS_NAME_TEXT_LENGTH)
+    {
+        return NULL;
+    }
+
+    if (type == A_RECORD_TYPE)
+    {
+        r->map = DNS_BATCH_A;
+        if (inet_aton(value, &r->ip_addr) == 0)
+        {
+            return NULL;
+        }
+    }
+    else if (type == AAAA_RECORD_TYPE)
+    {
+        r->map = DNS_BATCH_AAAA;
+        if (inet_pton(AF_INET6, value, &r->ip6_addr) != 1)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        r->map = DNS_BATCH_RR;
+        r->rdata_len = rr_rdata_from_text(type, value, r->rdata, sizeof(r->rdata));
+        if (r->rdata_len < 0)
+        {
+            return NULL;
+        }
+    }
+
+    memset(dns_name, 0, sizeof(dns_name));
+    if (replace_dots_with_length_octets((char *)name, dns_name) < 0)
+    {
+        return NULL;
+    }
+    dns_name_tolower(dns_name);
+
+    memset(&key, 0, sizeof(key));
+    key.name_hash = dns_name_hash(dns_name);
+    key.record_type = type;
+    key.class = DNS_CLASS_IN;
+
+    *err = 0;
+    return stage_value(b, r->map, &key, dns_name, dns_name_check(dns_name), err);
+}
+
+//Stage one record, in the presentation format of xdp_dns_update add. expires (CLOCK_BOOTTIME ns,
+//0 for never) applies to the whole RRset, the record staged last sets it.
+//Returns 0, or -EINVAL for an invalid record, -ENOSPC if the RRset is full,
+//-EEXIST if the name hash collides with another staged name or a name in the map, or the error
+//of a flush.
+int dns_batch_add(struct dns_batch *b, uint16_t type, const char *name, const char *value, uint32_t ttl,
+                  uint64_t expires, uint16_t flags)
+{
+    struct batch_record r;
+    char *staged;
+    uint16_t record_flags;
+    int err;
+
+    staged = stage_record(b, type, name, value, &r, &err);
+    if (!staged)
+    {
+        return err;
+    }
+
+    switch (r.map)
+    {
+    case DNS_BATCH_A:
+        err = a_rrset_add((struct a_record *)staged, r.ip_addr, ttl);
+        ((struct a_record *)staged)->expires = expires;
+        break;
+    case DNS_BATCH_AAAA:
+        err = aaaa_rrset_add((struct aaaa_record *)staged, r.ip6_addr, ttl);
+        ((struct aaaa_record *)staged)->expires = expires;
+        break;
+    default:
+    {
+        struct rr_record *rr = (struct rr_record *)staged;
+        //A name has a single CNAME, a later one replaces the previous target
+        if (type == CNAME_RECORD_TYPE)
+        {
+            uint64_t name_check = rr->name_check;
+            uint16_t flags = rr->flags;
+            memset(rr, 0, sizeof(*rr));
+            rr->name_check = name_check;
+            rr->flags = flags;
+        }
+        err = rr_record_add(rr, type, r.rdata, r.rdata_len, ttl);
+        rr->expires = expires;
+        break;
+    }
+    }
+    if (err)
+    {
+        return -ENOSPC;
+    }
+
+    //The RRset takes the expiry of the record added last, and with it XDNS_RECORD_RELATIVE
+    memcpy(&record_flags, staged + b->maps[r.map].flags_offset, sizeof(record_flags));
+    record_flags = (record_flags & ~XDNS_RECORD_RELATIVE) | (flags & XDNS_RECORD_RELATIVE);
+    memcpy(staged + b->maps[r.map].flags_offset, &record_flags, sizeof(record_flags));
+
+    b->records++;
+    return 0;
+}
+
+//Stage the removal of one record, an RRset left empty is deleted by the flush.
+//Returns 0, -ENOENT if the record is not in its RRset, otherwise as dns_batch_add.
+int dns_batch_remove(struct dns_batch *b, uint16_t type, const char *name, const char *value)
+{
+    struct batch_record r;
+    char *staged;
+    int err;
+
+    staged = stage_record(b, type, name, value, &r, &err);
+    if (!staged)
+    {
+        return err;
+    }
+
+    switch (r.map)
+    {
+    case DNS_BATCH_A:
+        err = a_rrset_remove((struct a_record *)staged, r.ip_addr);
+        break;
+    case DNS_BATCH_AAAA:
+        err = aaaa_rrset_remove((struct aaaa_record *)staged, r.ip6_addr);
+        break;
+    default:
+        err = rr_record_remove((struct rr_record *)staged, type, r.rdata, r.rdata_len);
+        break;
+    }
+    if (err)
+    {
+        return -ENOENT;
+    }
+
+    b->records++;
+    return 0;
+}
+
+//Guess the type of a db.csv value the way dns/apple_dns.py does, extended to IPv6
+static uint16_t csv_value_type(const char *value)
+{
+    struct in_addr ip_addr;
+    struct in6_addr ip6_addr;
+
+    if (inet_aton(value, &ip_addr))
+    {
+        return A_RECORD_TYPE;
+    }
+    if (inet_pton(AF_INET6, value, &ip6_addr) == 1)
+    {
+        return AAAA_RECORD_TYPE;
+    }
+    return CNAME_RECORD_TYPE;
+}
+
+//Stage the record of one line of a record file. Two layouts are accepted:
+//  name,value        dns/db.csv, the type follows from the value, the SOA line is skipped
+//  type name value [ttl [expiry]]  the output of xdp_dns_update list, the value may be quoted
+//Returns 1 for lines without a record (empty, comments, SOA), otherwise as dns_batch_add.
+int dns_batch_add_line(struct dns_batch *b, char *line)
+{
+    char *comma, *name, *value;
+    uint32_t ttl;
+    uint64_t expires;
+    uint16_t record_type, flags;
+    int err;
+
+    line[strcspn(line, "\r\n")] = 0;
+    while (isspace((unsigned char)*line))
+    {
+        line++;
+    }
+    if (*line == 0 || *line == '#' || *line == ';')
+    {
+        return 1;
+    }
+
+    comma = strchr(line, ',');
+    if (comma)
+    {
+        *comma = 0;
+        value = comma + 1;
+        //The SOA line holds several space separated fields
+        if (strchr(value, ' '))
+        {
+            return 1;
+        }
+        return dns_batch_add(b, csv_value_type(value), line, value, 0, 0, 0);
+    }
+
+    err = dns_record_split(line, &record_type, &name, &value, &ttl, &expires, &flags);
+    if (err)
+    {
+        return err;
+    }
+    return dns_batch_add(b, record_type, name, value, ttl, expires, flags);
+}
+
+//Split a record line 'type name value [ttl [expiry]]' in place. The value may be quoted (TXT values
+//keep their quotes, see rr_rdata_from_text), the TTL is only taken from a last field that is a number.
+//The expiry follows the TTL as '@' and a Unix time, or '+' and a number of seconds from now, and is
+//returned in CLOCK_BOOTTIME ns (0 without one), *flags is XDNS_RECORD_RELATIVE for a '+' expiry.
+//Returns 0 or -EINVAL.
+int dns_record_split(char *line, uint16_t *record_type, char **name, char **value, uint32_t *ttl,
+                     uint64_t *expires, uint16_t *flags)
+{
+    char *type, *end, *last;
+
+    *ttl = 0;
+    *expires = 0;
+    *flags = 0;
+    type = strtok_r(line, " \t", &end);
+    *name = strtok_r(NULL, " \t", &end);
+    if (!type || !*name)
+    {
+        return -EINVAL;
+    }
+    if (strcasecmp(type, "A") == 0)
+    {
+        *record_type = A_RECORD_TYPE;
+    }
+    else if (strcasecmp(type, "AAAA") == 0)
+    {
+        *record_type = AAAA_RECORD_TYPE;
+    }
+    else if ((*record_type = rr_type_from_name(type)) == 0)
+    {
+        return -EINVAL;
+    }
+
+    //The rest of the line is the value, followed by the TTL if the last field is a number,
+    //or the TTL and the expiry
+    *value = end;
+    while (isspace((unsigned char)**value))
+    {
+        (*value)++;
+    }
+    end = *value + strlen(*value);
+    while (end > *value && isspace((unsigned char)end[-1]))
+    {
+        *--end = 0;
+    }
+    last = strrchr(*value, ' ');
+    if (!last)
+    {
+        last = strrchr(*value, '\t');
+    }
+    if (last && dns_expiry_parse(last + 1, expires) == 0)
+    {
+        *flags = last[1] == '+' ? XDNS_RECORD_RELATIVE : 0;
+        while (last > *value && isspace((unsigned char)last[-1]))
+        {
+            last--;
+        }
+        *last = 0;
+        end = last;
+        last = strrchr(*value, ' ');
+        if (!last)
+        {
+            last = strrchr(*value, '\t');
+        }
+    }
+    if (last && last[1] && strspn(last + 1, "0123456789") == strlen(last + 1))
+    {
+        *ttl = strtoul(last + 1, NULL, 10);
+        while (last > *value && isspace((unsigned char)last[-1]))
+        {
+            last--;
+        }
+        *last = 0;
+        end = last;
+    }
+    //TXT values keep their quotes, every quoted string is a character-string of its own
+    if (*record_type != TXT_RECORD_TYPE && end - *value >= 2 && **value == '"' && end[-1] == '"')
+    {
+        end[-1] = 0;
+        (*value)++;
+    }
+    if (**value == 0)
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+//Write count entries with bpf_map_update_batch, one update per entry on kernels without batch
+//support for the map type. Adds the number of update syscalls to *calls.
+int dns_map_update(int fd, const struct dns_key *keys, const void *values, size_t value_size,
+                   uint32_t count, uint64_t *calls)
+{
+    uint32_t done = count;
+    uint32_t j;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    (*calls)++;
+    if (bpf_map_update_batch(fd, keys, values, &done, NULL) == 0)
+    {
+        return 0;
+    }
+
+    if (errno != EINVAL && errno != ENOTSUPP && errno != EOPNOTSUPP)
+    {
+        printf("ERROR: Batch update failed after %u of %u records: %s\n", done, count, strerror(errno));
+        return -EIO;
+    }
+    for (j = done; j < count; j++)
+    {
+        (*calls)++;
+        if (bpf_map_update_elem(fd, &keys[j], (const char *)values + j * value_size, BPF_ANY) != 0)
+        {
+            printf("ERROR: DNS record could not be added: %s\n", strerror(errno));
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+//Delete count keys with bpf_map_delete_batch, one delete per key on kernels without batch
+//support or if a key is already gone. Adds the number of delete syscalls to *calls.
+int dns_map_delete(int fd, const struct dns_key *keys, uint32_t count, uint64_t *calls)
+{
+    uint32_t done = count;
+    uint32_t j;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    (*calls)++;
+    if (bpf_map_delete_batch(fd, keys, &done, NULL) == 0)
+    {
+        return 0;
+    }
+
+    //A batch stops at the first missing key
+    if (errno != ENOENT && errno != EINVAL && errno != ENOTSUPP && errno != EOPNOTSUPP)
+    {
+        printf("ERROR: Batch delete failed after %u of %u records: %s\n", done, count, strerror(errno));
+        return -EIO;
+    }
+    for (j = done; j < count; j++)
+    {
+        (*calls)++;
+        if (bpf_map_delete_elem(fd, &keys[j]) != 0 && errno != ENOENT)
+        {
+            printf("ERROR: DNS record could not be removed: %s\n", strerror(errno));
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+static int rrset_empty(int map, const char *value)
+{
+    switch (map)
+    {
+    case DNS_BATCH_A:
+        return ((const struct a_record *)value)->count == 0;
+    case DNS_BATCH_AAAA:
+        return ((const struct aaaa_record *)value)->count == 0;
+    default:
+        return ((const struct rr_record *)value)->ans_count == 0;
+    }
+}
+
+//Move the staged RRsets that removals left empty behind the others, returns the number of the others
+static uint32_t partition_empty(struct dns_batch_map *m, int map)
+{
+    char tmp[sizeof(struct rr_record)];
+    uint32_t head = 0, tail = m->count;
+
+    while (head < tail)
+    {
+        char *value = m->values + head * m->value_size;
+        struct dns_key key;
+
+        if (!rrset_empty(map, value))
+        {
+            head++;
+            continue;
+        }
+        tail--;
+        key = m->keys[head];
+        m->keys[head] = m->keys[tail];
+        m->keys[tail] = key;
+        memcpy(tmp, value, m->value_size);
+        memcpy(value, m->values + tail * m->value_size, m->value_size);
+        memcpy(m->values + tail * m->value_size, tmp, m->value_size);
+    }
+    return head;
+}
+
+//Write the staged RRsets of every map and delete the ones left empty.
+//Returns 0, -EIO if a map update failed or -ENOMEM.
+int dns_batch_flush(struct dns_batch *b)
+{
+    int i, ret = 0;
+
+    //The names go first, xdp_dns does not answer a record before its name is written
+    if (b->name_count)
+    {
+        int err = dns_map_update(b->names_fd, b->name_keys, b->names, sizeof(*b->names), b->name_count,
+                                 &b->batches);
+        if (err)
+        {
+            ret = err;
+        }
+        b->name_count = 0;
+    }
+
+    for (i = 0; i < DNS_BATCH_MAPS; i++)
+    {
+        struct dns_batch_map *m = &b->maps[i];
+        uint32_t j, written;
+        int err;
+
+        if (m->count == 0)
+        {
+            continue;
+        }
+
+        written = partition_empty(m, i);
+        if (b->tables[i])
+        {
+            //Only loads write to tables, nothing is removed
+            for (j = 0; j < written; j++)
+            {
+                if (dns_table_put(b->tables[i], &m->keys[j], m->values + j * m->value_size) != 0)
+                {
+                    ret = -ENOMEM;
+                }
+            }
+            b->rrsets += written;
+            m->count = 0;
+            continue;
+        }
+
+        err = dns_map_update(m->fd, m->keys, m->values, m->value_size, written, &b->batches);
+        if (err == 0)
+        {
+            err = dns_map_delete(m->fd, m->keys + written, m->count - written, &b->batches);
+        }
+        if (err)
+        {
+            ret = err;
+        }
+
+        //Merge mode reads every RRset back anyway
+        for (j = 0; !b->merge && j < m->count; j++)
+        {
+            if (written_add(b, key_mix(&m->keys[j])) != 0)
+            {
+                ret = -ENOMEM;
+            }
+        }
+        b->rrsets += written;
+        b->deleted += m->count - written;
+        m->count = 0;
+    }
+
+    memset(b->index, 0, sizeof(b->index));
+    return ret;
+}
+
+int dns_map_dump(int fd, size_t value_size, dns_map_dump_fn fn, void *ctx)
+{
+    struct dns_key *keys = calloc(DNS_BATCH_SIZE, sizeof(*keys));
+    char *values = calloc(DNS_BATCH_SIZE, value_size);
+    //Opaque position of the dump, hash maps use a bucket index that fits in a key
+    struct dns_key batch;
+    int first = 1, done = 0, total = 0;
+    int ret = 0;
+
+    if (!keys || !values)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    while (!done)
+    {
+        uint32_t count = DNS_BATCH_SIZE;
+        uint32_t i;
+
+        if (bpf_map_lookup_batch(fd, first ? NULL : &batch, &batch, keys, values, &count, NULL) != 0)
+        {
+            //ENOENT marks the end of the map, the last entries are still returned
+            if (errno != ENOENT)
+            {
+                ret = -errno;
+                goto out;
+            }
+            done = 1;
+        }
+        first = 0;
+
+        for (i = 0; i < count; i++)
+        {
+            total++;
+            if (fn(&keys[i], values + i * value_size, ctx) != 0)
+            {
+                goto out;
+            }
+        }
+    }
+
+out:
+    free(keys);
+    free(values);
+    return ret ? ret : total;
+}
+
+struct sweep_ctx {
+    size_t expires_offset;
+    uint64_t now;
+    struct dns_key *keys;
+    uint32_t count;
+    uint32_t size;
+    int err;
+};
+
+static int sweep_collect(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct sweep_ctx *sw = ctx;
+    uint64_t expires;
+
+    memcpy(&expires, (const char *)value + sw->expires_offset, sizeof(expires));
+    if (!expires || expires > sw->now)
+    {
+        return 0;
+    }
+    if (sw->count == sw->size)
+    {
+        uint32_t size = sw->size ? sw->size * 2 : DNS_BATCH_SIZE;
+        struct dns_key *keys = realloc(sw->keys, size * sizeof(*keys));
+        if (!keys)
+        {
+            //Any nonzero return only stops the dump, the error is taken from the context
+            sw->err = -ENOMEM;
+            return -1;
+        }
+        sw->keys = keys;
+        sw->size = size;
+    }
+    sw->keys[sw->count++] = *key;
+    return 0;
+}
+
+//Delete the entries of a record map whose expiry (the uint64_t at expires_offset of the value)
+//has passed at now, with a batched dump and batched deletes. An RRset refreshed between the
+//dump and the delete is deleted as well and costs one more miss before it is filled again.
+//Returns the number of entries deleted or a negative error.
+int dns_map_sweep(int fd, size_t value_size, size_t expires_offset, uint64_t now, uint64_t *calls)
+{
+    struct sweep_ctx sw = {.expires_offset = expires_offset, .now = now};
+    uint32_t i;
+    int err;
+
+    err = dns_map_dump(fd, value_size, sweep_collect, &sw);
+    if (err >= 0)
+    {
+        err = sw.err;
+    }
+    for (i = 0; i < sw.count && !err; i += DNS_BATCH_SIZE)
+    {
+        uint32_t count = sw.count - i < DNS_BATCH_SIZE ? sw.count - i : DNS_BATCH_SIZE;
+        err = dns_map_delete(fd, sw.keys + i, count, calls);
+    }
+    free(sw.keys);
+    return err ? err : (int)sw.count;
+}
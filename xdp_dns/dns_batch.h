@@ -0,0 +1,115 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#ifndef DNS_BATCH_H
+#define DNS_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+
+//Number of RRsets staged per record map before they are written with one bpf_map_update_batch
+#define DNS_BATCH_SIZE 4096
+
+enum dns_batch_map_id {
+    DNS_BATCH_A,
+    DNS_BATCH_AAAA,
+    DNS_BATCH_RR,
+    DNS_BATCH_MAPS
+};
+
+//RRsets staged for one record map
+struct dns_batch_map {
+    int fd;
+    size_t value_size;
+    size_t check_offset;    //Offset of the name check in the value
+    size_t flags_offset;    //Offset of the uint16_t flags in the value
+    uint32_t count;
+    struct dns_key keys[DNS_BATCH_SIZE];
+    char *values;
+};
+
+//RRsets held in memory instead of a map, open addressing over the key
+struct dns_table {
+    size_t value_size;
+    size_t size;        //Slots, a power of two
+    size_t count;
+    struct dns_key *keys;
+    char *values;
+    uint8_t *flags;     //0 is empty, DNS_TABLE_USED and bits of the user
+};
+
+#define DNS_TABLE_USED 1
+
+//Records are staged per map and written in batches. A batch replaces the RRsets it holds,
+//so loading a file sets the RRsets of every name in the file and leaves other names alone.
+//RRsets of a name may be spread over several batches; keys written earlier in the same load
+//are remembered and their RRset is read back from the map before it is extended.
+//In merge mode every RRset is read back first, so records are added to or removed from the
+//RRsets in the map like single updates do; RRsets left empty are deleted.
+//With tables set, RRsets are written to the tables instead of the maps.
+struct dns_batch {
+    struct dns_batch_map maps[DNS_BATCH_MAPS];
+    int merge;
+    struct dns_table *tables[DNS_BATCH_MAPS];
+
+    //Staged keys of the current batch, open addressing, 0 is empty, else map id << 16 | slot + 1
+    uint32_t index[DNS_BATCH_MAPS * DNS_BATCH_SIZE * 2];
+
+    //Names of the RRsets staged in the current batch, written to xdns_names (names_fd) by the
+    //flush so list can show them. -1 if the map is not pinned.
+    int names_fd;
+    uint32_t name_count;
+    struct dns_key name_keys[DNS_BATCH_MAPS * DNS_BATCH_SIZE];
+    struct dns_name *names;
+
+    //Keys written since dns_batch_init, open addressing over a mix of the key, 0 is empty.
+    //A false positive only costs a lookup.
+    uint64_t *written;
+    size_t written_size;
+    size_t written_count;
+
+    uint64_t records;   //Records staged
+    uint64_t rrsets;    //RRsets written
+    uint64_t deleted;   //RRsets deleted
+    uint64_t batches;   //Update syscalls
+};
+
+struct dns_table *dns_table_new(size_t value_size);
+void dns_table_free(struct dns_table *t);
+char *dns_table_lookup(struct dns_table *t, const struct dns_key *key, uint8_t **flags);
+int dns_table_put(struct dns_table *t, const struct dns_key *key, const void *value);
+
+struct dns_batch *dns_batch_new(int a_records_fd, int aaaa_records_fd, int rr_records_fd);
+void dns_batch_free(struct dns_batch *b);
+int dns_batch_add(struct dns_batch *b, uint16_t type, const char *name, const char *value, uint32_t ttl,
+                  uint64_t expires, uint16_t flags);
+int dns_batch_remove(struct dns_batch *b, uint16_t type, const char *name, const char *value);
+int dns_batch_add_line(struct dns_batch *b, char *line);
+int dns_batch_flush(struct dns_batch *b);
+int dns_record_split(char *line, uint16_t *record_type, char **name, char **value, uint32_t *ttl,
+                     uint64_t *expires, uint16_t *flags);
+int dns_map_update(int fd, const struct dns_key *keys, const void *values, size_t value_size,
+                   uint32_t count, uint64_t *calls);
+int dns_map_delete(int fd, const struct dns_key *keys, uint32_t count, uint64_t *calls);
+
+//Called for every entry of a dumped map, a non-zero return stops the dump
+typedef int (*dns_map_dump_fn)(const struct dns_key *key, const void *value, void *ctx);
+int dns_map_dump(int fd, size_t value_size, dns_map_dump_fn fn, void *ctx);
+int dns_map_sweep(int fd, size_t value_size, size_t expires_offset, uint64_t now, uint64_t *calls);
+
+#endif
@@ -0,0 +1,363 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include "dns_util.h"
+#include "dns_batch.h"
+#include "dns_snapshot.h"
+
+static const size_t snapshot_value_sizes[DNS_SNAPSHOT_MAPS] = {sizeof(struct a_record), sizeof(struct aaaa_record),
+                                                                sizeof(struct rr_record), sizeof(struct dns_name)};
+
+//Entries of one map collected into the next chunk
+struct snapshot_writer {
+    FILE *file;
+    struct dns_snapshot_header *header;
+    uint32_t map;
+    struct dns_snapshot_chunk chunk;
+    struct dns_key keys[DNS_BATCH_SIZE];
+    char *values;
+    int err;
+};
+
+static int snapshot_out(struct snapshot_writer *w, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, w->file) != size)
+    {
+        w->err = -errno;
+        return -1;
+    }
+    w->header->body_crc = crc32(w->header->body_crc, data, size);
+    w->header->body_size += size;
+    return 0;
+}
+
+static int snapshot_write_chunk(struct snapshot_writer *w)
+{
+    size_t value_size = snapshot_value_sizes[w->map];
+
+    if (w->chunk.count == 0)
+    {
+        return 0;
+    }
+    w->chunk.map = w->map;
+    if (snapshot_out(w, &w->chunk, sizeof(w->chunk)) < 0 ||
+        snapshot_out(w, w->keys, w->chunk.count * sizeof(struct dns_key)) < 0 ||
+        snapshot_out(w, w->values, w->chunk.count * value_size) < 0)
+    {
+        return -1;
+    }
+    w->header->count[w->map] += w->chunk.count;
+    w->header->chunks++;
+    w->chunk.count = 0;
+    return 0;
+}
+
+static int snapshot_add(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct snapshot_writer *w = ctx;
+    size_t value_size = snapshot_value_sizes[w->map];
+
+    w->keys[w->chunk.count] = *key;
+    memcpy(w->values + w->chunk.count * value_size, value, value_size);
+    if (++w->chunk.count == DNS_BATCH_SIZE)
+    {
+        return snapshot_write_chunk(w);
+    }
+    return 0;
+}
+
+static uint32_t snapshot_header_crc(const struct dns_snapshot_header *header)
+{
+    struct dns_snapshot_header h = *header;
+
+    h.header_crc = 0;
+    return crc32(0, (const unsigned char *)&h, sizeof(h));
+}
+
+//Write the record maps fds to filename, and the names of fds[DNS_SNAPSHOT_NAMES] unless it is -1.
+//The snapshot is written next to it and renamed into place, so an existing snapshot is only
+//replaced by a complete one.
+int dns_snapshot_write(const char *filename, const int fds[DNS_SNAPSHOT_MAPS], struct dns_snapshot_header *header)
+{
+    struct snapshot_writer *w;
+    char tmp[4096];
+    int i, ret = 0;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp))
+    {
+        return -ENAMETOOLONG;
+    }
+
+    w = calloc(1, sizeof(*w));
+    if (w)
+    {
+        w->values = malloc(DNS_BATCH_SIZE * (sizeof(struct rr_record) > sizeof(struct dns_name) ?
+                                             sizeof(struct rr_record) : sizeof(struct dns_name)));
+    }
+    if (!w || !w->values)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, DNS_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = DNS_SNAPSHOT_VERSION;
+    header->header_size = sizeof(*header);
+    header->key_size = sizeof(struct dns_key);
+    for (i = 0; i < DNS_SNAPSHOT_MAPS; i++)
+    {
+        header->value_size[i] = snapshot_value_sizes[i];
+    }
+    header->created = time(NULL);
+    header->boot_offset = dns_boot_to_unix_ns();
+    w->header = header;
+
+    w->file = fopen(tmp, "w");
+    if (!w->file)
+    {
+        ret = -errno;
+        goto out;
+    }
+    //Room for the header, it is written once the body is known
+    if (fseek(w->file, sizeof(*header), SEEK_SET) != 0)
+    {
+        ret = -errno;
+        goto out;
+    }
+
+    //The names go first, restore writes in file order and xdp_dns does not answer a record
+    //before its name is written
+    for (i = 0; i < DNS_SNAPSHOT_MAPS; i++)
+    {
+        int map = (DNS_SNAPSHOT_NAMES + i) % DNS_SNAPSHOT_MAPS;
+        int err;
+
+        if (fds[map] < 0)
+        {
+            continue;
+        }
+        w->map = map;
+        err = dns_map_dump(fds[map], snapshot_value_sizes[map], snapshot_add, w);
+        if (err < 0 || w->err || snapshot_write_chunk(w) < 0)
+        {
+            ret = err < 0 ? err : w->err;
+            goto out;
+        }
+    }
+
+    header->header_crc = snapshot_header_crc(header);
+    if (fseek(w->file, 0, SEEK_SET) != 0 || fwrite(header, sizeof(*header), 1, w->file) != 1 ||
+        fflush(w->file) != 0 || fsync(fileno(w->file)) != 0)
+    {
+        ret = -errno;
+        goto out;
+    }
+    if (fclose(w->file) != 0)
+    {
+        w->file = NULL;
+        ret = -errno;
+        goto out;
+    }
+    w->file = NULL;
+    if (rename(tmp, filename) != 0)
+    {
+        ret = -errno;
+    }
+
+out:
+    if (w && w->file)
+    {
+        fclose(w->file);
+    }
+    if (ret)
+    {
+        unlink(tmp);
+    }
+    if (w)
+    {
+        free(w->values);
+    }
+    free(w);
+    return ret;
+}
+
+//Check the header and the checksum of a mapped snapshot and the chunks it is made of
+static int snapshot_check(const char *filename, const char *base, size_t size)
+{
+    const struct dns_snapshot_header *header = (const struct dns_snapshot_header *)base;
+    const char *pos, *end;
+    int i;
+
+    if (size < sizeof(*header) || memcmp(header->magic, DNS_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+    {
+        printf("ERROR: %s is not a snapshot\n", filename);
+        return -EINVAL;
+    }
+    if (header->version != DNS_SNAPSHOT_VERSION || header->header_size != sizeof(*header))
+    {
+        printf("ERROR: %s has snapshot version %u, this version reads %u\n", filename, header->version,
+               DNS_SNAPSHOT_VERSION);
+        return -EINVAL;
+    }
+    if (header->header_crc != snapshot_header_crc(header) || header->body_size != size - sizeof(*header))
+    {
+        printf("ERROR: %s is truncated or its header is damaged\n", filename);
+        return -EINVAL;
+    }
+    if (header->key_size != sizeof(struct dns_key))
+    {
+        printf("ERROR: %s was written with different record structures\n", filename);
+        return -EINVAL;
+    }
+    for (i = 0; i < DNS_SNAPSHOT_MAPS; i++)
+    {
+        if (header->value_size[i] != snapshot_value_sizes[i])
+        {
+            printf("ERROR: %s was written with different record structures\n", filename);
+            return -EINVAL;
+        }
+    }
+    if (crc32(0, (const unsigned char *)(base + sizeof(*header)), header->body_size) != header->body_crc)
+    {
+        printf("ERROR: %s fails its checksum\n", filename);
+        return -EINVAL;
+    }
+
+    pos = base + sizeof(*header);
+    end = base + size;
+    while (pos < end)
+    {
+        const struct dns_snapshot_chunk *chunk = (const struct dns_snapshot_chunk *)pos;
+
+        if ((size_t)(end - pos) < sizeof(*chunk) || chunk->map >= DNS_SNAPSHOT_MAPS || chunk->count > DNS_BATCH_SIZE ||
+            (size_t)(end - pos) < sizeof(*chunk) + chunk->count * (sizeof(struct dns_key) + snapshot_value_sizes[chunk->map]))
+        {
+            printf("ERROR: %s holds a damaged chunk\n", filename);
+            return -EINVAL;
+        }
+        pos += sizeof(*chunk) + chunk->count * (sizeof(struct dns_key) + snapshot_value_sizes[chunk->map]);
+    }
+    return 0;
+}
+
+//Expiries are CLOCK_BOOTTIME ns, which restarts at every boot. Move the expiries of a chunk
+//by shift ns so they fall on the same wall clock time, an expiry that has passed stays expired.
+static void snapshot_rebase(uint32_t map, char *values, uint32_t count, int64_t shift)
+{
+    size_t value_size = snapshot_value_sizes[map];
+    size_t offset = map == ZONE_A ? offsetof(struct a_record, expires) :
+                    map == ZONE_AAAA ? offsetof(struct aaaa_record, expires) : offsetof(struct rr_record, expires);
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        uint64_t *expires = (uint64_t *)(values + i * value_size + offset);
+        if (*expires)
+        {
+            int64_t rebased = (int64_t)*expires + shift;
+            *expires = rebased > 0 ? (uint64_t)rebased : 1;
+        }
+    }
+}
+
+//Write the records of a snapshot into the record maps fds, one batched update per chunk, and
+//its names into fds[DNS_SNAPSHOT_NAMES] unless it is -1. Nothing is written unless the whole
+//file checks out.
+int dns_snapshot_restore(const char *filename, const int fds[DNS_SNAPSHOT_MAPS], struct dns_snapshot_header *header,
+                         uint64_t *calls)
+{
+    struct stat st;
+    const char *base, *pos, *end;
+    int64_t shift;
+    int fd, ret;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        ret = -errno;
+        printf("ERROR: Could not open %s: %s\n", filename, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return ret;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        printf("ERROR: %s is not a snapshot\n", filename);
+        return -EINVAL;
+    }
+    //Writable for snapshot_rebase, the private mapping copies only the pages it changes
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        ret = -errno;
+        printf("ERROR: Could not map %s: %s\n", filename, strerror(errno));
+        return ret;
+    }
+    madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+
+    ret = snapshot_check(filename, base, st.st_size);
+    if (ret == 0)
+    {
+        memcpy(header, base, sizeof(*header));
+        //Within a second the snapshot was taken since the last boot, leave the pages clean
+        shift = header->boot_offset - dns_boot_to_unix_ns();
+        if (shift > -1000000000LL && shift < 1000000000LL)
+        {
+            shift = 0;
+        }
+        pos = base + sizeof(*header);
+        end = base + st.st_size;
+        while (ret == 0 && pos < end)
+        {
+            const struct dns_snapshot_chunk *chunk = (const struct dns_snapshot_chunk *)pos;
+            const struct dns_key *keys = (const struct dns_key *)(chunk + 1);
+            const char *values = (const char *)(keys + chunk->count);
+            size_t value_size = snapshot_value_sizes[chunk->map];
+
+            if (shift && chunk->map != DNS_SNAPSHOT_NAMES)
+            {
+                snapshot_rebase(chunk->map, (char *)values, chunk->count, shift);
+            }
+            if (fds[chunk->map] >= 0)
+            {
+                ret = dns_map_update(fds[chunk->map], keys, values, value_size, chunk->count, calls);
+            }
+            pos = values + chunk->count * value_size;
+        }
+    }
+
+    munmap((void *)base, st.st_size);
+    return ret;
+}
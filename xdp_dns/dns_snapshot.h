@@ -0,0 +1,61 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#ifndef DNS_SNAPSHOT_H
+#define DNS_SNAPSHOT_H
+
+#include <stdint.h>
+#include "common.h"
+#include "dns_zone.h"
+
+#define DNS_SNAPSHOT_MAGIC "XDNSSNAP"
+//Bump when the file layout changes, a change of the record structs is caught by the value sizes
+#define DNS_SNAPSHOT_VERSION 3
+
+//Maps held by a snapshot, the record maps of a zone followed by the names of xdns_names
+#define DNS_SNAPSHOT_NAMES ZONE_MAPS
+#define DNS_SNAPSHOT_MAPS (ZONE_MAPS + 1)
+
+//A snapshot is this header followed by chunks. Every chunk holds up to DNS_BATCH_SIZE entries
+//of one map as a struct dns_snapshot_chunk, count keys and count values, so the keys and
+//values of a mapped file are handed to bpf_map_update_batch as they are. All sizes are multiples
+//of 8 bytes, the integers are in host byte order.
+struct dns_snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t key_size;
+    uint32_t value_size[DNS_SNAPSHOT_MAPS];
+    uint64_t created;               //Unix time
+    int64_t boot_offset;            //Unix time of CLOCK_BOOTTIME zero in ns, to rebase record expiries
+    uint64_t count[DNS_SNAPSHOT_MAPS];  //Entries per map
+    uint64_t chunks;
+    uint64_t body_size;             //Bytes after the header
+    uint32_t body_crc;              //CRC-32 of the bytes after the header
+    uint32_t header_crc;            //CRC-32 of the header with header_crc zero
+};
+
+struct dns_snapshot_chunk {
+    uint32_t map;                   //enum zone_map_id or DNS_SNAPSHOT_NAMES
+    uint32_t count;
+};
+
+int dns_snapshot_write(const char *filename, const int fds[DNS_SNAPSHOT_MAPS], struct dns_snapshot_header *header);
+int dns_snapshot_restore(const char *filename, const int fds[DNS_SNAPSHOT_MAPS], struct dns_snapshot_header *header,
+                         uint64_t *calls);
+
+#endif
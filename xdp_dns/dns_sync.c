@@ -0,0 +1,371 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <bpf/bpf.h>
+#include "dns_util.h"
+#include "dns_batch.h"
+#include "dns_zone.h"
+#include "dns_sync.h"
+
+//Flag of table entries whose RRset is in the map as it is
+#define SYNC_SAME 2
+
+static const size_t sync_value_sizes[DNS_BATCH_MAPS] = {sizeof(struct a_record), sizeof(struct aaaa_record),
+                                                         sizeof(struct rr_record)};
+static const size_t sync_flags_offsets[DNS_BATCH_MAPS] = {offsetof(struct a_record, flags),
+                                                          offsetof(struct aaaa_record, flags),
+                                                          offsetof(struct rr_record, flags)};
+static const size_t sync_expires_offsets[DNS_BATCH_MAPS] = {offsetof(struct a_record, expires),
+                                                            offsetof(struct aaaa_record, expires),
+                                                            offsetof(struct rr_record, expires)};
+
+//Keys of the map that came from a file and are not in this one
+struct sync_diff {
+    struct dns_table *table;
+    size_t flags_offset;
+    size_t expires_offset;
+    struct dns_key *deletes;
+    size_t deletes_count;
+    size_t deletes_size;
+    uint64_t unchanged;
+    int err;
+};
+
+//Whether the RRset of the file is the one in the map. A +seconds expiry is computed again on
+//every read of the file, the deadline in the map stands if both RRsets were given one.
+static int sync_same(const struct sync_diff *d, char *wanted, const void *value)
+{
+    uint16_t wanted_flags, record_flags;
+    uint64_t expires;
+    int same;
+
+    if (memcmp(wanted, value, d->table->value_size) == 0)
+    {
+        return 1;
+    }
+    memcpy(&wanted_flags, wanted + d->flags_offset, sizeof(wanted_flags));
+    memcpy(&record_flags, (const char *)value + d->flags_offset, sizeof(record_flags));
+    if (!(wanted_flags & record_flags & XDNS_RECORD_RELATIVE))
+    {
+        return 0;
+    }
+
+    memcpy(&expires, wanted + d->expires_offset, sizeof(expires));
+    memcpy(wanted + d->expires_offset, (const char *)value + d->expires_offset, sizeof(expires));
+    same = memcmp(wanted, value, d->table->value_size) == 0;
+    if (!same)
+    {
+        memcpy(wanted + d->expires_offset, &expires, sizeof(expires));
+    }
+    return same;
+}
+
+static int sync_compare(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct sync_diff *d = ctx;
+    uint8_t *flags;
+    char *wanted = dns_table_lookup(d->table, key, &flags);
+    uint16_t record_flags;
+
+    if (wanted)
+    {
+        if (sync_same(d, wanted, value))
+        {
+            *flags |= SYNC_SAME;
+            d->unchanged++;
+        }
+        return 0;
+    }
+
+    //RRsets added at runtime, by add, serve or xdp_dns_fill, are not the file's to delete
+    memcpy(&record_flags, (const char *)value + d->flags_offset, sizeof(record_flags));
+    if (!(record_flags & XDNS_RECORD_FILE))
+    {
+        return 0;
+    }
+
+    if (d->deletes_count == d->deletes_size)
+    {
+        size_t size = d->deletes_size ? d->deletes_size * 2 : DNS_BATCH_SIZE;
+        struct dns_key *deletes = realloc(d->deletes, size * sizeof(*deletes));
+
+        if (!deletes)
+        {
+            d->err = -ENOMEM;
+            return 1;
+        }
+        d->deletes = deletes;
+        d->deletes_size = size;
+    }
+    d->deletes[d->deletes_count++] = *key;
+    return 0;
+}
+
+//Bring one record map in line with its table. New and changed RRsets are written before the
+//others are deleted, so a name moving between types is never missing from both.
+static int sync_map(int fd, struct dns_table *t, int map, struct dns_sync_stats *stats)
+{
+    struct sync_diff d;
+    struct dns_key *keys = malloc(DNS_BATCH_SIZE * sizeof(*keys));
+    char *values = malloc(DNS_BATCH_SIZE * t->value_size);
+    uint32_t count = 0;
+    size_t i;
+    int err;
+
+    memset(&d, 0, sizeof(d));
+    d.table = t;
+    d.flags_offset = sync_flags_offsets[map];
+    d.expires_offset = sync_expires_offsets[map];
+    if (!keys || !values)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    err = dns_map_dump(fd, t->value_size, sync_compare, &d);
+    if (err >= 0)
+    {
+        err = d.err;
+    }
+    if (err < 0)
+    {
+        goto out;
+    }
+    err = 0;
+
+    for (i = 0; err == 0 && i < t->size; i++)
+    {
+        if (t->flags && t->flags[i] && !(t->flags[i] & SYNC_SAME))
+        {
+            keys[count] = t->keys[i];
+            memcpy(values + count * t->value_size, t->values + i * t->value_size, t->value_size);
+            if (++count == DNS_BATCH_SIZE)
+            {
+                err = dns_map_update(fd, keys, values, t->value_size, count, &stats->calls);
+                stats->updated += count;
+                count = 0;
+            }
+        }
+    }
+    if (err == 0)
+    {
+        err = dns_map_update(fd, keys, values, t->value_size, count, &stats->calls);
+        stats->updated += count;
+    }
+
+    for (i = 0; err == 0 && i < d.deletes_count; i += DNS_BATCH_SIZE)
+    {
+        count = d.deletes_count - i < DNS_BATCH_SIZE ? d.deletes_count - i : DNS_BATCH_SIZE;
+        err = dns_map_delete(fd, d.deletes + i, count, &stats->calls);
+        stats->deleted += count;
+    }
+    stats->unchanged += d.unchanged;
+    stats->rrsets += t->count;
+
+out:
+    free(d.deletes);
+    free(keys);
+    free(values);
+    return err;
+}
+
+//Read filename into memory and write the difference to the active zone
+int dns_sync_once(const char *filename, dns_sync_load_fn load, void *ctx, struct dns_sync_stats *stats)
+{
+    struct dns_table *tables[DNS_BATCH_MAPS] = {NULL};
+    struct dns_batch *b;
+    int fds[ZONE_MAPS];
+    int i, err = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    b = dns_batch_new(-1, -1, -1);
+    for (i = 0; b && i < DNS_BATCH_MAPS; i++)
+    {
+        tables[i] = b->tables[i] = dns_table_new(sync_value_sizes[i]);
+        if (!tables[i])
+        {
+            err = -ENOMEM;
+        }
+    }
+    if (!b || err)
+    {
+        printf("ERROR: Failed to allocate memory\n");
+        err = -ENOMEM;
+        goto out;
+    }
+
+    err = load(filename, b, ctx);
+    if (err == 0)
+    {
+        err = dns_batch_flush(b);
+    }
+    if (err)
+    {
+        printf("ERROR: %s not synced, the maps are left as they are\n", filename);
+        goto out;
+    }
+
+    if (zone_open_active(fds) < 0)
+    {
+        err = -ENOENT;
+        goto out;
+    }
+    for (i = 0; err == 0 && i < DNS_BATCH_MAPS; i++)
+    {
+        err = sync_map(fds[i], tables[i], i, stats);
+    }
+    if (err)
+    {
+        printf("ERROR: Failed to sync %s: %s\n", filename, strerror(-err));
+    }
+    zone_close(fds);
+
+out:
+    dns_batch_free(b);
+    for (i = 0; i < DNS_BATCH_MAPS; i++)
+    {
+        dns_table_free(tables[i]);
+    }
+    return err;
+}
+
+static void sync_report(const char *filename, int err, const struct dns_sync_stats *stats, const struct timespec *start)
+{
+    struct timespec end;
+    double ms;
+
+    if (err)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+    printf("Synced %s in %.1f ms: %llu RRsets, %llu written, %llu deleted, %llu unchanged, %llu syscalls\n",
+           filename, ms, (unsigned long long)stats->rrsets, (unsigned long long)stats->updated,
+           (unsigned long long)stats->deleted, (unsigned long long)stats->unchanged,
+           (unsigned long long)stats->calls);
+    fflush(stdout);
+}
+
+//Sync filename now and whenever it is written or replaced, until SIGINT or SIGTERM.
+//The directory is watched, so editors that write a new file and rename it are followed too.
+int dns_sync_watch(const char *filename, dns_sync_load_fn load, void *ctx)
+{
+    char dir_buf[PATH_MAX], base_buf[PATH_MAX];
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct dns_sync_stats stats;
+    struct timespec start;
+    struct pollfd pfds[2];
+    sigset_t signal_mask;
+    const char *dir, *base;
+    int inotify_fd, signal_fd, err;
+    int ret = 0, pending = 1;
+
+    if (strlen(filename) >= sizeof(dir_buf))
+    {
+        return -ENAMETOOLONG;
+    }
+    strcpy(dir_buf, filename);
+    strcpy(base_buf, filename);
+    dir = dirname(dir_buf);
+    base = basename(base_buf);
+
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+    signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC);
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (signal_fd < 0 || inotify_fd < 0 ||
+        inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        printf("ERROR: Failed to watch %s: %s\n", dir, strerror(errno));
+        ret = -errno;
+        goto out;
+    }
+    pfds[0] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+    pfds[1] = (struct pollfd){.fd = inotify_fd, .events = POLLIN};
+
+    for (;;)
+    {
+        //Sync once the file has been quiet for DNS_SYNC_SETTLE_MS
+        int n = poll(pfds, 2, pending ? DNS_SYNC_SETTLE_MS : -1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ret = -errno;
+            break;
+        }
+        if (pfds[0].revents & POLLIN)
+        {
+            break;
+        }
+        if (n == 0 && pending)
+        {
+            pending = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            err = dns_sync_once(filename, load, ctx, &stats);
+            sync_report(filename, err, &stats, &start);
+            continue;
+        }
+
+        if (pfds[1].revents & POLLIN)
+        {
+            ssize_t len = read(inotify_fd, events, sizeof(events));
+            char *p = events;
+
+            while (len > 0 && p < events + len)
+            {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+
+                if (ev->len && strcmp(ev->name, base) == 0)
+                {
+                    pending = 1;
+                }
+                p += sizeof(*ev) + ev->len;
+            }
+        }
+    }
+
+out:
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+    }
+    if (signal_fd >= 0)
+    {
+        close(signal_fd);
+    }
+    return ret;
+}
@@ -0,0 +1,42 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#ifndef DNS_SYNC_H
+#define DNS_SYNC_H
+
+#include <stdint.h>
+#include "dns_batch.h"
+
+//Wait this long after a change of the watched file for more changes before syncing
+#define DNS_SYNC_SETTLE_MS 10
+
+struct dns_sync_stats {
+    uint64_t rrsets;        //RRsets in the file
+    uint64_t updated;       //RRsets written because they are new or changed
+    uint64_t deleted;       //RRsets deleted because they are no longer in the file
+    uint64_t unchanged;
+    uint64_t calls;         //Update and delete syscalls
+};
+
+//Stage the records of filename in b, which writes them to memory. Returns 0, or a negative
+//error if the file could not be read completely; the maps are left alone then.
+typedef int (*dns_sync_load_fn)(const char *filename, struct dns_batch *b, void *ctx);
+
+int dns_sync_once(const char *filename, dns_sync_load_fn load, void *ctx, struct dns_sync_stats *stats);
+int dns_sync_watch(const char *filename, dns_sync_load_fn load, void *ctx);
+
+#endif
@@ -0,0 +1,784 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include "common.h"
+#include "dns_util.h"
+
+//Calculate and insert length octets between DNS name labels. RFC1035 4.1.2
+//A backslash keeps the next character inside its label (\. is a dot, not a separator) or is
+//followed by three decimal digits giving an octet (RFC1035 5.1). A final dot is accepted.
+//Returns the length of the wire-format name including its terminating zero octet, or -1 for
+//an empty or overlong label, a name longer than 255 octets or an invalid escape.
+int replace_dots_with_length_octets(char *dns_name, char *new_dns_name)
+{
+    const unsigned char *p = (const unsigned char *)dns_name;
+    //Position of the length octet of the current label, and of its next octet
+    int len_pos = 0;
+    int out = 1;
+    int label = 0;
+
+    if (*p == 0 || (p[0] == '.' && p[1] == 0))
+    {
+        new_dns_name[0] = 0;
+        return 1;
+    }
+
+    for (;;)
+    {
+        int c = *p++;
+
+        if (c == '.' || c == 0)
+        {
+            if (label == 0)
+            {
+                return -1;
+            }
+            new_dns_name[len_pos] = label;
+            if (c == 0 || *p == 0)
+            {
+                new_dns_name[out] = 0;
+                return out + 1;
+            }
+            len_pos = out++;
+            label = 0;
+            continue;
+        }
+
+        if (c == '\\')
+        {
+            if (isdigit(p[0]) && isdigit(p[1]) && isdigit(p[2]))
+            {
+                c = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+                p += 3;
+            }
+            else
+            {
+                c = *p++;
+            }
+            //Zero octets would end the name for strnlen and the hash
+            if (c == 0 || c > 255)
+            {
+                return -1;
+            }
+        }
+
+        //Labels are at most 63 octets, the name at most 255 including the final zero octet
+        if (label == 63 || out >= MAX_DNS_NAME_LENGTH - 2)
+        {
+            return -1;
+        }
+        new_dns_name[out++] = c;
+        label++;
+    }
+}
+
+//Lowercase a wire-format name in place. The XDP program folds query names
+//to lowercase (RFC 4343), so stored names must be lowercase as well.
+void dns_name_tolower(char *dns_name)
+{
+    int i = 0;
+
+    while (i < MAX_DNS_NAME_LENGTH && dns_name[i] != 0)
+    {
+        int label_length = (uint8_t)dns_name[i];
+        int j;
+
+        for (j = i + 1; j <= i + label_length && j < MAX_DNS_NAME_LENGTH; j++)
+        {
+            dns_name[j] = tolower((unsigned char)dns_name[j]);
+        }
+        i += label_length + 1;
+    }
+}
+
+//Append one octet of a label or character-string in presentation format. Dots, backslashes
+//and quotes are escaped with a backslash, other octets that are not printable as \DDD.
+//Blanks only need no escape within a quoted character-string.
+static size_t text_put_octet(unsigned char c, int quoted, char *text, size_t pos, size_t size)
+{
+    char esc[5];
+    size_t len;
+
+    if (c == '.' || c == '\\' || c == '"')
+    {
+        len = snprintf(esc, sizeof(esc), "\\%c", c);
+    }
+    else if (c < ' ' || (c == ' ' && !quoted) || c >= 0x7f)
+    {
+        len = snprintf(esc, sizeof(esc), "\\%03u", c);
+    }
+    else
+    {
+        esc[0] = c;
+        len = 1;
+    }
+
+    if (pos + len >= size)
+    {
+        return pos;
+    }
+    memcpy(text + pos, esc, len);
+    return pos + len;
+}
+
+//Turn a wire-format name into dotted form, escaping octets within labels so the result
+//reads back with replace_dots_with_length_octets. size should be DNS_NAME_TEXT_LENGTH.
+void replace_length_octets_with_dots(char *dns_name, char *new_dns_name, size_t size)
+{
+    size_t pos = 0;
+    int i = 0;
+
+    while (i < MAX_DNS_NAME_LENGTH && dns_name[i] != 0)
+    {
+        int label_length = (uint8_t)dns_name[i++];
+
+        if (pos > 0 && pos + 1 < size)
+        {
+            new_dns_name[pos++] = '.';
+        }
+        for (; label_length > 0 && i < MAX_DNS_NAME_LENGTH; label_length--, i++)
+        {
+            pos = text_put_octet(dns_name[i], 0, new_dns_name, pos, size);
+        }
+    }
+    new_dns_name[pos] = 0;
+}
+
+//Hash a zero-padded wire-format name exactly like parse_query does in the kernel
+uint64_t dns_name_hash(const char *dns_name)
+{
+    uint64_t hash = DNS_NAME_HASH_SEED;
+    size_t name_len = strnlen(dns_name, MAX_DNS_NAME_LENGTH - 1);
+    size_t i;
+
+    //Hash every word up to and including the one holding the terminating zero octet
+    for (i = 0; i <= name_len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, dns_name + i, sizeof(word));
+        hash = dns_name_hash_word(hash, le64toh(word));
+    }
+
+    return hash;
+}
+
+//Check of a zero-padded wire-format name, computed by parse_query next to the hash
+uint64_t dns_name_check(const char *dns_name)
+{
+    uint64_t check = DNS_NAME_CHECK_SEED;
+    size_t name_len = strnlen(dns_name, MAX_DNS_NAME_LENGTH - 1);
+    size_t i;
+
+    for (i = 0; i <= name_len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, dns_name + i, sizeof(word));
+        check = dns_name_check_word(check, le64toh(word));
+    }
+
+    return check;
+}
+
+//Open the pinned map of record names. Returns -1 without a message if there is none.
+int dns_names_open(void)
+{
+    return bpf_obj_get(XDNS_NAMES_PATH);
+}
+
+//Set the key and value of a zero-padded wire-format name in xdns_names
+void dns_names_entry(const char *dns_name, struct dns_key *key, struct dns_name *value)
+{
+    memset(key, 0, sizeof(*key));
+    key->name_hash = dns_name_hash(dns_name);
+    memset(value, 0, sizeof(*value));
+    value->name_check = dns_name_check(dns_name);
+    memcpy(value->name, dns_name, strnlen(dns_name, MAX_DNS_NAME_LENGTH - 1));
+}
+
+//Remember a zero-padded wire-format name, for listing and for xdp_dns to compare questions with.
+//Returns 0, or -1 with errno set.
+int dns_names_put(int fd, const char *dns_name)
+{
+    struct dns_key key;
+    struct dns_name value;
+
+    dns_names_entry(dns_name, &key, &value);
+    return bpf_map_update_elem(fd, &key, &value, BPF_ANY);
+}
+
+//Look up the name of the records with name_hash and name_check in xdns_names.
+//Returns 0 with the wire-format name in dns_name, or -1 if the name is not known.
+int dns_names_get(int fd, uint64_t name_hash, uint64_t name_check, char *dns_name)
+{
+    struct dns_key key;
+    struct dns_name value;
+
+    memset(&key, 0, sizeof(key));
+    key.name_hash = name_hash;
+    if (fd < 0 || bpf_map_lookup_elem(fd, &key, &value) != 0 || value.name_check != name_check)
+    {
+        return -1;
+    }
+    memcpy(dns_name, value.name, MAX_DNS_NAME_LENGTH);
+    return 0;
+}
+
+//Add an address to an A RRset and set the TTL of the RRset.
+//Adding an address that is already present only updates the TTL. Returns -1 if the RRset is full.
+int a_rrset_add(struct a_record *a, struct in_addr ip_addr, uint32_t ttl)
+{
+    int i;
+
+    for (i = 0; i < a->count; i++)
+    {
+        if (a->ip_addr[i].s_addr == ip_addr.s_addr)
+        {
+            a->ttl = ttl;
+            return 0;
+        }
+    }
+    if (a->count >= MAX_RRSET_SIZE)
+    {
+        return -1;
+    }
+
+    a->ip_addr[a->count++] = ip_addr;
+    a->ttl = ttl;
+    return 0;
+}
+
+//Remove an address from an A RRset. Returns -1 if the address is not present.
+int a_rrset_remove(struct a_record *a, struct in_addr ip_addr)
+{
+    int i;
+
+    for (i = 0; i < a->count; i++)
+    {
+        if (a->ip_addr[i].s_addr == ip_addr.s_addr)
+        {
+            a->ip_addr[i] = a->ip_addr[--a->count];
+            memset(&a->ip_addr[a->count], 0, sizeof(a->ip_addr[0]));
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+//Add an address to an AAAA RRset, see a_rrset_add
+int aaaa_rrset_add(struct aaaa_record *a, struct in6_addr ip_addr, uint32_t ttl)
+{
+    int i;
+
+    for (i = 0; i < a->count; i++)
+    {
+        if (memcmp(&a->ip_addr[i], &ip_addr, sizeof(ip_addr)) == 0)
+        {
+            a->ttl = ttl;
+            return 0;
+        }
+    }
+    if (a->count >= MAX_RRSET_SIZE)
+    {
+        return -1;
+    }
+
+    a->ip_addr[a->count++] = ip_addr;
+    a->ttl = ttl;
+    return 0;
+}
+
+//Remove an address from an AAAA RRset, see a_rrset_remove
+int aaaa_rrset_remove(struct aaaa_record *a, struct in6_addr ip_addr)
+{
+    int i;
+
+    for (i = 0; i < a->count; i++)
+    {
+        if (memcmp(&a->ip_addr[i], &ip_addr, sizeof(ip_addr)) == 0)
+        {
+            a->ip_addr[i] = a->ip_addr[--a->count];
+            memset(&a->ip_addr[a->count], 0, sizeof(a->ip_addr[0]));
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+//Record types that are stored pre-serialized in the generic record map
+static const struct {
+    uint16_t type;
+    const char *name;
+} rr_types[] = {
+    {NS_RECORD_TYPE, "NS"},
+    {CNAME_RECORD_TYPE, "CNAME"},
+    {PTR_RECORD_TYPE, "PTR"},
+    {MX_RECORD_TYPE, "MX"},
+    {TXT_RECORD_TYPE, "TXT"},
+    {SRV_RECORD_TYPE, "SRV"},
+};
+
+//Return the type of a generic record type name (case-insensitive), or 0 if it is not supported
+uint16_t rr_type_from_name(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(rr_types) / sizeof(rr_types[0]); i++)
+    {
+        if (strcasecmp(name, rr_types[i].name) == 0)
+        {
+            return rr_types[i].type;
+        }
+    }
+
+    return 0;
+}
+
+const char *rr_type_to_name(uint16_t type)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(rr_types) / sizeof(rr_types[0]); i++)
+    {
+        if (rr_types[i].type == type)
+        {
+            return rr_types[i].name;
+        }
+    }
+
+    return "UNKNOWN";
+}
+
+//Append a domain name in wire format to rdata. Returns the new rdata length or -1.
+static int rdata_put_name(const char *name, char *rdata, int len, size_t size)
+{
+    char dns_name[MAX_DNS_NAME_LENGTH];
+    int name_len;
+
+    memset(dns_name, 0, sizeof(dns_name));
+    name_len = replace_dots_with_length_octets((char *)name, dns_name);
+    dns_name_tolower(dns_name);
+    if (name_len < 0 || len + name_len > size)
+    {
+        return -1;
+    }
+
+    memcpy(rdata + len, dns_name, name_len);
+    return len + name_len;
+}
+
+//Append a 16-bit value in network byte order to rdata. Returns the new rdata length or -1.
+static int rdata_put_u16(long value, char *rdata, int len, size_t size)
+{
+    uint16_t val = htons((uint16_t)value);
+
+    if (value < 0 || value > 0xffff || len + sizeof(val) > size)
+    {
+        return -1;
+    }
+
+    memcpy(rdata + len, &val, sizeof(val));
+    return len + sizeof(val);
+}
+
+//Encode TXT character-strings given as "quoted" "strings", each one of them becomes a
+//character-string of its own. Escapes are those of replace_dots_with_length_octets.
+//Returns the RDATA length, or -1.
+static int rdata_put_strings(const char *value, char *rdata, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)value;
+    int len = 0;
+
+    while (*p)
+    {
+        int len_pos = len++;
+        int chunk = 0;
+
+        if (*p++ != '"')
+        {
+            return -1;
+        }
+        while (*p != '"')
+        {
+            int c = *p++;
+
+            if (c == 0)
+            {
+                return -1;
+            }
+            if (c == '\\')
+            {
+                if (isdigit(p[0]) && isdigit(p[1]) && isdigit(p[2]))
+                {
+                    c = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+                    p += 3;
+                }
+                else if (*p)
+                {
+                    c = *p++;
+                }
+                if (c > 255)
+                {
+                    return -1;
+                }
+            }
+            if (chunk == 255 || len + 1 > size)
+            {
+                return -1;
+            }
+            rdata[len++] = c;
+            chunk++;
+        }
+        if (len_pos >= size)
+        {
+            return -1;
+        }
+        rdata[len_pos] = chunk;
+        p++;
+
+        //Strings are separated by blanks
+        if (*p && !isspace(*p))
+        {
+            return -1;
+        }
+        while (isspace(*p))
+        {
+            p++;
+        }
+    }
+
+    return len > 0 ? len : -1;
+}
+
+//Encode the presentation format of a record value as RDATA:
+//  NS, CNAME, PTR: "target.name"
+//  MX:             "preference exchange.name"
+//  SRV:            "priority weight port target.name"
+//  TXT:            '"one string" "another"', every quoted string a character-string of its own,
+//                  or unquoted text, split into character-strings of at most 255 octets
+//Returns the RDATA length, or -1 if the value is invalid or does not fit.
+int rr_rdata_from_text(uint16_t type, const char *value, char *rdata, size_t size)
+{
+    char name[DNS_NAME_TEXT_LENGTH];
+    long a, b, c;
+    int len = 0;
+
+    switch (type)
+    {
+    case NS_RECORD_TYPE:
+    case CNAME_RECORD_TYPE:
+    case PTR_RECORD_TYPE:
+        return rdata_put_name(value, rdata, 0, size);
+
+    case MX_RECORD_TYPE:
+        if (sscanf(value, "%ld %1023s", &a, name) != 2)
+        {
+            return -1;
+        }
+        len = rdata_put_u16(a, rdata, len, size);
+        return len < 0 ? -1 : rdata_put_name(name, rdata, len, size);
+
+    case SRV_RECORD_TYPE:
+        if (sscanf(value, "%ld %ld %ld %1023s", &a, &b, &c, name) != 4)
+        {
+            return -1;
+        }
+        len = rdata_put_u16(a, rdata, len, size);
+        len = len < 0 ? -1 : rdata_put_u16(b, rdata, len, size);
+        len = len < 0 ? -1 : rdata_put_u16(c, rdata, len, size);
+        return len < 0 ? -1 : rdata_put_name(name, rdata, len, size);
+
+    case TXT_RECORD_TYPE:
+    {
+        size_t remaining = strlen(value);
+        if (*value == '"')
+        {
+            return rdata_put_strings(value, rdata, size);
+        }
+        do
+        {
+            size_t chunk = remaining > 255 ? 255 : remaining;
+            if (len + 1 + chunk > size)
+            {
+                return -1;
+            }
+            rdata[len++] = (char)chunk;
+            memcpy(rdata + len, value, chunk);
+            len += chunk;
+            value += chunk;
+            remaining -= chunk;
+        } while (remaining > 0);
+        return len;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+//Decode a domain name in rdata into dotted form
+static void rdata_get_name(const char *rdata, int len, char *text, size_t size)
+{
+    char dns_name[MAX_DNS_NAME_LENGTH];
+    char dotted[DNS_NAME_TEXT_LENGTH];
+
+    memset(dns_name, 0, sizeof(dns_name));
+    memcpy(dns_name, rdata, len < MAX_DNS_NAME_LENGTH - 1 ? len : MAX_DNS_NAME_LENGTH - 1);
+    replace_length_octets_with_dots(dns_name, dotted, sizeof(dotted));
+    snprintf(text, size, "%s", dotted);
+}
+
+//Format RDATA of a generic record in the presentation format accepted by rr_rdata_from_text
+void rr_rdata_to_text(uint16_t type, const char *rdata, int len, char *text, size_t size)
+{
+    char name[DNS_NAME_TEXT_LENGTH];
+    uint16_t a, b, c;
+    int i, pos;
+
+    text[0] = 0;
+    switch (type)
+    {
+    case NS_RECORD_TYPE:
+    case CNAME_RECORD_TYPE:
+    case PTR_RECORD_TYPE:
+        rdata_get_name(rdata, len, text, size);
+        break;
+
+    case MX_RECORD_TYPE:
+        if (len < 3)
+        {
+            break;
+        }
+        memcpy(&a, rdata, 2);
+        rdata_get_name(rdata + 2, len - 2, name, sizeof(name));
+        snprintf(text, size, "%u %s", ntohs(a), name);
+        break;
+
+    case SRV_RECORD_TYPE:
+        if (len < 7)
+        {
+            break;
+        }
+        memcpy(&a, rdata, 2);
+        memcpy(&b, rdata + 2, 2);
+        memcpy(&c, rdata + 4, 2);
+        rdata_get_name(rdata + 6, len - 6, name, sizeof(name));
+        snprintf(text, size, "%u %u %u %s", ntohs(a), ntohs(b), ntohs(c), name);
+        break;
+
+    case TXT_RECORD_TYPE:
+        //Every character-string quoted on its own, so the boundaries between them are kept
+        for (i = 0, pos = 0; i < len && pos + 3 < size; )
+        {
+            int chunk = (uint8_t)rdata[i++];
+            if (pos > 0)
+            {
+                text[pos++] = ' ';
+            }
+            text[pos++] = '"';
+            for (; chunk > 0 && i < len; chunk--)
+            {
+                pos = text_put_octet(rdata[i++], 1, text, pos, size - 1);
+            }
+            text[pos++] = '"';
+        }
+        text[pos < size ? pos : size - 1] = 0;
+        break;
+    }
+}
+
+//Find the RR of the given type and RDATA in a generic record.
+//Returns its offset in r->data, or -1 if it is not present.
+static int rr_record_find(struct rr_record *r, uint16_t type, const char *rdata, int rdata_len)
+{
+    int offset = 0;
+    int i;
+
+    for (i = 0; i < r->ans_count && offset + sizeof(struct dns_response) <= r->data_length; i++)
+    {
+        struct dns_response *rr = (struct dns_response *)&r->data[offset];
+        int len = ntohs(rr->data_length);
+
+        if (ntohs(rr->record_type) == type && len == rdata_len &&
+            memcmp(&r->data[offset + sizeof(struct dns_response)], rdata, len) == 0)
+        {
+            return offset;
+        }
+        offset += sizeof(struct dns_response) + len;
+    }
+
+    return -1;
+}
+
+//Add an RR to a generic record. The RR is serialized the way it is sent: the owner
+//name is a compression pointer to the question, followed by type, class, TTL and RDATA.
+//Adding an RR that is already present only updates its TTL. Returns -1 if the record is full.
+int rr_record_add(struct rr_record *r, uint16_t type, const char *rdata, int rdata_len, uint32_t ttl)
+{
+    int offset = rr_record_find(r, type, rdata, rdata_len);
+    struct dns_response *rr;
+
+    if (offset < 0)
+    {
+        offset = r->data_length;
+        if (offset + sizeof(struct dns_response) + rdata_len > MAX_RR_DATA_LENGTH)
+        {
+            return -1;
+        }
+        memcpy(&r->data[offset + sizeof(struct dns_response)], rdata, rdata_len);
+        r->data_length += sizeof(struct dns_response) + rdata_len;
+        r->ans_count++;
+    }
+
+    //A name has at most one CNAME. Its target is hashed here, the kernel follows the chain by the hash
+    //and verifies every name of it with the check.
+    if (type == CNAME_RECORD_TYPE)
+    {
+        char target[MAX_DNS_NAME_LENGTH];
+        memset(target, 0, sizeof(target));
+        memcpy(target, rdata, rdata_len < sizeof(target) ? rdata_len : sizeof(target) - 1);
+        r->target_hash = dns_name_hash(target);
+        r->target_check = dns_name_check(target);
+    }
+
+    rr = (struct dns_response *)&r->data[offset];
+    rr->query_pointer = htons(0xc00c);
+    rr->record_type = htons(type);
+    rr->class = htons(DNS_CLASS_IN);
+    rr->ttl = htonl(ttl);
+    rr->data_length = htons(rdata_len);
+    return 0;
+}
+
+//Remove an RR from a generic record. Returns -1 if it is not present.
+int rr_record_remove(struct rr_record *r, uint16_t type, const char *rdata, int rdata_len)
+{
+    int offset = rr_record_find(r, type, rdata, rdata_len);
+    int rr_len = sizeof(struct dns_response) + rdata_len;
+
+    if (offset < 0)
+    {
+        return -1;
+    }
+
+    memmove(&r->data[offset], &r->data[offset + rr_len], r->data_length - offset - rr_len);
+    r->data_length -= rr_len;
+    memset(&r->data[r->data_length], 0, rr_len);
+    r->ans_count--;
+    return 0;
+}
+
+int get_map_fd(const char *map_path)
+{
+    int fd = bpf_obj_get(map_path);
+    if (fd < 0)
+    {
+        if (errno == EACCES)
+        {
+            printf("ERROR: Permission denied while trying to access %s\n", map_path);
+        }
+        else if (errno == ENOENT)
+        {
+            printf("ERROR: Could not find BPF maps. Load XDP program with iproute2 first.\n");
+        }
+        else
+        {
+            printf("ERROR: BPF map error: %d (%s)\n", errno, strerror(errno));
+        }
+    }
+    return fd;
+}
+
+//Offset of CLOCK_BOOTTIME from the epoch in ns, changes with every boot
+int64_t dns_boot_to_unix_ns(void)
+{
+    struct timespec boot, wall;
+
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    return ((int64_t)wall.tv_sec - boot.tv_sec) * 1000000000LL + (wall.tv_nsec - boot.tv_nsec);
+}
+
+uint64_t dns_now_boot_ns(void)
+{
+    struct timespec boot;
+
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    return (uint64_t)boot.tv_sec * 1000000000ULL + boot.tv_nsec;
+}
+
+//Expiry of a record from a Unix time in seconds, 0 stays 0 (never)
+uint64_t dns_expiry_from_unix(uint64_t unix_sec)
+{
+    int64_t expires;
+
+    if (!unix_sec)
+    {
+        return 0;
+    }
+    expires = (int64_t)(unix_sec * 1000000000ULL) - dns_boot_to_unix_ns();
+    //Already past: expire at once rather than never
+    if (expires <= 0)
+    {
+        return 1;
+    }
+    //Whole seconds, so the same Unix time gives the same value in the maps every time
+    //and sync does not see the RRset as changed
+    return (expires + 999999999) / 1000000000 * 1000000000;
+}
+
+uint64_t dns_expiry_to_unix(uint64_t expires)
+{
+    if (!expires)
+    {
+        return 0;
+    }
+    return (uint64_t)((int64_t)expires + dns_boot_to_unix_ns()) / 1000000000ULL;
+}
+
+//Parse an expiry given as '@' and a Unix time or '+' and a number of seconds from now.
+//Returns 0 or -EINVAL.
+int dns_expiry_parse(const char *text, uint64_t *expires)
+{
+    uint64_t seconds;
+
+    if ((text[0] != '@' && text[0] != '+') || !text[1] || strspn(text + 1, "0123456789") != strlen(text + 1))
+    {
+        return -EINVAL;
+    }
+    seconds = strtoull(text + 1, NULL, 10);
+    if (text[0] == '@')
+    {
+        *expires = dns_expiry_from_unix(seconds);
+    }
+    else
+    {
+        *expires = dns_now_boot_ns() + seconds * 1000000000ULL;
+    }
+    return 0;
+}
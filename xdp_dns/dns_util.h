@@ -0,0 +1,64 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#ifndef DNS_UTIL_H
+#define DNS_UTIL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include "common.h"
+
+//Userspace helpers shared by xdp_dns_update and the other xdp_dns tools
+//Longest dotted name, every octet of a wire-format name may be escaped as \DDD
+#define DNS_NAME_TEXT_LENGTH (4 * MAX_DNS_NAME_LENGTH)
+
+int get_map_fd(const char *map_path);
+int replace_dots_with_length_octets(char *dns_name, char *new_dns_name);
+void replace_length_octets_with_dots(char *dns_name, char *new_dns_name, size_t size);
+void dns_name_tolower(char *dns_name);
+uint64_t dns_name_hash(const char *dns_name);
+uint64_t dns_name_check(const char *dns_name);
+
+//Names of the records, kept apart from them for listing, see struct dns_name
+#define XDNS_NAMES_PATH "/sys/fs/bpf/xdns_names"
+
+int dns_names_open(void);
+void dns_names_entry(const char *dns_name, struct dns_key *key, struct dns_name *value);
+int dns_names_put(int fd, const char *dns_name);
+int dns_names_get(int fd, uint64_t name_hash, uint64_t name_check, char *dns_name);
+
+int a_rrset_add(struct a_record *a, struct in_addr ip_addr, uint32_t ttl);
+int a_rrset_remove(struct a_record *a, struct in_addr ip_addr);
+int aaaa_rrset_add(struct aaaa_record *a, struct in6_addr ip_addr, uint32_t ttl);
+int aaaa_rrset_remove(struct aaaa_record *a, struct in6_addr ip_addr);
+
+uint16_t rr_type_from_name(const char *name);
+const char *rr_type_to_name(uint16_t type);
+int rr_rdata_from_text(uint16_t type, const char *value, char *rdata, size_t size);
+void rr_rdata_to_text(uint16_t type, const char *rdata, int len, char *text, size_t size);
+int rr_record_add(struct rr_record *r, uint16_t type, const char *rdata, int rdata_len, uint32_t ttl);
+int rr_record_remove(struct rr_record *r, uint16_t type, const char *rdata, int rdata_len);
+
+//Record expiries are CLOCK_BOOTTIME ns, the clock of bpf_ktime_get_boot_ns()
+uint64_t dns_now_boot_ns(void);
+int64_t dns_boot_to_unix_ns(void);
+uint64_t dns_expiry_from_unix(uint64_t unix_sec);
+uint64_t dns_expiry_to_unix(uint64_t expires);
+int dns_expiry_parse(const char *text, uint64_t *expires);
+
+#endif
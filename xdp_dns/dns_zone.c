@@ -0,0 +1,665 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include "dns_util.h"
+#include "dns_batch.h"
+#include "dns_zone.h"
+
+const char *zone_outer_names[ZONE_MAPS] = {"xdns_a_zone", "xdns_aaaa_zone", "xdns_rr_zone"};
+const char *zone_active_name = "xdns_zone_active";
+
+//Names of the record maps as shown by bpftool, at most BPF_OBJ_NAME_LEN - 1 characters
+static const char *zone_record_names[ZONE_MAPS] = {"xdns_a_records", "xdns_aaaa_recs", "xdns_rr_records"};
+static const size_t zone_value_sizes[ZONE_MAPS] = {sizeof(struct a_record), sizeof(struct aaaa_record),
+                                                    sizeof(struct rr_record)};
+
+static void zone_clear(int fds[ZONE_MAPS])
+{
+    int i;
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        fds[i] = -1;
+    }
+}
+
+static int zone_pinned_fd(const char *name)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/sys/fs/bpf/%s", name);
+    return get_map_fd(path);
+}
+
+//Open the pinned arrays of maps
+int zone_outer_open(int outer_fds[ZONE_MAPS])
+{
+    int i;
+
+    zone_clear(outer_fds);
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        outer_fds[i] = zone_pinned_fd(zone_outer_names[i]);
+        if (outer_fds[i] < 0)
+        {
+            zone_close(outer_fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Return the slot the XDP program answers from, or -1
+int zone_active_slot(void)
+{
+    uint32_t key = 0, slot = 0;
+    int fd = zone_pinned_fd(zone_active_name);
+    int ret = -1;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (bpf_map_lookup_elem(fd, &key, &slot) == 0)
+    {
+        ret = slot & (XDNS_ZONE_SLOTS - 1);
+    }
+    close(fd);
+    return ret;
+}
+
+//Publish the zone of a slot. Queries that are in flight finish with the zone they started with.
+int zone_activate(uint32_t slot)
+{
+    uint32_t key = 0;
+    int fd = zone_pinned_fd(zone_active_name);
+    int ret;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ret = bpf_map_update_elem(fd, &key, &slot, BPF_ANY);
+    close(fd);
+    return ret;
+}
+
+//Open the record maps of a slot. Returns -1 if the slot holds no zone.
+int zone_open(const int outer_fds[ZONE_MAPS], uint32_t slot, int fds[ZONE_MAPS])
+{
+    int i;
+
+    zone_clear(fds);
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        uint32_t id;
+
+        //Userspace reads the id of an inner map, not its fd
+        if (bpf_map_lookup_elem(outer_fds[i], &slot, &id) == 0)
+        {
+            fds[i] = bpf_map_get_fd_by_id(id);
+        }
+        if (fds[i] < 0)
+        {
+            zone_close(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Open the record maps that queries are answered from
+int zone_open_active(int fds[ZONE_MAPS])
+{
+    int outer_fds[ZONE_MAPS];
+    int slot = zone_active_slot();
+    int ret;
+
+    if (slot < 0 || zone_outer_open(outer_fds) < 0)
+    {
+        return -1;
+    }
+    ret = zone_open(outer_fds, slot, fds);
+    if (ret < 0)
+    {
+        printf("ERROR: Zone slot %d holds no record maps. Start xdp_dns first.\n", slot);
+    }
+    zone_close(outer_fds);
+    return ret;
+}
+
+//Create empty record maps
+int zone_create(uint32_t max_entries, uint32_t map_flags, int fds[ZONE_MAPS])
+{
+    int i;
+
+    zone_clear(fds);
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        fds[i] = bpf_create_map_name(BPF_MAP_TYPE_HASH, zone_record_names[i], sizeof(struct dns_key),
+                                     zone_value_sizes[i], max_entries, map_flags);
+        if (fds[i] < 0)
+        {
+            printf("ERROR: Failed to create %s: %s\n", zone_record_names[i], strerror(errno));
+            zone_close(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Create empty record maps with the size and flags of other ones.
+//The kernel only accepts record maps whose flags match the first ones of the arrays.
+int zone_create_like(const int like_fds[ZONE_MAPS], int fds[ZONE_MAPS])
+{
+    int i;
+
+    zone_clear(fds);
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        struct bpf_map_info info;
+        uint32_t info_len = sizeof(info);
+
+        memset(&info, 0, sizeof(info));
+        if (bpf_obj_get_info_by_fd(like_fds[i], &info, &info_len) == 0)
+        {
+            fds[i] = bpf_create_map_name(BPF_MAP_TYPE_HASH, zone_record_names[i], sizeof(struct dns_key),
+                                         zone_value_sizes[i], info.max_entries, info.map_flags);
+        }
+        if (fds[i] < 0)
+        {
+            printf("ERROR: Failed to create %s: %s\n", zone_record_names[i], strerror(errno));
+            zone_close(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Put record maps into a slot. The maps previously in the slot are freed once no query uses them.
+int zone_install(const int outer_fds[ZONE_MAPS], uint32_t slot, const int fds[ZONE_MAPS])
+{
+    int i;
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        uint32_t fd = fds[i];
+
+        if (bpf_map_update_elem(outer_fds[i], &slot, &fd, BPF_ANY) != 0)
+        {
+            printf("ERROR: Failed to install %s in slot %u: %s\n", zone_record_names[i], slot, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void zone_close(int fds[ZONE_MAPS])
+{
+    int i;
+
+    for (i = 0; i < ZONE_MAPS; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+        fds[i] = -1;
+    }
+}
+
+//RRsets of the active zone on their way into the new zone of a swap
+struct zone_carry {
+    int fd;                 //Record map of the new zone
+    size_t value_size;
+    size_t flags_offset;
+    size_t expires_offset;
+    uint64_t now;
+    uint32_t count;
+    struct dns_key keys[DNS_BATCH_SIZE];
+    char values[DNS_BATCH_SIZE * sizeof(struct rr_record)];
+    struct dns_table *table;    //RRsets of the second pass
+    uint64_t carried;
+    uint64_t calls;
+    int err;
+};
+
+//Flag of second pass table entries the new zone holds a newer RRset for
+#define ZONE_CARRY_SKIP 2
+
+static const size_t zone_flags_offsets[ZONE_MAPS] = {offsetof(struct a_record, flags),
+                                                     offsetof(struct aaaa_record, flags),
+                                                     offsetof(struct rr_record, flags)};
+static const size_t zone_expires_offsets[ZONE_MAPS] = {offsetof(struct a_record, expires),
+                                                       offsetof(struct aaaa_record, expires),
+                                                       offsetof(struct rr_record, expires)};
+
+static int zone_carry_write(struct zone_carry *c)
+{
+    c->err = dns_map_update(c->fd, c->keys, c->values, c->value_size, c->count, &c->calls);
+    c->carried += c->count;
+    c->count = 0;
+    return c->err;
+}
+
+//Whether an RRset was added at runtime, by add, serve or xdp_dns_fill, and has not expired.
+//The RRsets of a file are replaced by the new zone, expired ones are left for good.
+static int zone_carry_runtime(const struct zone_carry *c, const void *value)
+{
+    uint16_t flags;
+    uint64_t expires;
+
+    memcpy(&flags, (const char *)value + c->flags_offset, sizeof(flags));
+    memcpy(&expires, (const char *)value + c->expires_offset, sizeof(expires));
+    return !(flags & XDNS_RECORD_FILE) && (!expires || expires > c->now);
+}
+
+static int zone_carry_add(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct zone_carry *c = ctx;
+
+    if (!zone_carry_runtime(c, value))
+    {
+        return 0;
+    }
+    c->keys[c->count] = *key;
+    memcpy(c->values + c->count * c->value_size, value, c->value_size);
+    if (++c->count == DNS_BATCH_SIZE)
+    {
+        return zone_carry_write(c);
+    }
+    return 0;
+}
+
+static int zone_carry_collect(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct zone_carry *c = ctx;
+
+    if (zone_carry_runtime(c, value))
+    {
+        c->err = dns_table_put(c->table, key, value);
+    }
+    return c->err;
+}
+
+//Skip the collected RRsets the new zone holds from a file, without an expiry, or with the same or a later one
+static int zone_carry_compare(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct zone_carry *c = ctx;
+    uint8_t *flags;
+    const char *old = dns_table_lookup(c->table, key, &flags);
+    uint16_t record_flags;
+    uint64_t expires, old_expires;
+
+    if (!old)
+    {
+        return 0;
+    }
+    memcpy(&record_flags, (const char *)value + c->flags_offset, sizeof(record_flags));
+    memcpy(&expires, (const char *)value + c->expires_offset, sizeof(expires));
+    memcpy(&old_expires, old + c->expires_offset, sizeof(old_expires));
+    if ((record_flags & XDNS_RECORD_FILE) || !expires || expires >= old_expires)
+    {
+        *flags |= ZONE_CARRY_SKIP;
+    }
+    return 0;
+}
+
+//Second pass over one map: write the runtime RRsets of from that to does not hold in a newer
+//version, with batched dumps of both maps and batched updates.
+static int zone_carry_late(struct zone_carry *c, int from_fd, int to_fd)
+{
+    size_t i;
+    int err;
+
+    c->table = dns_table_new(c->value_size);
+    if (!c->table)
+    {
+        return -ENOMEM;
+    }
+    err = dns_map_dump(from_fd, c->value_size, zone_carry_collect, c);
+    if (err >= 0 && !c->err)
+    {
+        err = dns_map_dump(to_fd, c->value_size, zone_carry_compare, c);
+    }
+    if (err >= 0)
+    {
+        err = c->err;
+    }
+    for (i = 0; i < c->table->size && !err; i++)
+    {
+        if (c->table->flags[i] != DNS_TABLE_USED)
+        {
+            continue;
+        }
+        c->keys[c->count] = c->table->keys[i];
+        memcpy(c->values + c->count * c->value_size, c->table->values + i * c->value_size, c->value_size);
+        if (++c->count == DNS_BATCH_SIZE)
+        {
+            err = zone_carry_write(c);
+        }
+    }
+    dns_table_free(c->table);
+    c->table = NULL;
+    return err;
+}
+
+//Copy the RRsets added at runtime by add, serve or xdp_dns_fill from the zone of slot into
+//to_fds. A zone built from a file does not know them, they would be dropped by the swap.
+//The first pass runs before the file is written, so the file's RRsets overwrite them with
+//plain batched updates. The late pass runs once the new zone answers, for the RRsets written
+//into the old one in the meantime. Returns the number copied or -1.
+static int64_t zone_carry(struct zone_swap *swap, int slot, const int to_fds[ZONE_MAPS], int late)
+{
+    struct zone_carry *c = calloc(1, sizeof(*c));
+    int from_fds[ZONE_MAPS];
+    int64_t carried = -1;
+    int i, err = 0;
+
+    if (!c)
+    {
+        printf("ERROR: Failed to allocate memory\n");
+        return -1;
+    }
+    if (zone_open(swap->outer_fds, slot, from_fds) < 0)
+    {
+        free(c);
+        return -1;
+    }
+
+    c->now = dns_now_boot_ns();
+    for (i = 0; i < ZONE_MAPS && err >= 0; i++)
+    {
+        c->fd = to_fds[i];
+        c->value_size = zone_value_sizes[i];
+        c->flags_offset = zone_flags_offsets[i];
+        c->expires_offset = zone_expires_offsets[i];
+        if (late)
+        {
+            err = zone_carry_late(c, from_fds[i], to_fds[i]);
+        }
+        else
+        {
+            err = dns_map_dump(from_fds[i], zone_value_sizes[i], zone_carry_add, c);
+            if (err >= 0)
+            {
+                err = c->err;
+            }
+        }
+        if (err >= 0 && c->count)
+        {
+            err = zone_carry_write(c);
+        }
+    }
+    if (err < 0)
+    {
+        printf("ERROR: Failed to copy the runtime records into the new zone: %s\n", strerror(-err));
+    }
+    else
+    {
+        carried = c->carried;
+    }
+
+    zone_close(from_fds);
+    free(c);
+    return carried;
+}
+
+//Names of xdns_names on their way to be pruned
+struct zone_prune {
+    struct dns_table *live;     //Name hashes some record still holds
+    struct dns_key *names;      //Names held before the records were read
+    uint32_t count;
+    uint32_t size;
+    int err;
+};
+
+static const char *zone_snoop_names[] = {"xdns_snoop_a", "xdns_snoop_aaaa"};
+static const size_t zone_snoop_value_sizes[] = {sizeof(struct a_record), sizeof(struct aaaa_record)};
+
+static int zone_prune_collect(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct zone_prune *p = ctx;
+
+    (void)value;
+    if (p->count == p->size)
+    {
+        uint32_t size = p->size ? p->size * 2 : DNS_BATCH_SIZE;
+        struct dns_key *names = realloc(p->names, size * sizeof(*names));
+
+        if (!names)
+        {
+            return p->err = -ENOMEM;
+        }
+        p->names = names;
+        p->size = size;
+    }
+    p->names[p->count++] = *key;
+    return 0;
+}
+
+static int zone_prune_live(const struct dns_key *key, const void *value, void *ctx)
+{
+    struct zone_prune *p = ctx;
+    struct dns_key name = {.name_hash = key->name_hash};
+    char used = 1;
+
+    (void)value;
+    if (!dns_table_lookup(p->live, &name, NULL))
+    {
+        p->err = dns_table_put(p->live, &name, &used);
+    }
+    return p->err;
+}
+
+//Read the keys of one record map into the live names, a missing map holds none
+static int zone_prune_map(struct zone_prune *p, int fd, size_t value_size)
+{
+    int err;
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+    err = dns_map_dump(fd, value_size, zone_prune_live, p);
+    return err < 0 ? err : p->err;
+}
+
+//Delete the names of xdns_names that no record of either zone slot, nor a snooped answer of
+//tc_dns, holds any longer. The names are read before the records, so a name written with its
+//record meanwhile is kept. A stale name whose record is written again between the read of its
+//map and the delete is lost, the record is passed on to the resolver until written once more.
+//Returns the number of names deleted, or -1.
+int64_t zone_names_prune(uint64_t *calls)
+{
+    struct zone_prune p = {0};
+    int outer_fds[ZONE_MAPS], fds[ZONE_MAPS];
+    int names_fd = dns_names_open();
+    int64_t pruned = -1;
+    uint32_t i, stale = 0;
+    int slot, err;
+
+    if (names_fd < 0)
+    {
+        return 0;
+    }
+    p.live = dns_table_new(1);
+    if (!p.live || zone_outer_open(outer_fds) < 0)
+    {
+        goto out;
+    }
+
+    err = dns_map_dump(names_fd, sizeof(struct dns_name), zone_prune_collect, &p);
+    for (slot = 0; slot < XDNS_ZONE_SLOTS && err >= 0 && !p.err; slot++)
+    {
+        if (zone_open(outer_fds, slot, fds) < 0)
+        {
+            continue;
+        }
+        for (i = 0; i < ZONE_MAPS && err >= 0; i++)
+        {
+            err = zone_prune_map(&p, fds[i], zone_value_sizes[i]);
+        }
+        zone_close(fds);
+    }
+    for (i = 0; i < sizeof(zone_snoop_names) / sizeof(zone_snoop_names[0]) && err >= 0 && !p.err; i++)
+    {
+        char path[64];
+        int fd;
+
+        snprintf(path, sizeof(path), "/sys/fs/bpf/%s", zone_snoop_names[i]);
+        fd = bpf_obj_get(path);
+        err = zone_prune_map(&p, fd, zone_snoop_value_sizes[i]);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    zone_close(outer_fds);
+    if (err >= 0)
+    {
+        err = p.err;
+    }
+
+    //Move the names to delete to the front and delete them in batches
+    for (i = 0; i < p.count && err >= 0; i++)
+    {
+        if (dns_table_lookup(p.live, &p.names[i], NULL))
+        {
+            continue;
+        }
+        p.names[stale++] = p.names[i];
+    }
+    if (err >= 0)
+    {
+        for (i = 0; i < stale && err >= 0; i += DNS_BATCH_SIZE)
+        {
+            err = dns_map_delete(names_fd, p.names + i, stale - i < DNS_BATCH_SIZE ? stale - i : DNS_BATCH_SIZE, calls);
+        }
+    }
+    if (err < 0)
+    {
+        printf("ERROR: Failed to prune xdns_names: %s\n", strerror(-err));
+    }
+    else
+    {
+        pruned = stale;
+    }
+
+out:
+    dns_table_free(p.live);
+    free(p.names);
+    close(names_fd);
+    return pruned;
+}
+
+//Create empty record maps, with the size and flags of the active ones, for a zone in the
+//inactive slot, and copy the RRsets added at runtime into them
+int zone_swap_begin(struct zone_swap *swap)
+{
+    int active_fds[ZONE_MAPS];
+    int64_t carried;
+    int ret;
+
+    zone_clear(swap->outer_fds);
+    zone_clear(swap->fds);
+    swap->slot = zone_active_slot();
+    if (swap->slot < 0 || zone_outer_open(swap->outer_fds) < 0)
+    {
+        return -1;
+    }
+    swap->next = (swap->slot + 1) % XDNS_ZONE_SLOTS;
+
+    if (zone_open(swap->outer_fds, swap->slot, active_fds) < 0)
+    {
+        printf("ERROR: Zone slot %d holds no record maps. Start xdp_dns first.\n", swap->slot);
+        return -1;
+    }
+    ret = zone_create_like(active_fds, swap->fds);
+    zone_close(active_fds);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    carried = zone_carry(swap, swap->slot, swap->fds, 0);
+    swap->carried = carried < 0 ? 0 : carried;
+    return carried < 0 ? -1 : 0;
+}
+
+//Install the new zone and publish it with a single update of the active slot, then copy the
+//RRsets added at runtime since zone_swap_begin. One written into the old zone after that, by
+//an xdp_dns_fill that has not yet seen the switch, is lost and costs one more miss.
+//The previous zone stays in its slot until the next swap.
+int zone_swap_commit(struct zone_swap *swap)
+{
+    struct timespec start, end;
+    uint64_t calls = 0;
+    int64_t late, pruned;
+
+    if (zone_install(swap->outer_fds, swap->next, swap->fds) < 0)
+    {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (zone_activate(swap->next) != 0)
+    {
+        printf("ERROR: Failed to activate slot %d: %s\n", swap->next, strerror(errno));
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("Zone swapped from slot %d to slot %d in %.1f us\n", swap->slot, swap->next,
+           ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3);
+
+    //The new zone is published, a failure here only loses runtime RRsets
+    late = zone_carry(swap, swap->slot, swap->fds, 1);
+    if (swap->carried || late > 0)
+    {
+        printf("Copied %llu RRsets added at runtime, and %lld written during the swap\n",
+               (unsigned long long)swap->carried, late > 0 ? (long long)late : 0LL);
+    }
+
+    //Drop the names of the zone the swap replaced
+    pruned = zone_names_prune(&calls);
+    if (pruned > 0)
+    {
+        printf("Pruned %lld names no record holds\n", (long long)pruned);
+    }
+    return 0;
+}
+
+//The arrays of maps hold their own references to installed record maps
+void zone_swap_end(struct zone_swap *swap)
+{
+    zone_close(swap->fds);
+    zone_close(swap->outer_fds);
+}
@@ -0,0 +1,63 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+#ifndef DNS_ZONE_H
+#define DNS_ZONE_H
+
+#include <stdint.h>
+#include "common.h"
+
+//A zone is one record map per record set, fd arrays hold them in this order
+enum zone_map_id {
+    ZONE_A,
+    ZONE_AAAA,
+    ZONE_RR,
+    ZONE_MAPS
+};
+
+//Names of the arrays of maps that hold the record maps of every slot
+extern const char *zone_outer_names[ZONE_MAPS];
+extern const char *zone_active_name;
+
+int zone_outer_open(int outer_fds[ZONE_MAPS]);
+int zone_active_slot(void);
+int zone_activate(uint32_t slot);
+int zone_open(const int outer_fds[ZONE_MAPS], uint32_t slot, int fds[ZONE_MAPS]);
+int zone_open_active(int fds[ZONE_MAPS]);
+int zone_create(uint32_t max_entries, uint32_t map_flags, int fds[ZONE_MAPS]);
+int zone_create_like(const int like_fds[ZONE_MAPS], int fds[ZONE_MAPS]);
+int zone_install(const int outer_fds[ZONE_MAPS], uint32_t slot, const int fds[ZONE_MAPS]);
+void zone_close(int fds[ZONE_MAPS]);
+int64_t zone_names_prune(uint64_t *calls);
+
+//A new zone built in the inactive slot. Records are written to fds between
+//zone_swap_begin and zone_swap_commit, zone_swap_end releases the swap either way.
+//The RRsets added at runtime are copied into fds by zone_swap_begin, records written
+//after it replace them.
+struct zone_swap {
+    int outer_fds[ZONE_MAPS];
+    int fds[ZONE_MAPS];
+    int slot;           //Slot answering until the commit
+    int next;           //Slot of the new zone
+    uint64_t carried;   //RRsets added at runtime copied from the old zone
+};
+
+int zone_swap_begin(struct zone_swap *swap);
+int zone_swap_commit(struct zone_swap *swap);
+void zone_swap_end(struct zone_swap *swap);
+
+#endif
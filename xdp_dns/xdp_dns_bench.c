@@ -0,0 +1,317 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Measures the per-packet cost of xdp_dns with BPF_PROG_TEST_RUN.
+ * Every object given on the command line is loaded without pinning its maps,
+ * filled with A records for the test names and run against a short, a medium
+ * and a 250-byte query name, for a hit and a miss each.
+ *
+ *   make bench
+ *   sudo ./xdp_dns_bench xdp_dns_kern_byte.o xdp_dns_kern.o
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "common.h"
+#include "dns_util.h"
+#include "dns_zone.h"
+
+#define BENCH_PKT_SIZE 1024
+#define BENCH_DEFAULT_REPEAT 1000000
+
+struct bench_name {
+	const char *label;
+	char name[MAX_DNS_NAME_LENGTH];
+};
+
+static struct bench_name bench_names[3];
+
+static const char *bench_maps[] = {"xdns_a_zone", "xdns_aaaa_zone", "xdns_rr_zone", "xdns_zone_active", "xdns_stats",
+								   "xdns_lat", "xdns_lat_on", "xdns_config", "xdns_events", "xdns_rxq",
+								   "xdns_snoop_a", "xdns_snoop_aaaa", "xdns_names"};
+
+static int print_bpf_verifier(enum libbpf_print_level level,
+							const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+//Fill in the short, medium and long (250 octets in wire format) test names
+static void init_bench_names(void)
+{
+	char *p;
+
+	bench_names[0].label = "short";
+	strcpy(bench_names[0].name, "a.io");
+
+	bench_names[1].label = "medium";
+	strcpy(bench_names[1].name, "api-gateway-01.eu-west-1.service.example.com");
+
+	//Three 63-octet labels and a 56-octet label, 249 characters in dotted form
+	bench_names[2].label = "long";
+	p = bench_names[2].name;
+	for (int i = 0; i < 4; i++) {
+		int len = i < 3 ? 63 : 56;
+		memset(p, 'a' + i, len);
+		p += len;
+		*p++ = i < 3 ? '.' : '\0';
+	}
+}
+
+//Build an Ethernet/IPv4/UDP/DNS query for name into pkt and return its length
+static size_t build_query(char *pkt, const char *name, uint16_t record_type)
+{
+	char wire_name[MAX_DNS_NAME_LENGTH];
+	struct ethhdr *eth = (struct ethhdr *)pkt;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	struct dns_hdr *dns = (struct dns_hdr *)(udp + 1);
+	char *query = (char *)(dns + 1);
+	size_t name_len;
+	uint16_t val;
+
+	memset(pkt, 0, BENCH_PKT_SIZE);
+	memset(wire_name, 0, sizeof(wire_name));
+	replace_dots_with_length_octets((char *)name, wire_name);
+	name_len = strnlen(wire_name, sizeof(wire_name)) + 1;
+
+	memset(eth->h_dest, 0x02, ETH_ALEN);
+	memset(eth->h_source, 0x04, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	memcpy(query, wire_name, name_len);
+	val = htons(record_type);
+	memcpy(query + name_len, &val, sizeof(val));
+	val = htons(DNS_CLASS_IN);
+	memcpy(query + name_len + 2, &val, sizeof(val));
+
+	dns->transaction_id = htons(0x1234);
+	dns->rd = 1;
+	dns->q_count = htons(1);
+
+	udp->source = htons(40000);
+	udp->dest = htons(53);
+	udp->len = htons(sizeof(*udp) + sizeof(*dns) + name_len + 4);
+
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->tot_len = htons(sizeof(*ip) + ntohs(udp->len));
+	ip->saddr = htonl(0x0a000001);
+	ip->daddr = htonl(0x0a000002);
+
+	return sizeof(*eth) + ntohs(ip->tot_len);
+}
+
+//Add the A record of name and the name itself, which xdp_dns compares the question with
+static int add_bench_record(int map_fd, int names_fd, const char *name)
+{
+	char wire_name[MAX_DNS_NAME_LENGTH];
+	struct dns_key key;
+	struct a_record value;
+
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	memset(wire_name, 0, sizeof(wire_name));
+	replace_dots_with_length_octets((char *)name, wire_name);
+	dns_name_tolower(wire_name);
+	key.name_hash = dns_name_hash(wire_name);
+	value.name_check = dns_name_check(wire_name);
+	key.record_type = A_RECORD_TYPE;
+	key.class = DNS_CLASS_IN;
+	inet_aton("192.0.2.1", &value.ip_addr[0]);
+	value.count = 1;
+	value.ttl = 300;
+
+	if (dns_names_put(names_fd, wire_name))
+		return -1;
+	return bpf_map_update_elem(map_fd, &key, &value, BPF_ANY);
+}
+
+static int run_bench(int prog_fd, const char *name, uint16_t record_type, int repeat,
+					 __u32 *retval, __u32 *duration)
+{
+	char pkt_in[BENCH_PKT_SIZE], pkt_out[BENCH_PKT_SIZE];
+	struct bpf_prog_test_run_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_fd = prog_fd;
+	attr.repeat = repeat;
+	attr.data_in = pkt_in;
+	attr.data_size_in = build_query(pkt_in, name, record_type);
+	attr.data_out = pkt_out;
+	attr.data_size_out = sizeof(pkt_out);
+
+	if (bpf_prog_test_run_xattr(&attr)) {
+		fprintf(stderr, "Error: BPF_PROG_TEST_RUN failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	*retval = attr.retval;
+	*duration = attr.duration;
+	return 0;
+}
+
+static int bench_object(const char *filename, int repeat)
+{
+	struct bpf_object *obj;
+	struct bpf_program *prog;
+	int prog_fd, a_records_fd, names_fd;
+	int zone_fds[ZONE_MAPS], outer_fds[ZONE_MAPS];
+	int ret = 0;
+
+	obj = bpf_object__open(filename);
+	if (!obj) {
+		fprintf(stderr, "Error: bpf_object__open failed for %s\n", filename);
+		return -1;
+	}
+
+	//Keep the benchmark away from the maps of a running xdp_dns
+	for (int i = 0; i < sizeof(bench_maps) / sizeof(bench_maps[0]); i++) {
+		struct bpf_map *map = bpf_object__find_map_by_name(obj, bench_maps[i]);
+		if (map)
+			bpf_map__set_pin_path(map, NULL);
+	}
+
+	//One zone in slot 0, the slot a fresh xdns_zone_active selects
+	if (zone_create(XDNS_DEFAULT_RECORDS, BPF_F_NO_PREALLOC, zone_fds)) {
+		bpf_object__close(obj);
+		return -1;
+	}
+	for (int i = 0; i < ZONE_MAPS; i++) {
+		struct bpf_map *map = bpf_object__find_map_by_name(obj, zone_outer_names[i]);
+		if (!map || bpf_map__set_inner_map_fd(map, zone_fds[i])) {
+			fprintf(stderr, "Error: Failed to set the record map of %s\n", zone_outer_names[i]);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	if (bpf_object__load(obj)) {
+		fprintf(stderr, "Error: bpf_object__load failed for %s\n", filename);
+		ret = -1;
+		goto out;
+	}
+
+	for (int i = 0; i < ZONE_MAPS; i++)
+		outer_fds[i] = bpf_object__find_map_fd_by_name(obj, zone_outer_names[i]);
+	if (zone_install(outer_fds, 0, zone_fds)) {
+		ret = -1;
+		goto out;
+	}
+
+	prog = bpf_object__find_program_by_name(obj, "xdp_dns");
+	if (!prog) {
+		fprintf(stderr, "Error: bpf_object__find_program_by_name failed\n");
+		ret = -1;
+		goto out;
+	}
+	prog_fd = bpf_program__fd(prog);
+	a_records_fd = zone_fds[ZONE_A];
+	names_fd = bpf_object__find_map_fd_by_name(obj, "xdns_names");
+	if (prog_fd < 0 || a_records_fd < 0 || names_fd < 0) {
+		fprintf(stderr, "Error: Failed to get program or map of %s\n", filename);
+		ret = -1;
+		goto out;
+	}
+
+	for (int i = 0; i < sizeof(bench_names) / sizeof(bench_names[0]); i++) {
+		if (add_bench_record(a_records_fd, names_fd, bench_names[i].name)) {
+			fprintf(stderr, "Error: Failed to add record for %s\n", bench_names[i].label);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	printf("%s\n", filename);
+	printf("  %-8s %8s %12s %12s\n", "name", "octets", "hit ns/pkt", "miss ns/pkt");
+	for (int i = 0; i < sizeof(bench_names) / sizeof(bench_names[0]); i++) {
+		char wire_name[MAX_DNS_NAME_LENGTH];
+		__u32 hit_ret, hit_ns, miss_ret, miss_ns;
+
+		memset(wire_name, 0, sizeof(wire_name));
+		replace_dots_with_length_octets(bench_names[i].name, wire_name);
+
+		//The A record is present, the AAAA record is not
+		if (run_bench(prog_fd, bench_names[i].name, A_RECORD_TYPE, repeat, &hit_ret, &hit_ns) ||
+			run_bench(prog_fd, bench_names[i].name, AAAA_RECORD_TYPE, repeat, &miss_ret, &miss_ns)) {
+			ret = -1;
+			goto out;
+		}
+		printf("  %-8s %8zu %12u %12u%s\n", bench_names[i].label,
+			   strnlen(wire_name, sizeof(wire_name)) + 1, hit_ns, miss_ns,
+			   hit_ret == XDP_TX ? "" : "  (hit not answered)");
+	}
+
+out:
+	zone_close(zone_fds);
+	bpf_object__close(obj);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	int repeat = BENCH_DEFAULT_REPEAT;
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+			case 'r':
+				repeat = atoi(optarg);
+				break;
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [-r repeat] [bpf_object...]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		perror("setrlimit failed");
+		return 1;
+	}
+	libbpf_set_print(print_bpf_verifier);
+	init_bench_names();
+
+	if (optind == argc)
+		return bench_object("xdp_dns_kern.o", repeat) ? 1 : 0;
+
+	for (; optind < argc; optind++) {
+		if (bench_object(argv[optind], repeat))
+			ret = 1;
+	}
+
+	return ret;
+}
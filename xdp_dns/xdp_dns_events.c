@@ -0,0 +1,274 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Consumes the sampled queries of a running xdp_dns from the xdns_events ring buffer.
+ * Events are appended to a binary log and the most missed names are printed every interval.
+ *
+ *   sudo ./xdp_dns_events -s 100 -w queries.log -k 10 -i 5
+ *
+ * Log format: the 8-byte magic "XDNSEVT1", followed by one record per event holding
+ * the fixed part of struct xdns_event (everything before name) and name_len octets of name.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <stddef.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "dns_util.h"
+#include "latency.h"
+
+#define EVENTS_LOG_MAGIC "XDNSEVT1"
+#define EVENTS_POLL_TIMEOUT_MS 100
+//Distinct missed names counted per interval, further names are only logged
+#define MISS_TABLE_SIZE 16384
+
+static const char *config_map_path = "/sys/fs/bpf/xdns_config";
+static const char *events_map_path = "/sys/fs/bpf/xdns_events";
+
+struct miss_entry {
+	uint64_t name_hash;
+	uint64_t count;
+	char name[MAX_DNS_NAME_LENGTH];
+};
+
+struct consumer {
+	FILE *log;
+	struct miss_entry *misses;
+	uint64_t events;
+	uint64_t dropped_names;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig)
+{
+	quit = 1;
+}
+
+//Count a missed name in the open-addressing table of the interval
+static void count_miss(struct consumer *c, const struct xdns_event *ev)
+{
+	uint64_t hash = dns_name_hash(ev->name);
+
+	for (int i = 0; i < MISS_TABLE_SIZE; i++) {
+		struct miss_entry *e = &c->misses[(hash + i) % MISS_TABLE_SIZE];
+
+		if (e->count == 0) {
+			e->name_hash = hash;
+			e->count = 1;
+			memcpy(e->name, ev->name, sizeof(e->name));
+			return;
+		}
+		if (e->name_hash == hash && memcmp(e->name, ev->name, ev->name_len) == 0) {
+			e->count++;
+			return;
+		}
+	}
+	c->dropped_names++;
+}
+
+static int handle_event(void *ctx, void *data, size_t size)
+{
+	struct consumer *c = ctx;
+	struct xdns_event *ev = data;
+
+	if (size < sizeof(*ev) || ev->name_len == 0 || ev->name_len > MAX_DNS_NAME_LENGTH)
+		return 0;
+
+	c->events++;
+	//Written through stdio, so the log is flushed in large batches
+	if (c->log) {
+		fwrite(ev, offsetof(struct xdns_event, name), 1, c->log);
+		fwrite(ev->name, ev->name_len, 1, c->log);
+	}
+	if (ev->outcome == LATENCY_MISS)
+		count_miss(c, ev);
+
+	return 0;
+}
+
+//Print the k most missed names of the interval and start a new interval
+static void print_top_misses(struct consumer *c, int k, double interval)
+{
+	struct miss_entry *top[k];
+	int n = 0;
+
+	for (int i = 0; i < MISS_TABLE_SIZE; i++) {
+		struct miss_entry *e = &c->misses[i];
+		int j;
+
+		if (e->count == 0 || (n == k && e->count <= top[n - 1]->count))
+			continue;
+		//Insertion into the sorted top list
+		j = n < k ? n++ : k - 1;
+		for (; j > 0 && top[j - 1]->count < e->count; j--)
+			top[j] = top[j - 1];
+		top[j] = e;
+	}
+
+	printf("%llu events in %.1fs, top %d missed names:\n", (unsigned long long)c->events, interval, n);
+	for (int i = 0; i < n; i++) {
+		char name[DNS_NAME_TEXT_LENGTH];
+
+		replace_length_octets_with_dots(top[i]->name, name, sizeof(name));
+		printf("  %10llu  %s\n", (unsigned long long)top[i]->count, name);
+	}
+	if (c->dropped_names)
+		printf("  (%llu misses of further names not counted)\n", (unsigned long long)c->dropped_names);
+	fflush(stdout);
+
+	memset(c->misses, 0, MISS_TABLE_SIZE * sizeof(struct miss_entry));
+	c->events = 0;
+	c->dropped_names = 0;
+}
+
+static int set_sample_rate(uint32_t sample_rate)
+{
+	struct xdns_config config;
+	uint32_t key = 0;
+	int fd = get_map_fd(config_map_path);
+
+	if (fd < 0)
+		return -1;
+	if (bpf_map_lookup_elem(fd, &key, &config))
+		memset(&config, 0, sizeof(config));
+	config.sample_rate = sample_rate;
+	if (bpf_map_update_elem(fd, &key, &config, BPF_ANY)) {
+		fprintf(stderr, "Error: Failed to set the sample rate: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-s sample_rate] [-w log_file] [-k top] [-i seconds]\n", progname);
+	fprintf(stderr, "  -s  sample one in <sample_rate> queries while running, 0 turns sampling off and exits\n");
+	fprintf(stderr, "  -w  append the events to a binary log\n");
+	fprintf(stderr, "  -k  number of missed names to print (default 10)\n");
+	fprintf(stderr, "  -i  seconds between two top lists (default 5)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct consumer c;
+	struct ring_buffer *rb;
+	const char *log_path = NULL;
+	long sample_rate = -1;
+	int k = 10, interval = 5;
+	int opt, fd, ret = 0;
+
+	while ((opt = getopt(argc, argv, "s:w:k:i:")) != -1) {
+		switch (opt) {
+			case 's':
+				sample_rate = strtol(optarg, NULL, 10);
+				break;
+			case 'w':
+				log_path = optarg;
+				break;
+			case 'k':
+				k = atoi(optarg);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case '?':
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (sample_rate < -1 || sample_rate > UINT32_MAX || k <= 0 || interval <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (sample_rate == 0)
+		return set_sample_rate(0) ? 1 : 0;
+
+	memset(&c, 0, sizeof(c));
+	c.misses = calloc(MISS_TABLE_SIZE, sizeof(struct miss_entry));
+	if (!c.misses) {
+		fprintf(stderr, "Error: failed to allocate memory\n");
+		return 1;
+	}
+
+	if (log_path) {
+		c.log = fopen(log_path, "a");
+		if (!c.log) {
+			fprintf(stderr, "Error: Failed to open %s: %s\n", log_path, strerror(errno));
+			return 1;
+		}
+		if (ftell(c.log) == 0)
+			fwrite(EVENTS_LOG_MAGIC, strlen(EVENTS_LOG_MAGIC), 1, c.log);
+	}
+
+	fd = get_map_fd(events_map_path);
+	if (fd < 0)
+		return 1;
+	rb = ring_buffer__new(fd, handle_event, &c, NULL);
+	if (!rb) {
+		fprintf(stderr, "Error: Failed to open the xdns_events ring buffer\n");
+		return 1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	//Sampling only starts once the ring buffer is drained, and stops again when we exit
+	if (sample_rate > 0 && set_sample_rate(sample_rate)) {
+		ring_buffer__free(rb);
+		return 1;
+	}
+
+	struct timespec last, now;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	while (!quit) {
+		//Every call consumes all events available, the kernel wakes us up only in batches
+		int err = ring_buffer__poll(rb, EVENTS_POLL_TIMEOUT_MS);
+		if (err < 0 && err != -EINTR) {
+			fprintf(stderr, "Error: Failed to poll the ring buffer: %d\n", err);
+			ret = 1;
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		if (elapsed >= interval) {
+			print_top_misses(&c, k, elapsed);
+			last = now;
+		}
+	}
+
+	//Nobody reads the ring buffer any more, stop the program from filling it
+	if (set_sample_rate(0))
+		ret = 1;
+	ring_buffer__free(rb);
+	if (c.log)
+		fclose(c.log);
+	free(c.misses);
+	return ret;
+}
@@ -0,0 +1,938 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Look-aside miss handler of xdp_dns, in the way memcached serves the misses of BMC.
+ * Queries the program does not answer are passed up the stack to the port this tool
+ * listens on. They are forwarded to an upstream resolver, and concurrent queries for
+ * the same name and type share one upstream query. A and AAAA answers, with the CNAME
+ * chain in front of them, are written into the active zone with their TTL as expiry,
+ * so the next query for the name is answered in XDP until the TTL runs out.
+ *
+ *   sudo ./xdp_dns_fill -u 192.0.2.53 -i 5
+ *   sudo ./xdp_dns_fill -u 2001:db8::53#5353 -p 53 -m 3600
+ *
+ * The filled records are not flagged as written from a file, so sync leaves them alone and
+ * swap and restore carry them into the new zone (see zone_swap_begin and zone_swap_commit).
+ * Records of the zone (written from a file, or added without an expiry) are never replaced. Upstream queries are
+ * sent without EDNS, so answers fit in 512 bytes; truncated answers are relayed, not cached.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+
+#include "dns_util.h"
+#include "dns_batch.h"
+#include "dns_zone.h"
+
+#define FILL_DEFAULT_PORT 53
+#define FILL_DEFAULT_MAX_TTL 86400
+#define FILL_BUF_SIZE 4096
+//Upstream answers without EDNS
+#define FILL_UDP_SIZE 512
+//Queries waiting for upstream, and clients waiting for one query
+#define FILL_PENDING_MAX 1024
+#define FILL_BUCKETS 2048
+#define FILL_WAITERS_MAX 32
+#define FILL_TIMEOUT_MS 2000
+#define FILL_POLL_MS 100
+//Datagrams read from one socket before the others get their turn
+#define FILL_RECV_BURST 256
+//RRsets staged per map before they are written with one batched update
+#define FILL_STAGE_MAX 256
+//Answer RRs looked at when an upstream answer is cached
+#define FILL_ANSWERS_MAX 32
+
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_HDR_SIZE 12
+
+//A client waiting for an upstream answer. upper marks the octets of the name it sent
+//in upper case, its answer is given back the question as it was asked (0x20 encoding).
+struct fill_waiter {
+	struct sockaddr_in6 addr;
+	uint16_t id;
+	uint8_t rd;
+	uint8_t upper[MAX_DNS_NAME_LENGTH / 8];
+};
+
+struct fill_query {
+	int used;
+	int next;               //Next query of the bucket, -1 ends it
+	uint16_t upstream_id;
+	uint16_t type;
+	uint64_t name_hash;
+	int name_len;           //Octets of name including the root label
+	char name[MAX_DNS_NAME_LENGTH];  //Lowercase wire format
+	struct timespec sent;
+	int waiter_count;
+	struct fill_waiter waiters[FILL_WAITERS_MAX];
+};
+
+//RRsets to write into one record map
+struct fill_stage {
+	uint32_t count;
+	struct dns_key keys[FILL_STAGE_MAX];
+	char *values;
+};
+
+struct fill_stats {
+	uint64_t queries;       //Queries received
+	uint64_t merged;        //Queries that joined a query already upstream
+	uint64_t upstream;      //Queries sent upstream
+	uint64_t answers;       //Upstream answers relayed
+	uint64_t filled;        //RRsets written into the maps
+	uint64_t uncacheable;   //Answers relayed but not cached
+	uint64_t kept;          //RRsets not written, the zone holds them
+	uint64_t failed;        //Queries answered with SERVFAIL (timeout, table full)
+	uint64_t dropped;       //Malformed queries and answers
+};
+
+struct fill {
+	int listen_fd;
+	int upstream_fd;
+	uint32_t max_ttl;
+
+	int slot;
+	int fds[ZONE_MAPS];
+	struct fill_stage stage[ZONE_MAPS];
+	uint64_t calls;
+
+	//Names of the staged RRsets, for xdns_names (-1 if it is not pinned)
+	int names_fd;
+	uint32_t name_count;
+	struct dns_key name_keys[ZONE_MAPS * FILL_STAGE_MAX];
+	struct dns_name *names;
+
+	int pending;
+	int buckets[FILL_BUCKETS];
+	struct fill_query *queries;
+	int16_t *by_id;         //Upstream id to query index, -1 if free
+
+	//Upstream answers read in one burst, relayed once their RRsets are in the maps
+	uint8_t *relay_msgs;    //FILL_RECV_BURST messages of FILL_BUF_SIZE octets
+	int relay_lens[FILL_RECV_BURST];
+	int relay_queries[FILL_RECV_BURST];
+	int relay_count;
+
+	struct fill_stats stats;
+};
+
+static const size_t fill_value_sizes[ZONE_MAPS] = {sizeof(struct a_record), sizeof(struct aaaa_record),
+												   sizeof(struct rr_record)};
+
+static int fill_bucket(uint64_t name_hash, uint16_t type)
+{
+	return (name_hash ^ type * 0x9e3779b97f4a7c15ULL) & (FILL_BUCKETS - 1);
+}
+
+static double ms_since(const struct timespec *start, const struct timespec *now)
+{
+	return (now->tv_sec - start->tv_sec) * 1e3 + (now->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+//Read the possibly compressed name at *off of msg in lowercase wire format into name
+//and move *off past it. Returns the octets of name including the root label, or -1.
+static int read_name(const uint8_t *msg, int len, int *off, char *name)
+{
+	int pos = *off, out = 0, jumps = 0;
+
+	while (pos < len) {
+		uint8_t label = msg[pos];
+
+		if ((label & 0xc0) == 0xc0) {
+			if (pos + 1 >= len || ++jumps > 16)
+				return -1;
+			if (jumps == 1)
+				*off = pos + 2;
+			pos = (label & 0x3f) << 8 | msg[pos + 1];
+			continue;
+		}
+		if (label & 0xc0)
+			return -1;
+		if (label == 0) {
+			if (jumps == 0)
+				*off = pos + 1;
+			name[out] = 0;
+			return out + 1;
+		}
+		if (pos + 1 + label > len || out + 1 + label >= MAX_DNS_NAME_LENGTH - 1)
+			return -1;
+		name[out++] = label;
+		for (int i = 0; i < label; i++)
+			name[out++] = tolower(msg[pos + 1 + i]);
+		pos += 1 + label;
+	}
+	return -1;
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static struct fill_query *find_query(struct fill *f, uint64_t name_hash, uint16_t type, const char *name, int name_len)
+{
+	for (int i = f->buckets[fill_bucket(name_hash, type)]; i >= 0; i = f->queries[i].next) {
+		struct fill_query *q = &f->queries[i];
+
+		if (q->name_hash == name_hash && q->type == type && q->name_len == name_len &&
+			memcmp(q->name, name, name_len) == 0)
+			return q;
+	}
+	return NULL;
+}
+
+static void release_query(struct fill *f, struct fill_query *q)
+{
+	int idx = q - f->queries;
+	int *link = &f->buckets[fill_bucket(q->name_hash, q->type)];
+
+	while (*link != idx)
+		link = &f->queries[*link].next;
+	*link = q->next;
+	f->by_id[q->upstream_id] = -1;
+	q->used = 0;
+	f->pending--;
+}
+
+//Send an answer to one waiter, with its id, flags and question name as it asked
+static void reply_waiter(struct fill *f, const struct fill_query *q, const struct fill_waiter *w,
+						 uint8_t *msg, int len)
+{
+	struct dns_hdr *hdr = (struct dns_hdr *)msg;
+
+	hdr->transaction_id = htons(w->id);
+	hdr->rd = w->rd;
+	for (int i = 0; i < q->name_len; i++) {
+		if (w->upper[i / 8] & (1 << (i % 8)))
+			msg[DNS_HDR_SIZE + i] = toupper(msg[DNS_HDR_SIZE + i]);
+		else
+			msg[DNS_HDR_SIZE + i] = tolower(msg[DNS_HDR_SIZE + i]);
+	}
+	sendto(f->listen_fd, msg, len, 0, (const struct sockaddr *)&w->addr, sizeof(w->addr));
+}
+
+//Build an answer to q without records, carrying rcode. Returns its length.
+static int error_answer(uint8_t *msg, const struct fill_query *q, int rcode)
+{
+	struct dns_hdr *hdr = (struct dns_hdr *)msg;
+
+	memset(hdr, 0, DNS_HDR_SIZE);
+	hdr->qr = 1;
+	hdr->ra = 1;
+	hdr->rcode = rcode;
+	hdr->q_count = htons(1);
+	memcpy(msg + DNS_HDR_SIZE, q->name, q->name_len);
+	msg[DNS_HDR_SIZE + q->name_len] = q->type >> 8;
+	msg[DNS_HDR_SIZE + q->name_len + 1] = q->type & 0xff;
+	msg[DNS_HDR_SIZE + q->name_len + 2] = 0;
+	msg[DNS_HDR_SIZE + q->name_len + 3] = DNS_CLASS_IN;
+	return DNS_HDR_SIZE + q->name_len + 4;
+}
+
+//Answer every waiter of q with rcode and release q
+static void fail_query(struct fill *f, struct fill_query *q, int rcode)
+{
+	uint8_t msg[DNS_HDR_SIZE + MAX_DNS_NAME_LENGTH + 4];
+	int len = error_answer(msg, q, rcode);
+
+	for (int i = 0; i < q->waiter_count; i++)
+		reply_waiter(f, q, &q->waiters[i], msg, len);
+	f->stats.failed += q->waiter_count;
+	release_query(f, q);
+}
+
+static int send_upstream(struct fill *f, struct fill_query *q)
+{
+	uint8_t msg[DNS_HDR_SIZE + MAX_DNS_NAME_LENGTH + 4];
+	struct dns_hdr *hdr = (struct dns_hdr *)msg;
+	int len = error_answer(msg, q, 0);
+
+	//The same question, as a query
+	memset(hdr, 0, DNS_HDR_SIZE);
+	hdr->transaction_id = htons(q->upstream_id);
+	hdr->rd = 1;
+	hdr->q_count = htons(1);
+
+	clock_gettime(CLOCK_MONOTONIC, &q->sent);
+	if (send(f->upstream_fd, msg, len, 0) != len)
+		return -1;
+	f->stats.upstream++;
+	return 0;
+}
+
+//A query passed on by xdp_dns. Joins the query for the same name and type if one is
+//upstream already, otherwise starts one.
+static void handle_query(struct fill *f, const uint8_t *msg, int len, const struct sockaddr_in6 *addr)
+{
+	const struct dns_hdr *hdr = (const struct dns_hdr *)msg;
+	struct fill_waiter w;
+	struct fill_query *q;
+	char name[MAX_DNS_NAME_LENGTH];
+	int pos = DNS_HDR_SIZE, out = 0;
+	uint64_t name_hash;
+	uint16_t type;
+
+	if (len < DNS_HDR_SIZE + 5 || hdr->qr || hdr->opcode || ntohs(hdr->q_count) != 1) {
+		f->stats.dropped++;
+		return;
+	}
+
+	//The question is never compressed, keep the case of its letters for the answer
+	memset(&w, 0, sizeof(w));
+	while (pos < len && msg[pos]) {
+		int label = msg[pos];
+
+		if (label > 63 || pos + 1 + label >= len || out + 1 + label >= MAX_DNS_NAME_LENGTH - 1) {
+			f->stats.dropped++;
+			return;
+		}
+		name[out++] = label;
+		for (int i = 0; i < label; i++, out++) {
+			if (isupper(msg[pos + 1 + i]))
+				w.upper[out / 8] |= 1 << (out % 8);
+			name[out] = tolower(msg[pos + 1 + i]);
+		}
+		pos += 1 + label;
+	}
+	if (pos + 5 > len || get_u16(msg + pos + 3) != DNS_CLASS_IN) {
+		f->stats.dropped++;
+		return;
+	}
+	name[out] = 0;
+	type = get_u16(msg + pos + 1);
+	name_hash = dns_name_hash(name);
+
+	w.addr = *addr;
+	w.id = ntohs(hdr->transaction_id);
+	w.rd = hdr->rd;
+	f->stats.queries++;
+
+	q = find_query(f, name_hash, type, name, out + 1);
+	if (q) {
+		//A retransmission of a query already waiting is not a second waiter
+		for (int i = 0; i < q->waiter_count; i++) {
+			if (q->waiters[i].id == w.id && memcmp(&q->waiters[i].addr, addr, sizeof(*addr)) == 0)
+				return;
+		}
+		if (q->waiter_count < FILL_WAITERS_MAX) {
+			q->waiters[q->waiter_count++] = w;
+			f->stats.merged++;
+		} else {
+			//The client retries, by then the answer is likely in the maps
+			f->stats.dropped++;
+		}
+		return;
+	}
+
+	if (f->pending == FILL_PENDING_MAX) {
+		uint8_t answer[DNS_HDR_SIZE + MAX_DNS_NAME_LENGTH + 4];
+		struct fill_query full;
+
+		memset(&full, 0, offsetof(struct fill_query, waiters));
+		full.type = type;
+		full.name_len = out + 1;
+		memcpy(full.name, name, out + 1);
+		reply_waiter(f, &full, &w, answer, error_answer(answer, &full, DNS_RCODE_SERVFAIL));
+		f->stats.failed++;
+		return;
+	}
+
+	for (int i = 0; i < FILL_PENDING_MAX; i++) {
+		if (!f->queries[i].used) {
+			q = &f->queries[i];
+			break;
+		}
+	}
+	memset(q, 0, offsetof(struct fill_query, waiters));
+	q->used = 1;
+	q->type = type;
+	q->name_hash = name_hash;
+	q->name_len = out + 1;
+	memcpy(q->name, name, out + 1);
+	q->waiters[0] = w;
+	q->waiter_count = 1;
+	//Random ids, so answers cannot be guessed by others than the upstream
+	do {
+		if (getrandom(&q->upstream_id, sizeof(q->upstream_id), 0) != sizeof(q->upstream_id))
+			q->upstream_id = random();
+	} while (f->by_id[q->upstream_id] >= 0);
+	f->by_id[q->upstream_id] = q - f->queries;
+	q->next = f->buckets[fill_bucket(name_hash, type)];
+	f->buckets[fill_bucket(name_hash, type)] = q - f->queries;
+	f->pending++;
+
+	if (send_upstream(f, q))
+		fail_query(f, q, DNS_RCODE_SERVFAIL);
+}
+
+static const size_t fill_expires_offsets[ZONE_MAPS] = {offsetof(struct a_record, expires),
+													   offsetof(struct aaaa_record, expires),
+													   offsetof(struct rr_record, expires)};
+static const size_t fill_flags_offsets[ZONE_MAPS] = {offsetof(struct a_record, flags),
+													 offsetof(struct aaaa_record, flags),
+													 offsetof(struct rr_record, flags)};
+
+//Write the staged RRsets with one batched update per map
+static void flush_stage(struct fill *f)
+{
+	//The names go first, xdp_dns does not answer a record before its name is written
+	if (f->name_count) {
+		dns_map_update(f->names_fd, f->name_keys, f->names, sizeof(*f->names), f->name_count, &f->calls);
+		f->name_count = 0;
+	}
+	for (int i = 0; i < ZONE_MAPS; i++) {
+		struct fill_stage *st = &f->stage[i];
+
+		if (st->count == 0)
+			continue;
+		if (dns_map_update(f->fds[i], st->keys, st->values, fill_value_sizes[i], st->count, &f->calls) == 0)
+			f->stats.filled += st->count;
+		st->count = 0;
+	}
+}
+
+//Stage an RRset of the zero-padded wire-format name unless the zone holds one for the key.
+//RRsets written from a file, even with an expiry, and the ones added without an expiry are
+//the zone's; any other entry was filled (or added to expire) and is replaced.
+static void stage_rrset(struct fill *f, int map, const struct dns_key *key, const void *value, const char *name)
+{
+	struct fill_stage *st = &f->stage[map];
+	size_t value_size = fill_value_sizes[map];
+	char old[sizeof(struct rr_record)];
+	uint64_t expires;
+	uint16_t flags;
+	uint32_t i;
+
+	if (bpf_map_lookup_elem(f->fds[map], key, old) == 0) {
+		memcpy(&expires, old + fill_expires_offsets[map], sizeof(expires));
+		memcpy(&flags, old + fill_flags_offsets[map], sizeof(flags));
+		if ((flags & XDNS_RECORD_FILE) || !expires) {
+			f->stats.kept++;
+			return;
+		}
+	}
+
+	for (i = 0; i < st->count; i++) {
+		if (memcmp(&st->keys[i], key, sizeof(*key)) == 0)
+			break;
+	}
+	if (i == FILL_STAGE_MAX) {
+		flush_stage(f);
+		i = 0;
+	}
+	st->keys[i] = *key;
+	memcpy(st->values + i * value_size, value, value_size);
+	if (i == st->count) {
+		st->count++;
+		if (f->names_fd >= 0) {
+			dns_names_entry(name, &f->name_keys[f->name_count], &f->names[f->name_count]);
+			f->name_count++;
+		}
+	}
+}
+
+struct answer_rr {
+	char owner[MAX_DNS_NAME_LENGTH];
+	int owner_len;
+	uint16_t type;
+	uint32_t ttl;
+	int rdata;              //Offset of the RDATA in the message
+	int rdlen;
+};
+
+static void make_key(struct dns_key *key, const char *name, uint16_t type)
+{
+	memset(key, 0, sizeof(*key));
+	key->name_hash = dns_name_hash(name);
+	key->record_type = type;
+	key->class = DNS_CLASS_IN;
+}
+
+//Stage the CNAME chain and the addresses an upstream answer gives for q, the way
+//xdp_dns answers them: a chain of at most MAX_CNAME_DEPTH CNAMEs followed by the
+//whole RRset of the final name. pos is the offset of the answer section.
+//Returns 0 if the answer was staged, -1 if it cannot be answered from the maps.
+static int cache_answer(struct fill *f, const struct fill_query *q, const uint8_t *msg, int len, int pos)
+{
+	const struct dns_hdr *hdr = (const struct dns_hdr *)msg;
+	static struct answer_rr rrs[FILL_ANSWERS_MAX];
+	static struct rr_record cnames[MAX_CNAME_DEPTH];
+	//Zero-padded owner names of the CNAMEs and of the RRset, as hashed by xdp_dns
+	static char owners[MAX_CNAME_DEPTH + 1][MAX_DNS_NAME_LENGTH];
+	union {
+		struct a_record a;
+		struct aaaa_record aaaa;
+	} addrs;
+	int count = ntohs(hdr->ans_count);
+	const char *name = q->name;
+	int name_len = q->name_len;
+	uint64_t now = dns_now_boot_ns();
+	uint32_t ttl = f->max_ttl;
+	int depth, found = 0;
+
+	if ((q->type != A_RECORD_TYPE && q->type != AAAA_RECORD_TYPE) || count == 0 || count > FILL_ANSWERS_MAX)
+		return -1;
+
+	for (int i = 0; i < count; i++) {
+		struct answer_rr *rr = &rrs[i];
+
+		rr->owner_len = read_name(msg, len, &pos, rr->owner);
+		if (rr->owner_len < 0 || pos + 10 > len)
+			return -1;
+		rr->type = get_u16(msg + pos);
+		rr->ttl = get_u32(msg + pos + 4);
+		rr->rdlen = get_u16(msg + pos + 8);
+		rr->rdata = pos + 10;
+		if (rr->rdata + rr->rdlen > len || get_u16(msg + pos + 2) != DNS_CLASS_IN)
+			return -1;
+		pos = rr->rdata + rr->rdlen;
+	}
+
+	//Follow the chain from the question
+	for (depth = 0;; depth++) {
+		struct answer_rr *cname = NULL;
+		struct rr_record *r;
+		char target[MAX_DNS_NAME_LENGTH];
+		int off, target_len;
+		uint32_t cname_ttl;
+
+		for (int i = 0; i < count; i++) {
+			if (rrs[i].type == CNAME_RECORD_TYPE && rrs[i].owner_len == name_len &&
+				memcmp(rrs[i].owner, name, name_len) == 0) {
+				cname = &rrs[i];
+				break;
+			}
+		}
+		if (!cname)
+			break;
+		if (depth == MAX_CNAME_DEPTH)
+			return -1;
+
+		off = cname->rdata;
+		target_len = read_name(msg, len, &off, target);
+		cname_ttl = cname->ttl < f->max_ttl ? cname->ttl : f->max_ttl;
+		if (target_len < 0 || cname_ttl == 0)
+			return -1;
+		r = &cnames[depth];
+		memset(r, 0, sizeof(*r));
+		memset(owners[depth], 0, MAX_DNS_NAME_LENGTH);
+		memcpy(owners[depth], name, name_len);
+		r->name_check = dns_name_check(owners[depth]);
+		if (rr_record_add(r, CNAME_RECORD_TYPE, target, target_len, cname_ttl))
+			return -1;
+		r->expires = now + cname_ttl * 1000000000ULL;
+
+		name = r->data + sizeof(struct dns_response);
+		name_len = target_len;
+	}
+
+	//The RRset shares the lowest TTL of its records
+	for (int i = 0; i < count; i++) {
+		if (rrs[i].type == q->type && rrs[i].owner_len == name_len && memcmp(rrs[i].owner, name, name_len) == 0) {
+			if (rrs[i].ttl < ttl)
+				ttl = rrs[i].ttl;
+			found++;
+		}
+	}
+	if (!found || ttl == 0)
+		return -1;
+
+	memset(&addrs, 0, sizeof(addrs));
+	for (int i = 0; i < count; i++) {
+		const struct answer_rr *rr = &rrs[i];
+		int err = 0;
+
+		if (rr->type != q->type || rr->owner_len != name_len || memcmp(rr->owner, name, name_len) != 0)
+			continue;
+		if (q->type == A_RECORD_TYPE) {
+			struct in_addr ip_addr;
+
+			if (rr->rdlen != sizeof(ip_addr))
+				return -1;
+			memcpy(&ip_addr, msg + rr->rdata, sizeof(ip_addr));
+			err = a_rrset_add(&addrs.a, ip_addr, ttl);
+		} else {
+			struct in6_addr ip6_addr;
+
+			if (rr->rdlen != sizeof(ip6_addr))
+				return -1;
+			memcpy(&ip6_addr, msg + rr->rdata, sizeof(ip6_addr));
+			err = aaaa_rrset_add(&addrs.aaaa, ip6_addr, ttl);
+		}
+		//More addresses than an RRset in the maps holds
+		if (err)
+			return -1;
+	}
+
+	for (int i = 0; i < depth; i++) {
+		struct dns_key key;
+
+		make_key(&key, owners[i], CNAME_RECORD_TYPE);
+		stage_rrset(f, ZONE_RR, &key, &cnames[i], owners[i]);
+	}
+	memset(owners[depth], 0, MAX_DNS_NAME_LENGTH);
+	memcpy(owners[depth], name, name_len);
+	if (q->type == A_RECORD_TYPE) {
+		struct dns_key key;
+
+		addrs.a.name_check = dns_name_check(owners[depth]);
+		addrs.a.expires = now + ttl * 1000000000ULL;
+		make_key(&key, owners[depth], A_RECORD_TYPE);
+		stage_rrset(f, ZONE_A, &key, &addrs.a, owners[depth]);
+	} else {
+		struct dns_key key;
+
+		addrs.aaaa.name_check = dns_name_check(owners[depth]);
+		addrs.aaaa.expires = now + ttl * 1000000000ULL;
+		make_key(&key, owners[depth], AAAA_RECORD_TYPE);
+		stage_rrset(f, ZONE_AAAA, &key, &addrs.aaaa, owners[depth]);
+	}
+	return 0;
+}
+
+//Write the staged RRsets, then relay the answers they came from to every waiting client.
+//A client that asks again right away is answered by XDP instead of missing once more.
+static void relay_answers(struct fill *f)
+{
+	flush_stage(f);
+	for (int i = 0; i < f->relay_count; i++) {
+		struct fill_query *q = &f->queries[f->relay_queries[i]];
+		uint8_t *msg = f->relay_msgs + i * FILL_BUF_SIZE;
+
+		for (int j = 0; j < q->waiter_count; j++)
+			reply_waiter(f, q, &q->waiters[j], msg, f->relay_lens[i]);
+		f->stats.answers += q->waiter_count;
+		release_query(f, q);
+	}
+	f->relay_count = 0;
+}
+
+//An upstream answer: stage its RRsets if it can be cached, and queue it for relay_answers
+static void handle_answer(struct fill *f, uint8_t *msg, int len)
+{
+	const struct dns_hdr *hdr = (const struct dns_hdr *)msg;
+	char name[MAX_DNS_NAME_LENGTH];
+	struct fill_query *q;
+	int pos = DNS_HDR_SIZE, name_len, idx;
+
+	if (len < DNS_HDR_SIZE || !hdr->qr || ntohs(hdr->q_count) != 1 ||
+		(idx = f->by_id[ntohs(hdr->transaction_id)]) < 0) {
+		f->stats.dropped++;
+		return;
+	}
+	q = &f->queries[idx];
+
+	//The question must be the one asked
+	name_len = read_name(msg, len, &pos, name);
+	if (name_len != q->name_len || pos != DNS_HDR_SIZE + name_len || pos + 4 > len ||
+		memcmp(name, q->name, name_len) != 0 || get_u16(msg + pos) != q->type ||
+		get_u16(msg + pos + 2) != DNS_CLASS_IN) {
+		f->stats.dropped++;
+		return;
+	}
+
+	if (hdr->tc || hdr->rcode || cache_answer(f, q, msg, len, pos + 4) != 0)
+		f->stats.uncacheable++;
+
+	if (f->relay_count == FILL_RECV_BURST)
+		relay_answers(f);
+	memcpy(f->relay_msgs + f->relay_count * FILL_BUF_SIZE, msg, len);
+	f->relay_lens[f->relay_count] = len;
+	f->relay_queries[f->relay_count] = idx;
+	f->relay_count++;
+	//A second answer to the id is not relayed again
+	f->by_id[q->upstream_id] = -1;
+}
+
+//Answer the queries upstream has not answered in time with SERVFAIL
+static void expire_queries(struct fill *f, const struct timespec *now)
+{
+	for (int i = 0; i < FILL_PENDING_MAX && f->pending; i++) {
+		struct fill_query *q = &f->queries[i];
+
+		if (q->used && ms_since(&q->sent, now) >= FILL_TIMEOUT_MS)
+			fail_query(f, q, DNS_RCODE_SERVFAIL);
+	}
+}
+
+//Follow swap and rollback to the zone queries are answered from
+static int fill_open_zone(struct fill *f)
+{
+	int slot = zone_active_slot();
+
+	if (slot < 0)
+		return -1;
+	if (slot == f->slot)
+		return 0;
+	zone_close(f->fds);
+	if (zone_open_active(f->fds) < 0)
+		return -1;
+	f->slot = slot;
+	return 0;
+}
+
+static int open_upstream(const char *upstream)
+{
+	struct addrinfo hints, *ai;
+	char host[INET6_ADDRSTRLEN + 8], port[8] = "53";
+	char *sep;
+	int fd, err;
+
+	snprintf(host, sizeof(host), "%s", upstream);
+	sep = strrchr(host, '#');
+	if (sep) {
+		*sep = 0;
+		snprintf(port, sizeof(port), "%s", sep + 1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	err = getaddrinfo(host, port, &hints, &ai);
+	if (err) {
+		fprintf(stderr, "Error: Invalid upstream %s: %s\n", upstream, gai_strerror(err));
+		return -1;
+	}
+	fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		fprintf(stderr, "Error: Failed to connect to upstream %s: %s\n", upstream, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+//One socket for IPv4 and IPv6 queries, IPv4 clients show up as mapped addresses
+static int open_listen(int port)
+{
+	struct sockaddr_in6 addr;
+	int off = 0;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0 ||
+		bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Error: Failed to listen on port %d: %s\n", port, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void print_stats(struct fill *f, struct fill_stats *last, double interval)
+{
+	struct fill_stats *s = &f->stats;
+	uint64_t queries = s->queries - last->queries;
+	uint64_t merged = s->merged - last->merged;
+
+	//Misses reaching userspace fall while the maps warm up
+	printf("%.0f misses/s, %.0f upstream/s, %.1f%% merged, %llu RRsets filled, %llu kept, "
+		   "%llu uncacheable, %llu failed, %llu dropped, %d waiting\n",
+		   queries / interval, (s->upstream - last->upstream) / interval,
+		   queries ? 100.0 * merged / queries : 0.0,
+		   (unsigned long long)(s->filled - last->filled), (unsigned long long)(s->kept - last->kept),
+		   (unsigned long long)(s->uncacheable - last->uncacheable),
+		   (unsigned long long)(s->failed - last->failed),
+		   (unsigned long long)(s->dropped - last->dropped), f->pending);
+	fflush(stdout);
+	*last = *s;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s -u address[#port] [-p port] [-m max_ttl] [-i seconds]\n", progname);
+	fprintf(stderr, "  -u  upstream resolver the misses are forwarded to\n");
+	fprintf(stderr, "  -p  port the queries passed on by xdp_dns arrive at (default %d)\n", FILL_DEFAULT_PORT);
+	fprintf(stderr, "  -m  longest time in seconds an answer is kept in the maps (default %d)\n", FILL_DEFAULT_MAX_TTL);
+	fprintf(stderr, "  -i  seconds between two lines of statistics, 0 for none (default 5)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t buf[FILL_BUF_SIZE];
+	struct fill_stats last;
+	struct timespec start, checked, now;
+	struct pollfd pfds[3];
+	sigset_t signal_mask;
+	const char *upstream = NULL;
+	int port = FILL_DEFAULT_PORT, interval = 5;
+	struct fill f;
+	int opt, ret = 0;
+
+	memset(&f, 0, sizeof(f));
+	f.max_ttl = FILL_DEFAULT_MAX_TTL;
+	while ((opt = getopt(argc, argv, "u:p:m:i:")) != -1) {
+		switch (opt) {
+			case 'u':
+				upstream = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'm':
+				f.max_ttl = strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case '?':
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (!upstream || optind != argc || port <= 0 || port > 65535 || interval < 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	f.queries = calloc(FILL_PENDING_MAX, sizeof(*f.queries));
+	f.by_id = malloc(65536 * sizeof(*f.by_id));
+	for (int i = 0; i < ZONE_MAPS; i++)
+		f.stage[i].values = calloc(FILL_STAGE_MAX, fill_value_sizes[i]);
+	f.names = calloc(ZONE_MAPS * FILL_STAGE_MAX, sizeof(*f.names));
+	f.relay_msgs = malloc(FILL_RECV_BURST * FILL_BUF_SIZE);
+	if (!f.queries || !f.by_id || !f.stage[ZONE_A].values || !f.stage[ZONE_AAAA].values ||
+		!f.stage[ZONE_RR].values || !f.names || !f.relay_msgs) {
+		fprintf(stderr, "Error: failed to allocate memory\n");
+		return 1;
+	}
+	memset(f.by_id, 0xff, 65536 * sizeof(*f.by_id));
+	memset(f.buckets, 0xff, sizeof(f.buckets));
+	for (int i = 0; i < ZONE_MAPS; i++)
+		f.fds[i] = -1;
+	f.slot = -1;
+	srandom(time(NULL) ^ getpid());
+
+	if (fill_open_zone(&f))
+		return 1;
+	f.names_fd = dns_names_open();
+	f.upstream_fd = open_upstream(upstream);
+	if (f.upstream_fd < 0)
+		return 1;
+	f.listen_fd = open_listen(port);
+	if (f.listen_fd < 0)
+		return 1;
+
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+	pfds[0].fd = signalfd(-1, &signal_mask, SFD_CLOEXEC);
+	pfds[1].fd = f.listen_fd;
+	pfds[2].fd = f.upstream_fd;
+	for (int i = 0; i < 3; i++)
+		pfds[i].events = POLLIN;
+
+	memset(&last, 0, sizeof(last));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	checked = start;
+	while (1) {
+		if (poll(pfds, 3, FILL_POLL_MS) < 0 && errno != EINTR) {
+			fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+		if (pfds[0].revents)
+			break;
+		if (fill_open_zone(&f)) {
+			ret = 1;
+			break;
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			for (int i = 0; i < FILL_RECV_BURST; i++) {
+				struct sockaddr_in6 addr;
+				socklen_t addr_len = sizeof(addr);
+				int len = recvfrom(f.listen_fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addr_len);
+
+				if (len < 0)
+					break;
+				handle_query(&f, buf, len, &addr);
+			}
+		}
+		if (pfds[2].revents & (POLLIN | POLLERR)) {
+			for (int i = 0; i < FILL_RECV_BURST; i++) {
+				int len = recv(f.upstream_fd, buf, sizeof(buf), 0);
+
+				//ICMP errors of the upstream show up as ECONNREFUSED, the queries time out
+				if (len < 0 && errno == EAGAIN)
+					break;
+				if (len > 0)
+					handle_answer(&f, buf, len);
+			}
+		}
+		//Answers that arrived together are written together, before they are relayed
+		relay_answers(&f);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ms_since(&checked, &now) >= FILL_POLL_MS) {
+			expire_queries(&f, &now);
+			checked = now;
+		}
+		if (interval && ms_since(&start, &now) >= interval * 1000.0) {
+			print_stats(&f, &last, ms_since(&start, &now) / 1000);
+			start = now;
+		}
+	}
+
+	close(pfds[0].fd);
+	close(f.listen_fd);
+	close(f.upstream_fd);
+	zone_close(f.fds);
+	if (f.names_fd >= 0)
+		close(f.names_fd);
+	for (int i = 0; i < ZONE_MAPS; i++)
+		free(f.stage[i].values);
+	free(f.names);
+	free(f.relay_msgs);
+	free(f.by_id);
+	free(f.queries);
+	return ret;
+}
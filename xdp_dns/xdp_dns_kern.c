@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place - Suite 330
 #include <linux/bpf.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/udp.h>
 #include <linux/version.h>
 #include <linux/in.h>
@@ -28,76 +29,229 @@ Foundation, Inc., 59 Temple Place - Suite 330
 #include <bpf_helpers.h>
 #include <bpf_endian.h>
 
+#include "parsing_helpers.h"
+#include "csum_helpers.h"
+#include "latency.h"
+#include "rxq_stats.h"
 #include "common.h"
 
-//Create different BPF map of type Hash table for DNS A Records
-//Key is a dns_query struct, value is the associated IPv4 address
+//Records live in hash maps that are reached through one array of maps per record set:
+//  xdns_a_zone     A records, key is a dns_key struct, value an a_record
+//  xdns_aaaa_zone  AAAA records, value an aaaa_record
+//  xdns_rr_zone    every other record type (CNAME, MX, TXT, SRV, PTR, NS, ...), value holds
+//                  the pre-serialized answer section built by xdp_dns_update
+//Every array has XDNS_ZONE_SLOTS slots and xdns_zone_active selects the slot the queries read.
+//A new zone is built in the other slot and published by flipping xdns_zone_active, a single
+//map update. The hash maps are created by xdp_dns_user, which also sets their size.
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, struct dns_query);
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(key_size, sizeof(uint32_t));
+	__uint(value_size, sizeof(uint32_t));
+	__uint(max_entries, XDNS_ZONE_SLOTS);
+    __uint(pinning, 1);
+} xdns_a_zone SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(key_size, sizeof(uint32_t));
+	__uint(value_size, sizeof(uint32_t));
+	__uint(max_entries, XDNS_ZONE_SLOTS);
+    __uint(pinning, 1);
+} xdns_aaaa_zone SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(key_size, sizeof(uint32_t));
+	__uint(value_size, sizeof(uint32_t));
+	__uint(max_entries, XDNS_ZONE_SLOTS);
+    __uint(pinning, 1);
+} xdns_rr_zone SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, uint32_t);
+	__type(value, uint32_t);
+	__uint(max_entries, 1);
+    __uint(pinning, 1);
+} xdns_zone_active SEC(".maps");
+
+//A and AAAA answers of a resolver on this host, snooped on egress by tc_dns and keyed like the
+//record maps. Consulted for names the zone does not hold; LRU, so memory stays bounded whatever
+//the resolver sees. The declarations must match the ones in tc_dns_kern.c.
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct dns_key);
 	__type(value, struct a_record);
-	__uint(max_entries, 65536);
+	__uint(max_entries, XDNS_SNOOP_ENTRIES);
     __uint(pinning, 1);
-} xdns_a_records SEC(".maps");
+} xdns_snoop_a SEC(".maps");
 
-//Create different BPF map of type Hash table for DNS AAAA Records
-//Key is a dns_query struct, value is the associated IPv6 address
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, struct dns_query);
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct dns_key);
 	__type(value, struct aaaa_record);
-	__uint(max_entries, 65536);
+	__uint(max_entries, XDNS_SNOOP_ENTRIES);
+    __uint(pinning, 1);
+} xdns_snoop_aaaa SEC(".maps");
+
+//Names of the records (see struct dns_name), read on a hit to compare the question with.
+//Allocated on insert like the record maps, xdp_dns_user sets its size and flags to match them.
+//Written by the userspace tools and tc_dns, which reuses the pinned map.
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct dns_key);
+	__type(value, struct dns_name);
+	__uint(max_entries, XDNS_ZONE_SLOTS * XDNS_DEFAULT_RECORDS + XDNS_SNOOP_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
     __uint(pinning, 1);
-} xdns_aaaa_records SEC(".maps");
+} xdns_names SEC(".maps");
+
+//Scratch buffer for assembling the answer section. Must hold the largest answer plus the OPT record.
+#define DNS_SCRATCH_SIZE 512
+
+//Largest response sent over UDP, also the payload size announced in our OPT record
+#define DNS_UDP_SIZE 512
+
+struct dns_scratch {
+    char buf[DNS_SCRATCH_SIZE];
+    //Round-robin position for rotating RRsets, advanced once per answered query
+    uint32_t rotation;
+    //Parsed queries left until the next one is sampled
+    uint32_t sample_countdown;
+    //Sampled query, sent to xdns_events once the outcome is known
+    struct xdns_event event;
+};
+
+//Per-CPU scratch area in which the answer section is assembled before it is copied into the packet.
+//Every CPU has its own copy, so RX queues serviced in parallel never overwrite each other's answers.
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct dns_scratch);
+	__uint(max_entries, 1);
+} xdns_scratch SEC(".maps");
+
+//Per-CPU counters for every decision taken on a packet, read by xdp_dns_user
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct xdns_stats);
+	__uint(max_entries, 1);
+    __uint(pinning, 1);
+} xdns_stats SEC(".maps");
+
+//Runtime options, set by xdp_dns_events
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct xdns_config);
+	__uint(max_entries, 1);
+    __uint(pinning, 1);
+} xdns_config SEC(".maps");
+
+//Sampled queries, read by xdp_dns_events
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+    __uint(pinning, 1);
+} xdns_events SEC(".maps");
+
+//Wake the consumer only once this many bytes of events are waiting, it polls with a timeout anyway
+#define XDNS_EVENTS_WAKEUP_BYTES (64 * 1024)
+
+//Processing time histograms per outcome, recorded while xdns_lat_on is set (see the latency tool)
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct latency_hist);
+	__uint(max_entries, 1);
+    __uint(pinning, 1);
+} xdns_lat SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, uint32_t);
+	__type(value, uint32_t);
+	__uint(max_entries, 1);
+    __uint(pinning, 1);
+} xdns_lat_on SEC(".maps");
+
+//Packets and answers per RX queue, to check how the NIC spreads the queries (see xdp_dns_user -i)
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct rxq_stats);
+	__uint(max_entries, MAX_RX_QUEUES);
+    __uint(pinning, 1);
+} xdns_rxq SEC(".maps");
 
 static int parse_query(struct xdp_md *ctx, void *query_start, struct dns_query *q);
 #ifdef EDNS
 static inline int create_ar_response(struct ar_hdr *ar, char *dns_buffer, size_t *buf_size);
 static inline int parse_ar(struct xdp_md *ctx, struct dns_hdr *dns_hdr, int query_length, struct ar_hdr *ar);
 #endif
-static inline void modify_dns_header_response(struct dns_hdr *dns_hdr);
-static inline void update_ip_checksum(void *data, int len, uint16_t *checksum_location);
+static inline int create_a_response(struct a_record *a_record, char *dns_buffer, uint16_t owner, uint32_t rotation, uint32_t ttl, size_t *buf_size);
+static inline int create_aaaa_response(struct aaaa_record *aaaa_record, char *dns_buffer, uint16_t owner, uint32_t rotation, uint32_t ttl, size_t *buf_size);
+static inline int record_expired(uint64_t expires, uint64_t *now);
+static inline uint32_t record_ttl(uint32_t ttl, uint64_t expires, uint64_t now);
+static inline void cap_rr_ttl(char *dns_buffer, size_t offset, int count, uint32_t ttl);
+static inline int create_rr_response(struct rr_record *rr_record, char *dns_buffer, uint16_t owner, size_t *buf_size);
+static inline void modify_dns_header_response(struct dns_hdr *dns_hdr, uint16_t ans_count);
+static inline uint16_t udp_checksum(uint64_t csum, struct udphdr *udp, void *data_end);
 static inline void swap_mac(uint8_t *src_mac, uint8_t *dst_mac);
-
-char dns_buffer[40];
-
-SEC("xdp")
-int xdp_dns(struct xdp_md *ctx)
+static inline int copy_to_packet(char *dst, void *data_end, char *src, size_t len);
+static inline uint64_t dns_word_tolower(uint64_t word);
+static inline void count_stat(struct xdns_stats *stats, uint32_t stat);
+static inline int sample_query(struct dns_scratch *scratch);
+static inline void count_hit(struct xdns_stats *stats, uint16_t record_type);
+static __always_inline int name_matches(const struct dns_query *q);
+static inline void count_miss(struct xdns_stats *stats, uint16_t record_type);
+
+//Answer the packet if it is a query for a record we hold.
+//outcome is set to LATENCY_MISS when the lookup fails, answered packets are hits.
+//If the query is sampled, *event points at its staged event.
+static __always_inline int process_packet(struct xdp_md *ctx, uint32_t *outcome, struct xdns_event **event)
 {
-    #ifdef DEBUG
-    uint64_t start = bpf_ktime_get_ns();
-    #endif
-
     void *data_end = (void *)(unsigned long)ctx->data_end;
     void *data = (void *)(unsigned long)ctx->data;
 
-    //Boundary check: check if packet is larger than a full ethernet + ip header
-    if (data + sizeof(struct ethhdr) + sizeof(struct iphdr) > data_end)
-    {
-        return DEFAULT_ACTION;
-    }
+    uint32_t stats_key = 0;
+    struct xdns_stats *stats = bpf_map_lookup_elem(&xdns_stats, &stats_key);
+
+    //Walk the Ethernet header (with up to two VLAN tags) and the IP header.
+    //The header offsets are kept to find the headers again once the packet has been resized.
+    struct hdr_cursor nh = { .pos = data, .off = 0 };
+    struct ethhdr *eth;
+    struct iphdr *ip;
+    struct ipv6hdr *ip6;
+    struct udphdr *udp;
+    int is_ipv6 = 0;
+    int protocol;
 
-    struct ethhdr *eth = data;
+    int eth_proto = parse_ethhdr(&nh, data_end, &eth);
+    uint32_t l3_off = nh.off;
 
     //Ignore packet if ethernet protocol is not IP-based
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
+    if (eth_proto == bpf_htons(ETH_P_IP))
+    {
+        protocol = parse_iphdr(&nh, data_end, &ip);
+    }
+    else if (eth_proto == bpf_htons(ETH_P_IPV6))
+    {
+        //IPv6 extension headers are not followed, such queries take the slow path
+        protocol = parse_ip6hdr(&nh, data_end, &ip6);
+        is_ipv6 = 1;
+    }
+    else
     {
+        count_stat(stats, XDNS_STAT_NON_IP);
         return DEFAULT_ACTION;
     }
 
-    struct iphdr *ip = data + sizeof(*eth);
+    uint32_t l4_off = nh.off;
 
-    if (ip->protocol == IPPROTO_UDP)
+    if (protocol == IPPROTO_UDP && parse_udphdr(&nh, data_end, &udp) >= 0)
     {
-        struct udphdr *udp;
-        //Boundary check for UDP
-        if (data + sizeof(*eth) + sizeof(*ip) + sizeof(*udp) > data_end)
-        {
-            return DEFAULT_ACTION;
-        }
-
-        udp = data + sizeof(*eth) + sizeof(*ip);
-
         //Check if dest port equals 53
         if (udp->dest == bpf_htons(53))
         {
@@ -107,12 +261,13 @@ int xdp_dns(struct xdp_md *ctx)
             #endif
 
             //Boundary check for minimal DNS header
-            if (data + sizeof(*eth) + sizeof(*ip) + sizeof(*udp) + sizeof(struct dns_hdr) > data_end)
+            if (nh.pos + sizeof(struct dns_hdr) > data_end)
             {
+                count_stat(stats, XDNS_STAT_PARSE_FAIL);
                 return DEFAULT_ACTION;
             }
 
-            struct dns_hdr *dns_hdr = data + sizeof(*eth) + sizeof(*ip) + sizeof(*udp);
+            struct dns_hdr *dns_hdr = nh.pos;
 
             //Check if header contains a standard query
             if (dns_hdr->qr == 0 && dns_hdr->opcode == 0)
@@ -129,9 +284,53 @@ int xdp_dns(struct xdp_md *ctx)
                 int query_length = 0;
                 query_length = parse_query(ctx, query_start, &q);
                 if (query_length < 1)
+                {
+                    count_stat(stats, XDNS_STAT_PARSE_FAIL);
+                    return DEFAULT_ACTION;
+                }
+
+                //Bound the query length so the verifier accepts it as a packet offset
+                if (query_length > MAX_DNS_NAME_LENGTH + 4)
+                {
+                    count_stat(stats, XDNS_STAT_PARSE_FAIL);
+                    return DEFAULT_ACTION;
+                }
+
+                uint32_t scratch_key = 0;
+                struct dns_scratch *scratch = bpf_map_lookup_elem(&xdns_scratch, &scratch_key);
+                if (!scratch)
                 {
                     return DEFAULT_ACTION;
                 }
+                char *dns_buffer = scratch->buf;
+
+                //Stage an event for a sampled query while the client address is still the source
+                if (sample_query(scratch))
+                {
+                    struct xdns_event *ev = &scratch->event;
+                    int i;
+
+                    ev->timestamp = bpf_ktime_get_ns();
+                    ev->record_type = q.record_type;
+                    ev->name_len = q.name_len;
+                    ev->outcome = LATENCY_PASS;
+                    __builtin_memset(ev->client, 0, sizeof(ev->client));
+                    if (is_ipv6)
+                    {
+                        ev->family = 6;
+                        __builtin_memcpy(ev->client, &ip6->saddr, sizeof(struct in6_addr));
+                    }
+                    else
+                    {
+                        ev->family = 4;
+                        __builtin_memcpy(ev->client, &ip->saddr, sizeof(uint32_t));
+                    }
+                    for (i = 0; i < MAX_DNS_NAME_LENGTH; i += sizeof(uint64_t))
+                    {
+                        *(uint64_t *)&ev->name[i] = *(uint64_t *)&q.name[i];
+                    }
+                    *event = ev;
+                }
 
                 size_t buf_size = 0;
                 #ifdef DEBUG
@@ -140,64 +339,252 @@ int xdp_dns(struct xdp_md *ctx)
                 bpf_printk("DNS name: %s", q.name);
                 #endif
 
-                if (q.record_type == A_RECORD_TYPE) {
-                    //Check if query matches a record in our hash table
-                    struct a_record *a_record;
-                    a_record = bpf_map_lookup_elem(&xdns_a_records, &q);
-                    if (!a_record) {
+                //Records are looked up by the hash of the name, the name check is only compared on a hit
+                struct dns_key key = {
+                    .name_hash = q.name_hash,
+                    .record_type = q.record_type,
+                    .class = q.class,
+                    .pad = 0,
+                };
+
+                //Answers start at a per-CPU rotating offset into the RRset (round-robin)
+                uint32_t rotation = scratch->rotation++;
+                int ans_count = 0;
+                //Read on the first record with an expiry
+                uint64_t now = 0;
+
+                //The slot is read once per query, so a zone swap never mixes records of two zones
+                uint32_t zone_slot = 0;
+                uint32_t *active = bpf_map_lookup_elem(&xdns_zone_active, &zone_slot);
+                if (active)
+                {
+                    zone_slot = *active & (XDNS_ZONE_SLOTS - 1);
+                }
+                void *rr_records = bpf_map_lookup_elem(&xdns_rr_zone, &zone_slot);
+                int snooped = 0;
+
+                if (q.record_type == A_RECORD_TYPE || q.record_type == AAAA_RECORD_TYPE) {
+                    //Follow CNAMEs until a name holds the queried type. Every CNAME on the way is
+                    //answered, its owner name points at the previous target (or the question).
+                    struct a_record *a_record = NULL;
+                    struct aaaa_record *aaaa_record = NULL;
+                    uint16_t owner = 0xc00c;
+                    int depth;
+                    //Check of the name looked up, the question and then every CNAME target,
+                    //so a record found under a colliding hash is never spliced into the chain
+                    uint64_t name_check = q.name_check;
+
+                    void *a_records = NULL;
+                    void *aaaa_records = NULL;
+                    if (q.record_type == A_RECORD_TYPE) {
+                        a_records = bpf_map_lookup_elem(&xdns_a_zone, &zone_slot);
+                    } else {
+                        aaaa_records = bpf_map_lookup_elem(&xdns_aaaa_zone, &zone_slot);
+                    }
+                    if ((!a_records && !aaaa_records) || !rr_records) {
+                        count_miss(stats, q.record_type);
+                        *outcome = LATENCY_MISS;
                         return DEFAULT_ACTION;
                     }
 
-                    buf_size = sizeof(struct dns_response);
-                    //Create DNS response and add to temporary buffer.
-                    //Formulate a DNS response. Currently defaults to hardcoded query pointer + type + class in + ttl + ip_addr as reply.
-                    struct dns_response *response = (struct dns_response *) &dns_buffer[0];
-                    response->query_pointer = bpf_htons(0xc00c);
-                    response->class = bpf_htons(0x0001);
-                    response->record_type = bpf_htons(A_RECORD_TYPE);
-                    response->ttl = bpf_htonl(a_record->ttl);
-                    response->data_length = bpf_htons((uint16_t)sizeof(a_record->ip_addr));
-                    //Copy IP address
-                    __builtin_memcpy(&dns_buffer[buf_size], &a_record->ip_addr, sizeof(struct in_addr));
-                    buf_size += sizeof(struct in_addr);
-                } else if (q.record_type == AAAA_RECORD_TYPE) {
-                    //Check if query matches a record in our hash table
-                    struct aaaa_record *aaaa_record;
-                    aaaa_record = bpf_map_lookup_elem(&xdns_aaaa_records, &q);
-                    if (!aaaa_record) {
-                        return DEFAULT_ACTION;
+                    for (depth = 0; depth <= MAX_CNAME_DEPTH; depth++)
+                    {
+                        //Check if the current name has a record of the queried type
+                        key.record_type = q.record_type;
+                        if (a_records) {
+                            a_record = bpf_map_lookup_elem(a_records, &key);
+                            if (a_record) {
+                                break;
+                            }
+                        } else if (aaaa_records) {
+                            aaaa_record = bpf_map_lookup_elem(aaaa_records, &key);
+                            if (aaaa_record) {
+                                break;
+                            }
+                        }
+
+                        //Chains longer than MAX_CNAME_DEPTH (or loops) are left to userspace
+                        if (depth == MAX_CNAME_DEPTH) {
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+
+                        key.record_type = CNAME_RECORD_TYPE;
+                        struct rr_record *cname = bpf_map_lookup_elem(rr_records, &key);
+                        if (!cname || cname->name_check != name_check) {
+                            //A name the zone does not hold may have been answered by the resolver
+                            //on this host, the answers snooped by tc_dns are kept for the question name
+                            if (depth == 0) {
+                                key.record_type = q.record_type;
+                                if (a_records) {
+                                    a_record = bpf_map_lookup_elem(&xdns_snoop_a, &key);
+                                } else {
+                                    aaaa_record = bpf_map_lookup_elem(&xdns_snoop_aaaa, &key);
+                                }
+                                if (a_record || aaaa_record) {
+                                    snooped = 1;
+                                    break;
+                                }
+                            }
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+                        if (record_expired(cname->expires, &now)) {
+                            count_stat(stats, XDNS_STAT_EXPIRED);
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+
+                        size_t cname_offset = buf_size;
+                        if (create_rr_response(cname, dns_buffer, owner, &buf_size) != 1) {
+                            count_stat(stats, XDNS_STAT_ANSWER_FAIL);
+                            return DEFAULT_ACTION;
+                        }
+                        if (cname->expires) {
+                            cap_rr_ttl(dns_buffer, cname_offset, 1, record_ttl(~0U, cname->expires, now));
+                        }
+                        ans_count++;
+
+                        //The next owner name is the RDATA of the CNAME just written
+                        owner = 0xc000 | (sizeof(struct dns_hdr) + query_length + cname_offset + sizeof(struct dns_response));
+                        key.name_hash = cname->target_hash;
+                        name_check = cname->target_check;
                     }
 
-                    buf_size = sizeof(struct dns_response);
-                    struct dns_response *response = (struct dns_response *) &dns_buffer[0];
-                    response->query_pointer = bpf_htons(0xc00c);
-                    response->class = bpf_htons(0x0001);
-                    response->record_type = bpf_htons(AAAA_RECORD_TYPE);
-                    response->ttl = bpf_htonl(aaaa_record->ttl);
-                    response->data_length = bpf_htons((uint16_t)sizeof(aaaa_record->ip_addr));
-                    //Copy IP address
-                    __builtin_memcpy(&dns_buffer[buf_size], &aaaa_record->ip_addr, sizeof(struct in6_addr));
-                    buf_size += sizeof(struct in6_addr);
+                    int count;
+                    if (a_record) {
+                        if (a_record->name_check != name_check) {
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+                        if (record_expired(a_record->expires, &now)) {
+                            //Snooped answers are not swept, make room for fresh ones right away
+                            if (snooped) {
+                                bpf_map_delete_elem(&xdns_snoop_a, &key);
+                            }
+                            count_stat(stats, XDNS_STAT_EXPIRED);
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+
+                        //Create DNS responses and add them to the per-CPU scratch buffer.
+                        count = create_a_response(a_record, dns_buffer, owner, rotation,
+                                                  record_ttl(a_record->ttl, a_record->expires, now), &buf_size);
+                    } else {
+                        //The loop above only breaks out with a record of the queried type
+                        if (aaaa_record->name_check != name_check) {
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+                        if (record_expired(aaaa_record->expires, &now)) {
+                            if (snooped) {
+                                bpf_map_delete_elem(&xdns_snoop_aaaa, &key);
+                            }
+                            count_stat(stats, XDNS_STAT_EXPIRED);
+                            count_miss(stats, q.record_type);
+                            *outcome = LATENCY_MISS;
+                            return DEFAULT_ACTION;
+                        }
+
+                        count = create_aaaa_response(aaaa_record, dns_buffer, owner, rotation,
+                                                     record_ttl(aaaa_record->ttl, aaaa_record->expires, now), &buf_size);
+                    }
+
+                    if (count < 1) {
+                        count_stat(stats, XDNS_STAT_ANSWER_FAIL);
+                        return DEFAULT_ACTION;
+                    }
+                    ans_count += count;
                 } else {
+                    //Any other type is answered from the generic record store with a single bounded copy
+                    struct rr_record *rr_record = NULL;
+                    if (rr_records)
+                    {
+                        rr_record = bpf_map_lookup_elem(rr_records, &key);
+                    }
+                    if (!rr_record || rr_record->name_check != q.name_check) {
+                        count_miss(stats, q.record_type);
+                        *outcome = LATENCY_MISS;
+                        return DEFAULT_ACTION;
+                    }
+                    if (record_expired(rr_record->expires, &now)) {
+                        count_stat(stats, XDNS_STAT_EXPIRED);
+                        count_miss(stats, q.record_type);
+                        *outcome = LATENCY_MISS;
+                        return DEFAULT_ACTION;
+                    }
+
+                    ans_count = create_rr_response(rr_record, dns_buffer, 0xc00c, &buf_size);
+                    if (rr_record->expires) {
+                        cap_rr_ttl(dns_buffer, 0, ans_count, record_ttl(~0U, rr_record->expires, now));
+                    }
+                }
+
+                if (ans_count < 1)
+                {
+                    count_stat(stats, XDNS_STAT_ANSWER_FAIL);
+                    return DEFAULT_ACTION;
+                }
+
+                //Only now that there is an answer, make sure the question is the name of the records
+                if (!name_matches(&q))
+                {
+                    count_stat(stats, XDNS_STAT_NAME_MISMATCH);
+                    count_miss(stats, q.record_type);
+                    *outcome = LATENCY_MISS;
                     return DEFAULT_ACTION;
                 }
-                
+                count_hit(stats, q.record_type);
+                if (snooped) {
+                    count_stat(stats, XDNS_STAT_SNOOPED);
+                }
+
+                //A chain or an RRset that does not fit a UDP response is not cut short, the
+                //answer section is dropped and TC tells the client to retry over TCP
+                size_t response_size = sizeof(struct dns_hdr) + query_length + buf_size;
+                #ifdef EDNS
+                if (dns_hdr->add_count > 0)
+                {
+                    response_size += sizeof(struct ar_hdr);
+                }
+                #endif
+                int truncated = response_size > DNS_UDP_SIZE;
+                if (truncated)
+                {
+                    count_stat(stats, XDNS_STAT_TRUNCATED);
+                    ans_count = 0;
+                    buf_size = 0;
+                }
+
                 //Change DNS header to a valid response header
-                modify_dns_header_response(dns_hdr);
+                modify_dns_header_response(dns_hdr, ans_count);
+                dns_hdr->tc = truncated;
 
+                //Anything that followed the question is overwritten by our answer
+                uint16_t add_count = 0;
                 #ifdef EDNS
                 //If an additional record is present
                 if(dns_hdr->add_count > 0)
                 {
-                    //Parse AR record
+                    //Parse AR record, if there is room left for our OPT record
                     struct ar_hdr ar;
-                    if(parse_ar(ctx, dns_hdr, query_length, &ar) != -1)
+                    if(buf_size <= DNS_SCRATCH_SIZE - sizeof(struct ar_hdr) && parse_ar(ctx, dns_hdr, query_length, &ar) != -1)
                     {     
-                        //Create AR response and add to temporary buffer
-                        create_ar_response(&ar, &dns_buffer[buf_size], &buf_size);
+                        //Create AR response and add to the scratch buffer
+                        if (create_ar_response(&ar, &dns_buffer[buf_size], &buf_size) == 0)
+                        {
+                            add_count = 1;
+                        }
                     }
                 }
                 #endif
+                dns_hdr->add_count = bpf_htons(add_count);
 
                 //Start our response [query_length] bytes beyond the header
                 void *answer_start = (void *)dns_hdr + sizeof(struct dns_hdr) + query_length;
@@ -210,6 +597,7 @@ int xdp_dns(struct xdp_md *ctx)
                     #ifdef DEBUG
                     bpf_printk("Adjust tail fail");
                     #endif
+                    count_stat(stats, XDNS_STAT_ADJUST_TAIL_FAIL);
                 }
                 else
                 {
@@ -218,71 +606,266 @@ int xdp_dns(struct xdp_md *ctx)
                     data = (void *)(unsigned long)ctx->data;
                     data_end = (void *)(unsigned long)ctx->data_end;
 
-                    //Copy bytes from our temporary buffer to packet buffer
-                    char *dst = data + sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(struct dns_hdr) + query_length;
-                    for (int i = 0; i < sizeof(dns_buffer) && i < buf_size && dst + i + 1 <= data_end; i++) {
-                        dst[i] = dns_buffer[i];
+                    //Copy the answer from the scratch buffer to the packet buffer
+                    char *dst = data + l4_off + sizeof(struct udphdr) + sizeof(struct dns_hdr) + query_length;
+                    if (copy_to_packet(dst, data_end, dns_buffer, buf_size) < 0)
+                    {
+                        #ifdef DEBUG
+                        bpf_printk("Error: Boundary exceeded while copying answer");
+                        #endif
+                        count_stat(stats, XDNS_STAT_ANSWER_FAIL);
+                        return DEFAULT_ACTION;
                     }
-                    
+
                     eth = data;
-                    ip = data + sizeof(struct ethhdr);
-                    udp = data + sizeof(struct ethhdr) + sizeof(struct iphdr);
+                    udp = data + l4_off;
 
                     //Do a new boundary check
-                    if (data + sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) > data_end)
+                    if ((void *)udp + sizeof(struct udphdr) > data_end)
                     {
                         #ifdef DEBUG
                         bpf_printk("Error: Boundary exceeded");
                         #endif
+                        count_stat(stats, XDNS_STAT_ANSWER_FAIL);
                         return DEFAULT_ACTION;
                     }
 
-                    //Adjust UDP length and IP length
-                    uint16_t iplen = (data_end - data) - sizeof(struct ethhdr);
-                    uint16_t udplen = (data_end - data) - sizeof(struct ethhdr) - sizeof(struct iphdr);
-                    ip->tot_len = bpf_htons(iplen);
+                    //Adjust UDP length
+                    uint16_t udplen = data_end - (void *)udp;
                     udp->len = bpf_htons(udplen);
 
                     //Swap eth macs
                     swap_mac((uint8_t *)eth->h_source, (uint8_t *)eth->h_dest);
 
-                    //Swap src/dst IP
-                    uint32_t src_ip = ip->saddr;
-                    ip->saddr = ip->daddr;
-                    ip->daddr = src_ip;
-
-                    //Set UDP checksum to zero
-                    udp->check = 0;
-
                     //Swap udp src/dst ports
                     uint16_t tmp_src = udp->source;
                     udp->source = udp->dest;
                     udp->dest = tmp_src;
 
-                    //Recalculate IP checksum
-                    update_ip_checksum(ip, sizeof(struct iphdr), &ip->check);
+                    if (is_ipv6)
+                    {
+                        ip6 = data + l3_off;
+                        if ((void *)ip6 + sizeof(struct ipv6hdr) > data_end)
+                        {
+                            count_stat(stats, XDNS_STAT_ANSWER_FAIL);
+                            return DEFAULT_ACTION;
+                        }
+
+                        //Adjust IPv6 payload length and swap src/dst IP
+                        ip6->payload_len = bpf_htons(udplen);
+                        struct in6_addr src_ip6 = ip6->saddr;
+                        ip6->saddr = ip6->daddr;
+                        ip6->daddr = src_ip6;
+
+                        //The UDP checksum is mandatory over IPv6 (RFC 8200)
+                        udp->check = 0;
+                        udp->check = udp_checksum((uint32_t)bpf_csum_diff(0, 0, (__be32 *)&ip6->saddr, 2 * sizeof(struct in6_addr), 0),
+                                                  udp, data_end);
+                    }
+                    else
+                    {
+                        ip = data + l3_off;
+                        if ((void *)ip + sizeof(struct iphdr) > data_end)
+                        {
+                            count_stat(stats, XDNS_STAT_ANSWER_FAIL);
+                            return DEFAULT_ACTION;
+                        }
+
+                        //Adjust IP length, the header keeps its options.
+                        //Only the length changes the IP checksum, which is patched incrementally (RFC 1624).
+                        uint16_t old_tot_len = ip->tot_len;
+                        ip->tot_len = bpf_htons(udplen + (l4_off - l3_off));
+                        csum_replace2(&ip->check, old_tot_len, ip->tot_len);
+
+                        //Swap src/dst IP, which leaves the checksum unchanged
+                        uint32_t src_ip = ip->saddr;
+                        ip->saddr = ip->daddr;
+                        ip->daddr = src_ip;
+
+                        //The UDP checksum is optional over IPv4, zero means none
+                        udp->check = 0;
+                        #ifdef UDP_CHECKSUM
+                        udp->check = udp_checksum((uint32_t)bpf_csum_diff(0, 0, (__be32 *)&ip->saddr, 2 * sizeof(uint32_t), 0),
+                                                  udp, data_end);
+                        #endif
+                    }
 
                     #ifdef DEBUG
                     bpf_printk("XDP_TX");
                     #endif
 
-        
-                    #ifdef DEBUG
-                    uint64_t end = bpf_ktime_get_ns();
-                    uint64_t elapsed = end-start;
-                    bpf_printk("Time elapsed: %d", elapsed);
-                    #endif
-
                     //Emit modified packet
+                    count_stat(stats, XDNS_STAT_TX);
                     return XDP_TX;
                 }
             }
+            else
+            {
+                count_stat(stats, XDNS_STAT_NOT_QUERY);
+            }
+        }
+        else
+        {
+            count_stat(stats, XDNS_STAT_WRONG_PORT);
         }
     }
+    else
+    {
+        count_stat(stats, XDNS_STAT_NON_UDP);
+    }
 
     return DEFAULT_ACTION;
 }
 
+SEC("xdp")
+int xdp_dns(struct xdp_md *ctx)
+{
+    uint64_t start = latency_start(&xdns_lat_on);
+    uint32_t outcome = LATENCY_PASS;
+    struct xdns_event *event = NULL;
+
+    int action = process_packet(ctx, &outcome, &event);
+    if (action == XDP_TX)
+    {
+        outcome = LATENCY_HIT;
+    }
+    latency_record(&xdns_lat, start, outcome);
+    rxq_count(&xdns_rxq, ctx, action == XDP_TX);
+
+    if (event)
+    {
+        //Batch the events, the consumer is only woken up once enough have piled up
+        uint64_t flags = bpf_ringbuf_query(&xdns_events, BPF_RB_AVAIL_DATA) >= XDNS_EVENTS_WAKEUP_BYTES ?
+                         BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP;
+        event->outcome = outcome;
+        bpf_ringbuf_output(&xdns_events, event, sizeof(*event), flags);
+    }
+
+    return action;
+}
+
+#ifdef WORD_PARSER
+//Parse query and return query length.
+//The name is copied and hashed one 64-bit word at a time. Label length octets are followed as the
+//words come in, so a malformed name is rejected at the first bad length octet.
+static int parse_query(struct xdp_md *ctx, void *query_start, struct dns_query *q)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+
+    #ifdef DEBUG
+    bpf_printk("Parsing query");
+    #endif
+
+    int i, j;
+    //Offset of the next label length octet, relative to query_start
+    int label = 0;
+    uint64_t hash = DNS_NAME_HASH_SEED;
+    uint64_t check = DNS_NAME_CHECK_SEED;
+
+    //Fill dns_query.name with zero bytes
+    //Not doing so will make the verifier complain when dns_query.name is read
+    memset(&q->name[0], 0, sizeof(q->name));
+    //Fill record_type and class with default values to satisfy verifier
+    q->record_type = 0;
+    q->class = 0;
+    q->name_hash = 0;
+    q->name_check = 0;
+    q->name_len = 0;
+    q->pad = 0;
+
+    //Bounded loop over the (at most) MAX_DNS_NAME_LENGTH / 8 words of the name
+    for (i = 0; i < MAX_DNS_NAME_LENGTH; i += sizeof(uint64_t))
+    {
+        void *cursor = query_start + i;
+        uint64_t word = 0;
+
+        if (cursor + sizeof(uint64_t) <= data_end)
+        {
+            word = *(uint64_t *)cursor;
+        }
+        else
+        {
+            //Less than a word left in the packet, collect the remaining octets one by one.
+            //Octets past data_end read as zero and can at most end the name early,
+            //in which case the record type check below fails.
+            for (j = 0; j < sizeof(uint64_t) - 1; j++)
+            {
+                if (cursor + j + 1 > data_end)
+                {
+                    break;
+                }
+                word |= (uint64_t)*(uint8_t *)(cursor + j) << (j * 8);
+            }
+        }
+
+        //Follow the label length octets that fall into this word.
+        //Every label but the root takes at least two octets, so there are at most five.
+        for (j = 0; j < 5; j++)
+        {
+            if (label >= i + sizeof(uint64_t))
+            {
+                break;
+            }
+
+            uint8_t label_len = (word >> ((label - i) * 8)) & 0xff;
+            if (label_len == 0)
+            {
+                //Root label: clear whatever follows it in this word and finish the name
+                int used = label - i + 1;
+                if (used < sizeof(uint64_t))
+                {
+                    word &= ((uint64_t)1 << (used * 8)) - 1;
+                }
+                word = dns_word_tolower(word);
+                *(uint64_t *)&q->name[i] = word;
+                q->name_hash = dns_name_hash_word(hash, word);
+                q->name_check = dns_name_check_word(check, word);
+                q->name_len = label + 1;
+
+                //The name is followed by 2x 2 bytes: the dns type and dns class.
+                cursor = query_start + label;
+                if (cursor + 5 > data_end)
+                {
+                    #ifdef DEBUG
+                    bpf_printk("Error: boundary exceeded while retrieving DNS record type and class");
+                    #endif
+                    return -1;
+                }
+                q->record_type = bpf_htons(*(uint16_t *)(cursor + 1));
+                q->class = bpf_htons(*(uint16_t *)(cursor + 3));
+
+                //Return the bytecount of (name + dns type + dns class) as the query length.
+                return label + 1 + 2 + 2;
+            }
+
+            //Compression pointers and extended label types are not valid in a question
+            if (label_len > 63)
+            {
+                #ifdef DEBUG
+                bpf_printk("Error: invalid label length %u in DNS query name", label_len);
+                #endif
+                return -1;
+            }
+
+            label += label_len + 1;
+        }
+
+        //Names longer than MAX_DNS_NAME_LENGTH octets are invalid
+        if (label >= MAX_DNS_NAME_LENGTH)
+        {
+            return -1;
+        }
+
+        //Names are matched case-insensitively (RFC 4343), fold the word before storing and hashing it
+        word = dns_word_tolower(word);
+        *(uint64_t *)&q->name[i] = word;
+        hash = dns_name_hash_word(hash, word);
+        check = dns_name_check_word(check, word);
+    }
+
+    return -1;
+}
+#else
 //Parse query and return query length
 static int parse_query(struct xdp_md *ctx, void *query_start, struct dns_query *q)
 {
@@ -295,6 +878,10 @@ static int parse_query(struct xdp_md *ctx, void *query_start, struct dns_query *
     uint16_t i;
     void *cursor = query_start;
     int namepos = 0;
+    //Name hash and check, and the word of the name currently being collected for them
+    uint64_t hash = DNS_NAME_HASH_SEED;
+    uint64_t check = DNS_NAME_CHECK_SEED;
+    uint64_t word = 0;
 
     //Fill dns_query.name with zero bytes
     //Not doing so will make the verifier complain when dns_query is used as a key in bpf_map_lookup
@@ -302,6 +889,10 @@ static int parse_query(struct xdp_md *ctx, void *query_start, struct dns_query *
     //Fill record_type and class with default values to satisfy verifier
     q->record_type = 0;
     q->class = 0;
+    q->name_hash = 0;
+    q->name_check = 0;
+    q->name_len = 0;
+    q->pad = 0;
 
     //We create a bounded loop of MAX_DNS_NAME_LENGTH (maximum allowed dns name size).
     //We'll loop through the packet byte by byte until we reach '0' in order to get the dns query name
@@ -336,19 +927,40 @@ static int parse_query(struct xdp_md *ctx, void *query_start, struct dns_query *
                 q->class = bpf_htons(*(uint16_t *)(cursor + 3));
             }
 
+            //Fold in the word holding the terminating zero octet
+            q->name_hash = dns_name_hash_word(hash, word);
+            q->name_check = dns_name_check_word(check, word);
+            q->name_len = namepos + 1;
+
             //Return the bytecount of (namepos + current '0' byte + dns type + dns class) as the query length.
             return namepos + 1 + 2 + 2;
         }
 
-        //Read and fill data into struct
-        q->name[namepos] = *(char *)(cursor);
+        //Read and fill data into struct. Names are matched case-insensitively (RFC 4343),
+        //so letters are stored in lowercase. The packet itself keeps the client's casing.
+        uint8_t c = *(uint8_t *)(cursor);
+        if (c >= 'A' && c <= 'Z')
+        {
+            c += 'a' - 'A';
+        }
+        q->name[namepos] = c;
+
+        //Collect the octet into the current little-endian word and hash every full word
+        word |= (uint64_t)c << ((namepos & 7) * 8);
+        if ((namepos & 7) == 7)
+        {
+            hash = dns_name_hash_word(hash, word);
+            check = dns_name_check_word(check, word);
+            word = 0;
+        }
+
         namepos++;
         cursor++;
     }
 
     return -1;
 }
-
+#endif
 
 #ifdef EDNS
 //Parse additonal record
@@ -361,14 +973,17 @@ static inline int parse_ar(struct xdp_md *ctx, struct dns_hdr *dns_hdr, int quer
     void *data_end = (void *)(long)ctx->data_end;
 
     //Parse ar record
-    ar  = (void *) dns_hdr + query_length + sizeof(struct dns_response);
-    if((void*) ar + sizeof(struct ar_hdr) > data_end){
+    struct ar_hdr *ar_pkt = (void *) dns_hdr + query_length + sizeof(struct dns_hdr);
+    if((void*) ar_pkt + sizeof(struct ar_hdr) > data_end){
         #ifdef DEBUG
         bpf_printk("Error: boundary exceeded while parsing additional record");
         #endif
         return -1;
     }
 
+    //Copy the record out, the packet area is overwritten by our answer
+    __builtin_memcpy(ar, ar_pkt, sizeof(struct ar_hdr));
+
     return 0;
 }
 
@@ -384,7 +999,7 @@ static inline int create_ar_response(struct ar_hdr *ar, char *dns_buffer, size_t
         //Respond that we're serving a payload size of 512 and not serving any additional records.
         ar_response->name = 0;
         ar_response->type = bpf_htons(41);
-        ar_response->size = bpf_htons(512);
+        ar_response->size = bpf_htons(DNS_UDP_SIZE);
         ar_response->ex_rcode = 0;
         ar_response->rcode_len = 0;
 
@@ -399,48 +1014,251 @@ static inline int create_ar_response(struct ar_hdr *ar, char *dns_buffer, size_t
 }
 #endif
 
-//Update IP checksum for IP header, as specified in RFC 1071
-//The checksum_location is passed as a pointer. At this location 16 bits need to be set to 0.
-static inline void update_ip_checksum(void *data, int len, uint16_t *checksum_location)
+//Compute the UDP checksum (RFC 768, RFC 8200 section 8.1).
+//csum is the sum of the source and destination address of the pseudo header.
+//The UDP header and payload run up to data_end, udp->check must be zero.
+static inline uint16_t udp_checksum(uint64_t csum, struct udphdr *udp, void *data_end)
 {
-    uint32_t accumulator = 0;
+    void *cursor = udp;
     int i;
-    for (i = 0; i < len; i += 2)
+
+    //Rest of the pseudo header: UDP length and protocol
+    csum += bpf_htonl((uint32_t)(data_end - (void *)udp));
+    csum += bpf_htonl(IPPROTO_UDP);
+
+    //UDP header and payload, 64 bytes per helper call
+    for (i = 0; i < (sizeof(struct udphdr) + sizeof(struct dns_hdr) + MAX_DNS_NAME_LENGTH + 4 + DNS_SCRATCH_SIZE) / 64; i++)
     {
-        uint16_t val;
-        //If we are currently at the checksum_location, set to zero
-        if (data + i == checksum_location)
+        if (cursor + 64 > data_end)
         {
-            val = 0;
+            break;
         }
-        else
+        csum += (uint32_t)bpf_csum_diff(0, 0, cursor, 64, 0);
+        cursor += 64;
+    }
+
+    //Up to 60 remaining bytes, one 32-bit word at a time
+    for (i = 0; i < 16; i++)
+    {
+        if (cursor + sizeof(uint32_t) > data_end)
         {
-            //Else we load two bytes of data into val
-            val = *(uint16_t *)(data + i);
+            break;
         }
-        accumulator += val;
+        csum += *(uint32_t *)cursor;
+        cursor += sizeof(uint32_t);
     }
 
-    //Add 16 bits overflow back to accumulator (if necessary)
-    uint16_t overflow = accumulator >> 16;
-    accumulator &= 0x00FFFF;
-    accumulator += overflow;
+    //Up to 3 remaining bytes, padded with zeroes
+    uint32_t tail = 0;
+    for (i = 0; i < 3; i++)
+    {
+        if (cursor + i + 1 > data_end)
+        {
+            break;
+        }
+        ((uint8_t *)&tail)[i] = *(uint8_t *)(cursor + i);
+    }
+    csum += tail;
 
-    //If this resulted in an overflow again, do the same (if necessary)
-    accumulator += (accumulator >> 16);
-    accumulator &= 0x00FFFF;
+    //A computed checksum of zero is sent as all ones
+    uint16_t chk = ~csum_fold(csum);
+    return chk ? chk : 0xffff;
+}
 
-    //Invert bits and set the checksum at checksum_location
-    uint16_t chk = accumulator ^ 0xFFFF;
+//Append the addresses of an A RRset to the scratch buffer as answers, one RR per address.
+//owner is the compression pointer used as the name of every answer, ttl the TTL of every answer.
+//The answers start at address (rotation % count) and wrap around. Returns the number of answers.
+static inline int create_a_response(struct a_record *a_record, char *dns_buffer, uint16_t owner, uint32_t rotation, uint32_t ttl, size_t *buf_size)
+{
+    uint32_t count = a_record->count;
+    size_t offset = *buf_size;
+    int i;
 
-    #ifdef DEBUG
-    bpf_printk("Checksum: %u", chk);
-    #endif
+    if (count == 0)
+    {
+        return -1;
+    }
+    if (count > MAX_RRSET_SIZE)
+    {
+        count = MAX_RRSET_SIZE;
+    }
+
+    uint32_t idx = rotation % count;
+    for (i = 0; i < MAX_RRSET_SIZE; i++)
+    {
+        if (i >= count)
+        {
+            break;
+        }
+        //The RRset may follow a CNAME chain, so the space left is checked per answer
+        if (offset > DNS_SCRATCH_SIZE - sizeof(struct dns_response) - sizeof(struct in_addr))
+        {
+            return -1;
+        }
+
+        //Formulate a DNS response: query pointer + type + class in + ttl + ip_addr.
+        //The answer name points back at the question (or the last CNAME target), which keeps the client's casing
+        struct dns_response *response = (struct dns_response *) &dns_buffer[offset];
+        response->query_pointer = bpf_htons(owner);
+        response->class = bpf_htons(DNS_CLASS_IN);
+        response->record_type = bpf_htons(A_RECORD_TYPE);
+        response->ttl = bpf_htonl(ttl);
+        response->data_length = bpf_htons((uint16_t)sizeof(struct in_addr));
+        //Copy IP address
+        __builtin_memcpy(&dns_buffer[offset + sizeof(struct dns_response)], &a_record->ip_addr[idx & (MAX_RRSET_SIZE - 1)], sizeof(struct in_addr));
+        offset += sizeof(struct dns_response) + sizeof(struct in_addr);
+
+        if (++idx >= count)
+        {
+            idx = 0;
+        }
+    }
+
+    *buf_size = offset;
+    return count;
+}
+
+//Append the addresses of an AAAA RRset to the scratch buffer, see create_a_response
+static inline int create_aaaa_response(struct aaaa_record *aaaa_record, char *dns_buffer, uint16_t owner, uint32_t rotation, uint32_t ttl, size_t *buf_size)
+{
+    uint32_t count = aaaa_record->count;
+    size_t offset = *buf_size;
+    int i;
+
+    if (count == 0)
+    {
+        return -1;
+    }
+    if (count > MAX_RRSET_SIZE)
+    {
+        count = MAX_RRSET_SIZE;
+    }
+
+    uint32_t idx = rotation % count;
+    for (i = 0; i < MAX_RRSET_SIZE; i++)
+    {
+        if (i >= count)
+        {
+            break;
+        }
+        if (offset > DNS_SCRATCH_SIZE - sizeof(struct dns_response) - sizeof(struct in6_addr))
+        {
+            return -1;
+        }
+
+        struct dns_response *response = (struct dns_response *) &dns_buffer[offset];
+        response->query_pointer = bpf_htons(owner);
+        response->class = bpf_htons(DNS_CLASS_IN);
+        response->record_type = bpf_htons(AAAA_RECORD_TYPE);
+        response->ttl = bpf_htonl(ttl);
+        response->data_length = bpf_htons((uint16_t)sizeof(struct in6_addr));
+        //Copy IP address
+        __builtin_memcpy(&dns_buffer[offset + sizeof(struct dns_response)], &aaaa_record->ip_addr[idx & (MAX_RRSET_SIZE - 1)], sizeof(struct in6_addr));
+        offset += sizeof(struct dns_response) + sizeof(struct in6_addr);
+
+        if (++idx >= count)
+        {
+            idx = 0;
+        }
+    }
+
+    *buf_size = offset;
+    return count;
+}
+
+//Append the pre-serialized answers of a generic record to the scratch buffer.
+//The data is copied one 64-bit word at a time; bytes past data_length are never sent.
+//The owner name of the first RR is set to owner, which only differs from 0xc00c for a CNAME in a chain.
+static inline int create_rr_response(struct rr_record *rr_record, char *dns_buffer, uint16_t owner, size_t *buf_size)
+{
+    size_t offset = *buf_size;
+    uint32_t len = rr_record->data_length;
+    int i;
+
+    //The last word copied may extend up to 7 bytes past len
+    if (rr_record->ans_count == 0 || len < sizeof(struct dns_response) || len > MAX_RR_DATA_LENGTH ||
+        offset + len > DNS_SCRATCH_SIZE - sizeof(uint64_t))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < MAX_RR_DATA_LENGTH; i += sizeof(uint64_t))
+    {
+        if (i >= len)
+        {
+            break;
+        }
+        if (offset + i > DNS_SCRATCH_SIZE - sizeof(uint64_t))
+        {
+            return -1;
+        }
+        *(uint64_t *)&dns_buffer[offset + i] = *(uint64_t *)&rr_record->data[i];
+    }
+
+    if (offset > DNS_SCRATCH_SIZE - sizeof(uint16_t))
+    {
+        return -1;
+    }
+    *(uint16_t *)&dns_buffer[offset] = bpf_htons(owner);
+
+    *buf_size = offset + len;
+    return rr_record->ans_count;
+}
+
+//Records with an expiry are answered until then. now is read from the clock on first use.
+static inline int record_expired(uint64_t expires, uint64_t *now)
+{
+    if (!expires)
+    {
+        return 0;
+    }
+    if (!*now)
+    {
+        *now = bpf_ktime_get_boot_ns();
+    }
+    return *now >= expires;
+}
 
-    *checksum_location = chk;
+//The TTL of an answer counts down to the expiry of its record, so caches downstream
+//never hold it longer than we do
+static inline uint32_t record_ttl(uint32_t ttl, uint64_t expires, uint64_t now)
+{
+    if (expires && expires > now)
+    {
+        uint64_t left = (expires - now) / 1000000000ULL;
+        if (left < ttl)
+        {
+            ttl = left;
+        }
+    }
+    return ttl;
 }
 
-static inline void modify_dns_header_response(struct dns_hdr *dns_hdr)
+//Lower the TTL of the count pre-serialized RRs at offset in the scratch buffer to at most ttl
+static inline void cap_rr_ttl(char *dns_buffer, size_t offset, int count, uint32_t ttl)
+{
+    int i;
+
+    for (i = 0; i < MAX_RR_DATA_LENGTH / sizeof(struct dns_response); i++)
+    {
+        if (i >= count)
+        {
+            break;
+        }
+        if (offset > DNS_SCRATCH_SIZE - sizeof(struct dns_response))
+        {
+            return;
+        }
+        struct dns_response *rr = (struct dns_response *)&dns_buffer[offset];
+        if (bpf_ntohl(rr->ttl) > ttl)
+        {
+            rr->ttl = bpf_htonl(ttl);
+        }
+        offset += sizeof(struct dns_response) + bpf_ntohs(rr->data_length);
+    }
+}
+
+static inline void modify_dns_header_response(struct dns_hdr *dns_hdr, uint16_t ans_count)
 {
     //Set query response
     dns_hdr->qr = 1;
@@ -450,8 +1268,49 @@ static inline void modify_dns_header_response(struct dns_hdr *dns_hdr)
     //dns_hdr->aa = 0;
     //Recursion available
     dns_hdr->ra = 1;
-    //One answer
-    dns_hdr->ans_count = bpf_htons(1);
+    //One answer per record in the RRset
+    dns_hdr->ans_count = bpf_htons(ans_count);
+}
+
+//Copy len bytes of the scratch buffer to the packet, one 64-bit word at a time.
+//The remaining (len % 8) bytes are copied individually.
+static inline int copy_to_packet(char *dst, void *data_end, char *src, size_t len)
+{
+    size_t i;
+    for (i = 0; i + sizeof(uint64_t) <= len && i < DNS_SCRATCH_SIZE; i += sizeof(uint64_t))
+    {
+        if ((void *)(dst + i + sizeof(uint64_t)) > data_end)
+        {
+            return -1;
+        }
+        *(uint64_t *)(dst + i) = *(uint64_t *)(src + i);
+    }
+
+    for (; i < len && i < DNS_SCRATCH_SIZE; i++)
+    {
+        if ((void *)(dst + i + 1) > data_end)
+        {
+            return -1;
+        }
+        dst[i] = src[i];
+    }
+
+    return 0;
+}
+
+//Lowercase the ASCII letters in a word of the query name, eight octets at once.
+//Label length octets are at most 63 and are never changed.
+static inline uint64_t dns_word_tolower(uint64_t word)
+{
+    uint64_t heptets = word & 0x7f7f7f7f7f7f7f7fULL;
+    //High bit of every octet above 'Z'
+    uint64_t above_z = heptets + 0x2525252525252525ULL;
+    //High bit of every octet from 'A' upwards
+    uint64_t from_a = heptets + 0x3f3f3f3f3f3f3f3fULL;
+    //High bit of every ASCII octet in 'A'..'Z'
+    uint64_t upper = (from_a ^ above_z) & ~word & 0x8080808080808080ULL;
+
+    return word | (upper >> 2);
 }
 
 static inline void swap_mac(uint8_t *src_mac, uint8_t *dst_mac)
@@ -466,5 +1325,85 @@ static inline void swap_mac(uint8_t *src_mac, uint8_t *dst_mac)
     }
 }
 
+//Decide whether to sample the current query, one in xdns_config.sample_rate.
+//A per-CPU countdown keeps this to one array lookup and a compare while sampling is off.
+static inline int sample_query(struct dns_scratch *scratch)
+{
+    uint32_t key = 0;
+    struct xdns_config *config = bpf_map_lookup_elem(&xdns_config, &key);
+
+    if (!config || config->sample_rate == 0)
+    {
+        return 0;
+    }
+
+    if (scratch->sample_countdown > 0)
+    {
+        scratch->sample_countdown--;
+        return 0;
+    }
+
+    scratch->sample_countdown = config->sample_rate - 1;
+    return 1;
+}
+
+//Per-CPU counters, no atomic operations are needed
+static inline void count_stat(struct xdns_stats *stats, uint32_t stat)
+{
+    if (stats && stat < XDNS_STAT_MAX)
+    {
+        stats->counters[stat]++;
+    }
+}
+
+//Compare the question with the name stored for its hash in xdns_names, word by word.
+//Both are lowercase and zero padded, the word holding the terminating zero octet is the last one.
+static __always_inline int name_matches(const struct dns_query *q)
+{
+    struct dns_key name_key = {
+        .name_hash = q->name_hash,
+        .record_type = 0,
+        .class = 0,
+        .pad = 0,
+    };
+    struct dns_name *stored = bpf_map_lookup_elem(&xdns_names, &name_key);
+    int i;
+
+    if (!stored || stored->name_check != q->name_check)
+    {
+        return 0;
+    }
+    for (i = 0; i < MAX_DNS_NAME_LENGTH; i += sizeof(uint64_t))
+    {
+        if (i >= q->name_len)
+        {
+            break;
+        }
+        if (*(uint64_t *)&stored->name[i] != *(uint64_t *)&q->name[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline void count_hit(struct xdns_stats *stats, uint16_t record_type)
+{
+    uint32_t idx = xdns_qtype_index(record_type);
+    if (stats && idx < XDNS_QTYPE_MAX)
+    {
+        stats->hit[idx]++;
+    }
+}
+
+static inline void count_miss(struct xdns_stats *stats, uint16_t record_type)
+{
+    uint32_t idx = xdns_qtype_index(record_type);
+    if (stats && idx < XDNS_QTYPE_MAX)
+    {
+        stats->miss[idx]++;
+    }
+}
+
 char _license[] SEC("license") = "GPL";
 __u32 _version SEC("version") = LINUX_VERSION_CODE;
@@ -0,0 +1,212 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Stub upstream resolver for xdp_dns_fill, used by the warm-up harness (see xdp_dns_warmup).
+ * Every A query is answered with one address in 198.18.0.0/15 and every AAAA query with one
+ * in 2001:db8::/64, both derived from the name, so repeated queries get the same answer.
+ * Other types get an empty NOERROR answer. Nothing is looked up, the answers only exercise
+ * the fill path.
+ *
+ *   ./xdp_dns_stub -p 5353 -t 300
+ *   sudo ./xdp_dns_fill -u 127.0.0.1#5353 -p 5300
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+
+#define STUB_DEFAULT_PORT 5353
+#define STUB_DEFAULT_TTL 300
+#define STUB_BUF_SIZE 512
+#define DNS_HDR_SIZE 12
+#define DNS_RCODE_FORMERR 1
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig)
+{
+	quit = 1;
+}
+
+//FNV-1a of the wire-format name, case-insensitive like the names xdp_dns_fill caches
+static uint64_t stub_name_hash(const uint8_t *name, int len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (int i = 0; i < len; i++) {
+		uint8_t c = name[i];
+
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		hash = (hash ^ c) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	put_u16(p, v >> 16);
+	put_u16(p + 2, v & 0xffff);
+}
+
+//Turn the query in msg into its answer in place. Returns the length of the answer, or -1
+//for a datagram that is not answered at all.
+static int stub_answer(uint8_t *msg, int len, uint32_t ttl)
+{
+	struct dns_hdr *hdr = (struct dns_hdr *)msg;
+	int pos = DNS_HDR_SIZE, rdlen = 0;
+	uint16_t type;
+	uint64_t hash;
+
+	if (len < DNS_HDR_SIZE || hdr->qr)
+		return -1;
+
+	hdr->qr = 1;
+	hdr->aa = 0;
+	hdr->tc = 0;
+	hdr->ra = 1;
+	hdr->ans_count = 0;
+	hdr->auth_count = 0;
+	hdr->add_count = 0;
+
+	//Uncompressed question name, as resolvers send it
+	while (pos < len && msg[pos] != 0 && msg[pos] < 64)
+		pos += msg[pos] + 1;
+	if (hdr->opcode != 0 || ntohs(hdr->q_count) != 1 || pos + 5 > len || msg[pos] != 0) {
+		hdr->q_count = 0;
+		hdr->rcode = DNS_RCODE_FORMERR;
+		return DNS_HDR_SIZE;
+	}
+	hash = stub_name_hash(msg + DNS_HDR_SIZE, pos + 1 - DNS_HDR_SIZE);
+	type = msg[pos + 1] << 8 | msg[pos + 2];
+	hdr->rcode = 0;
+	//Anything after the question (an OPT record) is dropped
+	pos += 5;
+
+	if (type == A_RECORD_TYPE)
+		rdlen = sizeof(struct in_addr);
+	else if (type == AAAA_RECORD_TYPE)
+		rdlen = sizeof(struct in6_addr);
+	if (!rdlen)
+		return pos;
+
+	uint8_t *rr = msg + pos;
+	put_u16(rr, 0xc000 | DNS_HDR_SIZE);
+	put_u16(rr + 2, type);
+	put_u16(rr + 4, DNS_CLASS_IN);
+	put_u32(rr + 6, ttl);
+	put_u16(rr + 10, rdlen);
+	if (type == A_RECORD_TYPE) {
+		put_u32(rr + 12, 0xc6120000 | (hash & 0x1ffff));
+	} else {
+		put_u32(rr + 12, 0x20010db8);
+		put_u32(rr + 16, 0);
+		put_u32(rr + 20, hash >> 32);
+		put_u32(rr + 24, hash & 0xffffffff);
+	}
+	hdr->ans_count = htons(1);
+	return pos + 12 + rdlen;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-t ttl]\n", progname);
+	fprintf(stderr, "  -p  port to answer on (default %d)\n", STUB_DEFAULT_PORT);
+	fprintf(stderr, "  -t  TTL of the answers (default %d)\n", STUB_DEFAULT_TTL);
+}
+
+int main(int argc, char *argv[])
+{
+	//Room for the question and the largest answer added to it
+	static uint8_t buf[STUB_BUF_SIZE + 64];
+	struct sockaddr_in6 addr;
+	struct sigaction sa;
+	uint32_t ttl = STUB_DEFAULT_TTL;
+	unsigned long long answered = 0;
+	int port = STUB_DEFAULT_PORT;
+	int opt, fd, off = 0;
+
+	while ((opt = getopt(argc, argv, "p:t:")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 't':
+				ttl = strtoul(optarg, NULL, 10);
+				break;
+			case '?':
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc || port <= 0 || port > 65535) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0 ||
+		bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Error: Failed to listen on port %d: %s\n", port, strerror(errno));
+		return 1;
+	}
+
+	//Without SA_RESTART, so a signal ends the blocking receive
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!quit) {
+		socklen_t addr_len = sizeof(addr);
+		int len = recvfrom(fd, buf, STUB_BUF_SIZE, 0, (struct sockaddr *)&addr, &addr_len);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: recvfrom failed: %s\n", strerror(errno));
+			break;
+		}
+		len = stub_answer(buf, len, ttl);
+		if (len > 0 && sendto(fd, buf, len, 0, (struct sockaddr *)&addr, addr_len) == len)
+			answered++;
+	}
+
+	printf("%llu queries answered\n", answered);
+	close(fd);
+	return 0;
+}
@@ -16,81 +16,1236 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place - Suite 330
 */
 #include <stdlib.h>
+#include <inttypes.h>
 #include <bpf/libbpf.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <bpf/bpf.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
 #include "common.h"
+#include "dns_util.h"
+#include "dns_batch.h"
+#include "dns_zone.h"
+#include "dns_snapshot.h"
+#include "dns_sync.h"
 
-int get_map_fd(const char *map_path);
-void replace_dots_with_length_octets(char *dns_name, char *new_dns_name);
-void replace_length_octets_with_dots(char *dns_name, char *new_dns_name);
-
-static const char *a_records_map_path = "/sys/fs/bpf/xdns_a_records";
-static const char *aaaa_records_map_path = "/sys/fs/bpf/xdns_aaaa_records";
+#define SERVE_DEFAULT_SOCKET "/run/xdp_dns.sock"
 
 void usage(char *progname)
 {
-    fprintf(stderr, "Usage: %s add record_type domain_name value [ttl]\n", progname);
+    fprintf(stderr, "Usage: %s add record_type domain_name value [ttl [@unix_time|+seconds]]\n", progname);
     fprintf(stderr, "       %s remove record_type domain_name value\n", progname);
-    fprintf(stderr, "       %s list\n", progname);
+    fprintf(stderr, "       %s list [-t record_type] [-s name_suffix] [-j]\n", progname);
+    fprintf(stderr, "       %s load file\n", progname);
+    fprintf(stderr, "       %s swap file\n", progname);
+    fprintf(stderr, "       %s rollback\n", progname);
+    fprintf(stderr, "       %s snapshot file\n", progname);
+    fprintf(stderr, "       %s restore file\n", progname);
+    fprintf(stderr, "       %s sync file\n", progname);
+    fprintf(stderr, "       %s serve [socket_path]\n", progname);
+    fprintf(stderr, "       %s sweep [-i seconds]\n", progname);
     fprintf(stderr, "\nExamples:\n");
     fprintf(stderr, "   %s add a foo.bar 1.2.3.4 120\n", progname);
     fprintf(stderr, "   %s add aaaa foo.bar 1:2:3::4 120\n", progname);
+    fprintf(stderr, "   %s add cname www.foo.bar foo.bar 120\n", progname);
+    fprintf(stderr, "   %s add mx foo.bar \"10 mail.foo.bar\" 120\n", progname);
+    fprintf(stderr, "   %s add srv _sip._udp.foo.bar \"10 5 5060 sip.foo.bar\" 120\n", progname);
+    fprintf(stderr, "   %s add txt foo.bar \"v=spf1 -all\" 120\n", progname);
+    fprintf(stderr, "   %s add a tmp.foo.bar 1.2.3.4 60 +3600\n", progname);
+    fprintf(stderr, "\nSupported record types: A, AAAA, CNAME, MX, NS, PTR, SRV, TXT\n");
+    fprintf(stderr, "\nAdding another address to a name extends its RRset (up to %d addresses),\n", MAX_RRSET_SIZE);
+    fprintf(stderr, "the TTL and expiry of the last add apply to the whole RRset. From its expiry, given as\n");
+    fprintf(stderr, "a Unix time or in seconds from now, an RRset is not answered and until then answers\n");
+    fprintf(stderr, "carry at most the seconds left as TTL. sweep deletes expired RRsets, every interval with -i.\n");
+    fprintf(stderr, "\nload reads records from a file (- for stdin), one per line, either as\n");
+    fprintf(stderr, "'name,value' like dns/db.csv or as 'type name value [ttl [expiry]]' like the output of list.\n");
+    fprintf(stderr, "The RRsets of every name in the file are replaced, other names are left alone.\n");
+    fprintf(stderr, "\nswap builds a new zone from a file in the same format and publishes it at once,\n");
+    fprintf(stderr, "the zone is left as it is if the file has errors. rollback publishes the previous zone.\n");
+    fprintf(stderr, "\nsnapshot writes the active zone to a binary file, restore publishes a zone built from one\n");
+    fprintf(stderr, "the way swap does.\n");
+    fprintf(stderr, "\nsync makes the active zone hold exactly the records of a file in the format of load\n");
+    fprintf(stderr, "and keeps it that way, writing only the RRsets that change whenever the file is saved.\n");
+    fprintf(stderr, "\nserve applies add, remove, get and batch ... end requests sent as lines to a Unix socket\n");
+    fprintf(stderr, "(default %s), changes that arrive together are written with one batched update.\n", SERVE_DEFAULT_SOCKET);
+    fprintf(stderr, "\nlist prints the records of one type (-t) and of names ending in a suffix (-s),\n");
+    fprintf(stderr, "as 'type name value ttl [@expiry]' lines or with -j as one JSON object per line.\n");
 }
 
-int main(int argc, char **argv)
+struct list_filter {
+    uint16_t type;      //0 lists every type
+    const char *suffix; //Dotted name suffix, NULL lists every name
+    size_t suffix_len;
+    int json;
+    unsigned long records;
+    unsigned long unnamed;  //RRsets whose name is not in xdns_names
+    struct dns_table *names;
+    const char *dns_name;   //Wire-format name of every RRset listed, instead of names
+    FILE *out;
+};
+
+static int list_names_add(const struct dns_key *key, const void *value, void *ctx)
 {
-    //Return code
-    int ret = EINVAL;
+    return dns_table_put(ctx, key, value);
+}
 
-    //Initialize file descriptor for a_records map
-    int a_records_fd, aaaa_records_fd;
-    a_records_fd = get_map_fd(a_records_map_path);
-    aaaa_records_fd = get_map_fd(aaaa_records_map_path);
-    if (a_records_fd < 0 || aaaa_records_fd < 0)
-        return EXIT_FAILURE;
+//Read xdns_names into memory, so every RRset finds its name without a syscall.
+//Returns NULL if the map is not pinned or cannot be read.
+static struct dns_table *list_names_read(void)
+{
+    struct dns_table *names;
+    int fd = dns_names_open();
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    names = dns_table_new(sizeof(struct dns_name));
+    if (names && dns_map_dump(fd, sizeof(struct dns_name), list_names_add, names) < 0)
+    {
+        dns_table_free(names);
+        names = NULL;
+    }
+    close(fd);
+    return names;
+}
+
+//Dotted name of the RRset of key. Names missing from xdns_names are printed as # and the hash.
+static void list_name(struct list_filter *f, const struct dns_key *key, uint64_t name_check, char *name,
+                      size_t size)
+{
+    struct dns_key name_key;
+    const struct dns_name *n = NULL;
+
+    if (f->dns_name)
+    {
+        replace_length_octets_with_dots((char *)f->dns_name, name, size);
+        return;
+    }
+    memset(&name_key, 0, sizeof(name_key));
+    name_key.name_hash = key->name_hash;
+    if (f->names)
+    {
+        n = (const struct dns_name *)dns_table_lookup(f->names, &name_key, NULL);
+    }
+    if (n && n->name_check == name_check)
+    {
+        replace_length_octets_with_dots((char *)n->name, name, size);
+    }
+    else
+    {
+        f->unnamed++;
+        snprintf(name, size, "#%016llx", (unsigned long long)key->name_hash);
+    }
+}
+
+//Match whole labels only, foo.bar ends in bar and foo.bar but not in o.bar
+static int list_name_match(const struct list_filter *f, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (!f->suffix)
+    {
+        return 1;
+    }
+    if (len < f->suffix_len || strcasecmp(name + len - f->suffix_len, f->suffix) != 0)
+    {
+        return 0;
+    }
+    return len == f->suffix_len || name[len - f->suffix_len - 1] == '.';
+}
+
+static void json_print_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+//expires is printed as the Unix time of the expiry, records without one are printed as before
+static void list_print(struct list_filter *f, const char *type, const char *name, const char *value, uint32_t ttl,
+                       uint64_t expires)
+{
+    unsigned long long unix_expiry = dns_expiry_to_unix(expires);
 
-    if (argc == 2)
+    f->records++;
+    if (!f->json)
     {
-        if (strcmp(argv[1], "list") == 0)
+        if (expires)
+            fprintf(f->out, "%s %s %s %u @%llu\n", type, name, value, ttl, unix_expiry);
+        else
+            fprintf(f->out, "%s %s %s %u\n", type, name, value, ttl);
+        return;
+    }
+    fprintf(f->out, "{\"type\":\"%s\",\"name\":", type);
+    json_print_string(f->out, name);
+    fprintf(f->out, ",\"value\":");
+    json_print_string(f->out, value);
+    if (expires)
+        fprintf(f->out, ",\"ttl\":%u,\"expires\":%llu}\n", ttl, unix_expiry);
+    else
+        fprintf(f->out, ",\"ttl\":%u}\n", ttl);
+}
+
+static int list_a(const struct dns_key *key, const void *value, void *ctx)
+{
+    const struct a_record *a = value;
+    char name[DNS_NAME_TEXT_LENGTH];
+
+    list_name(ctx, key, a->name_check, name, sizeof(name));
+    if (list_name_match(ctx, name))
+    {
+        for (int i = 0; i < a->count && i < MAX_RRSET_SIZE; i++)
+            list_print(ctx, "A", name, inet_ntoa(a->ip_addr[i]), a->ttl, a->expires);
+    }
+    return 0;
+}
+
+static int list_aaaa(const struct dns_key *key, const void *value, void *ctx)
+{
+    const struct aaaa_record *a = value;
+    char name[DNS_NAME_TEXT_LENGTH];
+    char ip_buf[INET6_ADDRSTRLEN];
+
+    list_name(ctx, key, a->name_check, name, sizeof(name));
+    if (list_name_match(ctx, name))
+    {
+        for (int i = 0; i < a->count && i < MAX_RRSET_SIZE; i++)
         {
-            struct dns_query key, next_key;
-            struct a_record value;
-            struct aaaa_record value6;
-            int res = -1;
-            while (bpf_map_get_next_key(a_records_fd, &key, &next_key) == 0)
+            inet_ntop(AF_INET6, &a->ip_addr[i], ip_buf, sizeof(ip_buf));
+            list_print(ctx, "AAAA", name, ip_buf, a->ttl, a->expires);
+        }
+    }
+    return 0;
+}
+
+static int list_rr(const struct dns_key *key, const void *value, void *ctx)
+{
+    const struct rr_record *r = value;
+    struct list_filter *f = ctx;
+    char name[DNS_NAME_TEXT_LENGTH];
+    char rdata_buf[MAX_RR_DATA_LENGTH * 4];
+    int offset = 0;
+
+    if (f->type && key->record_type != f->type)
+    {
+        return 0;
+    }
+    list_name(f, key, r->name_check, name, sizeof(name));
+    if (!list_name_match(f, name))
+    {
+        return 0;
+    }
+
+    //Walk the pre-serialized RRs
+    for (int i = 0; i < r->ans_count && offset + sizeof(struct dns_response) <= r->data_length; i++)
+    {
+        const struct dns_response *rr = (const struct dns_response *)&r->data[offset];
+        int rdata_len = ntohs(rr->data_length);
+        rr_rdata_to_text(ntohs(rr->record_type), &r->data[offset + sizeof(struct dns_response)],
+                         rdata_len, rdata_buf, sizeof(rdata_buf));
+        list_print(f, rr_type_to_name(ntohs(rr->record_type)), name, rdata_buf, ntohl(rr->ttl), r->expires);
+        offset += sizeof(struct dns_response) + rdata_len;
+    }
+    return 0;
+}
+
+//Dump the maps with batched lookups, argv starts at "list"
+static int list_records(int argc, char **argv, int a_records_fd, int aaaa_records_fd, int rr_records_fd)
+{
+    struct list_filter filter;
+    int opt, err = 0;
+
+    memset(&filter, 0, sizeof(filter));
+    filter.out = stdout;
+    optind = 1;
+    while ((opt = getopt(argc, argv, "t:s:j")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            if (strcasecmp(optarg, "A") == 0)
+                filter.type = A_RECORD_TYPE;
+            else if (strcasecmp(optarg, "AAAA") == 0)
+                filter.type = AAAA_RECORD_TYPE;
+            else if ((filter.type = rr_type_from_name(optarg)) == 0)
             {
-                res = bpf_map_lookup_elem(a_records_fd, &next_key, &value);
-                if (res > -1)
-                {
-                    char new_dns_name[strnlen(next_key.name, MAX_DNS_NAME_LENGTH)];
-                    replace_length_octets_with_dots(next_key.name, new_dns_name);
-                    printf("A %s %s %i\n", new_dns_name, inet_ntoa(value.ip_addr), value.ttl);
-                }
-                key = next_key;
+                printf("ERROR: %s is not a DNS record type.\n", optarg);
+                return EINVAL;
             }
-            memset(&key, 0, sizeof(key));
-            res = -1;
-            while (bpf_map_get_next_key(aaaa_records_fd, &key, &next_key) == 0)
+            break;
+        case 's':
+            filter.suffix = optarg;
+            filter.suffix_len = strlen(optarg);
+            //Accept fully qualified suffixes, stored names have no trailing dot
+            if (filter.suffix_len > 0 && optarg[filter.suffix_len - 1] == '.')
+                optarg[--filter.suffix_len] = 0;
+            if (filter.suffix_len == 0)
+                filter.suffix = NULL;
+            break;
+        case 'j':
+            filter.json = 1;
+            break;
+        default:
+            return EINVAL;
+        }
+    }
+    if (optind != argc)
+    {
+        return EINVAL;
+    }
+
+    filter.names = list_names_read();
+    if (!filter.type || filter.type == A_RECORD_TYPE)
+        err = dns_map_dump(a_records_fd, sizeof(struct a_record), list_a, &filter);
+    if (err >= 0 && (!filter.type || filter.type == AAAA_RECORD_TYPE))
+        err = dns_map_dump(aaaa_records_fd, sizeof(struct aaaa_record), list_aaaa, &filter);
+    if (err >= 0 && filter.type != A_RECORD_TYPE && filter.type != AAAA_RECORD_TYPE)
+        err = dns_map_dump(rr_records_fd, sizeof(struct rr_record), list_rr, &filter);
+    dns_table_free(filter.names);
+
+    if (filter.unnamed)
+        fprintf(stderr, "WARNING: %lu RRsets have no name in xdns_names and are listed by their hash\n",
+                filter.unnamed);
+    if (err < 0)
+    {
+        printf("ERROR: Failed to read the record maps: %s\n", strerror(-err));
+        return EIO;
+    }
+    return 0;
+}
+
+static const char *load_error(int err)
+{
+    switch (err)
+    {
+    case -EINVAL:
+        return "Invalid record";
+    case -ENOSPC:
+        return "RRset is full";
+    case -EEXIST:
+        return "Name hash collides with another record";
+    case -ENOENT:
+        return "Record not found";
+    default:
+        return strerror(-err);
+    }
+}
+
+//Stage every line of a record file, errors in single lines are counted and reported.
+//Returns 0 or the error that stopped the file from being staged completely.
+static int load_lines(FILE *fp, const char *filename, struct dns_batch *batch, unsigned long *errors)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned long line_number = 0;
+    int err = 0;
+
+    while (getline(&line, &line_size, fp) > 0)
+    {
+        line_number++;
+        err = dns_batch_add_line(batch, line);
+        if (err == -EIO || err == -ENOMEM)
+        {
+            break;
+        }
+        if (err < 0)
+        {
+            printf("ERROR: %s:%lu: %s\n", filename, line_number, load_error(err));
+            (*errors)++;
+        }
+        err = 0;
+    }
+    if (err == 0)
+    {
+        err = dns_batch_flush(batch);
+    }
+
+    free(line);
+    return err;
+}
+
+//Stream a record file into the maps with batched updates
+static int load_records(const char *filename, int a_records_fd, int aaaa_records_fd, int rr_records_fd)
+{
+    struct dns_batch *batch;
+    struct timespec start, end;
+    FILE *fp;
+    unsigned long errors = 0;
+    int err;
+
+    fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (fp == NULL)
+    {
+        printf("ERROR: Could not open %s: %s\n", filename, strerror(errno));
+        return ENOENT;
+    }
+
+    batch = dns_batch_new(a_records_fd, aaaa_records_fd, rr_records_fd);
+    if (batch == NULL)
+    {
+        printf("ERROR: Failed to allocate memory\n");
+        fclose(fp);
+        return ENOMEM;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = load_lines(fp, filename, batch, &errors);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Loaded %" PRIu64 " records in %.3f s (%.0f records/s, %" PRIu64 " RRsets written in %" PRIu64
+           " update calls), %lu errors\n",
+           batch->records, elapsed, elapsed > 0 ? batch->records / elapsed : 0.0,
+           batch->rrsets, batch->batches, errors);
+
+    dns_batch_free(batch);
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+    return err ? EIO : errors ? EINVAL : 0;
+}
+
+//Build a zone from a record file in the inactive slot and publish it with a single map update
+static int swap_zone(const char *filename)
+{
+    struct zone_swap swap;
+    int ret = ENOENT;
+
+    if (zone_swap_begin(&swap) == 0)
+    {
+        ret = load_records(filename, swap.fds[ZONE_A], swap.fds[ZONE_AAAA], swap.fds[ZONE_RR]);
+        if (ret != 0)
+        {
+            printf("ERROR: Zone not swapped, slot %d is still answering\n", swap.slot);
+        }
+        else if (zone_swap_commit(&swap) != 0)
+        {
+            ret = EIO;
+        }
+    }
+    zone_swap_end(&swap);
+    return ret;
+}
+
+//Publish the zone of the other slot again
+static int rollback_zone(void)
+{
+    int outer_fds[ZONE_MAPS], fds[ZONE_MAPS];
+    int slot, next;
+
+    slot = zone_active_slot();
+    if (slot < 0 || zone_outer_open(outer_fds) < 0)
+    {
+        return ENOENT;
+    }
+    next = (slot + 1) % XDNS_ZONE_SLOTS;
+    if (zone_open(outer_fds, next, fds) < 0)
+    {
+        printf("ERROR: Slot %d holds no previous zone\n", next);
+        zone_close(outer_fds);
+        return ENOENT;
+    }
+    zone_close(fds);
+    zone_close(outer_fds);
+
+    if (zone_activate(next) != 0)
+    {
+        printf("ERROR: Failed to activate slot %d: %s\n", next, strerror(errno));
+        return EIO;
+    }
+    printf("Zone rolled back from slot %d to slot %d\n", slot, next);
+    return 0;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//Write the active zone to a snapshot file
+static int snapshot_zone(const char *filename)
+{
+    struct dns_snapshot_header header;
+    struct timespec start;
+    int fds[DNS_SNAPSHOT_MAPS];
+    int err;
+
+    if (zone_open_active(fds) < 0)
+    {
+        return ENOENT;
+    }
+    //Without xdns_names the records are kept, list shows them without their names
+    fds[DNS_SNAPSHOT_NAMES] = dns_names_open();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = dns_snapshot_write(filename, fds, &header);
+    zone_close(fds);
+    if (fds[DNS_SNAPSHOT_NAMES] >= 0)
+    {
+        close(fds[DNS_SNAPSHOT_NAMES]);
+    }
+    if (err)
+    {
+        printf("ERROR: Could not write snapshot %s: %s\n", filename, strerror(-err));
+        return EIO;
+    }
+
+    printf("Wrote %llu A, %llu AAAA and %llu other RRsets (%llu bytes) to %s in %.3f s\n",
+           (unsigned long long)header.count[ZONE_A], (unsigned long long)header.count[ZONE_AAAA],
+           (unsigned long long)header.count[ZONE_RR], (unsigned long long)(header.header_size + header.body_size),
+           filename, seconds_since(&start));
+    return 0;
+}
+
+//Build a new zone from a snapshot file and publish it like swap
+static int restore_zone(const char *filename)
+{
+    struct dns_snapshot_header header;
+    struct zone_swap swap;
+    struct timespec start;
+    int fds[DNS_SNAPSHOT_MAPS];
+    uint64_t calls = 0;
+    int ret = ENOENT;
+
+    if (zone_swap_begin(&swap) == 0)
+    {
+        memcpy(fds, swap.fds, sizeof(swap.fds));
+        fds[DNS_SNAPSHOT_NAMES] = dns_names_open();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (dns_snapshot_restore(filename, fds, &header, &calls) != 0)
+        {
+            printf("ERROR: Zone not restored, slot %d is still answering\n", swap.slot);
+            ret = EIO;
+        }
+        else
+        {
+            double seconds = seconds_since(&start);
+            uint64_t total = header.count[ZONE_A] + header.count[ZONE_AAAA] + header.count[ZONE_RR];
+
+            printf("Restored %llu RRsets from %s in %.3f s (%.0f RRsets/s, %llu update calls)\n",
+                   (unsigned long long)total, filename, seconds, seconds > 0 ? total / seconds : 0.0,
+                   (unsigned long long)calls);
+            ret = zone_swap_commit(&swap) == 0 ? 0 : EIO;
+        }
+        if (fds[DNS_SNAPSHOT_NAMES] >= 0)
+        {
+            close(fds[DNS_SNAPSHOT_NAMES]);
+        }
+    }
+    zone_swap_end(&swap);
+    return ret;
+}
+
+//Delete the expired RRsets of the active zone. Queries already miss on them, the sweep
+//reclaims their entries. With an interval the zone is swept until a signal arrives,
+//following swap and rollback.
+static int sweep_zone(int argc, char **argv)
+{
+    static const size_t value_sizes[ZONE_MAPS] = {
+        [ZONE_A] = sizeof(struct a_record),
+        [ZONE_AAAA] = sizeof(struct aaaa_record),
+        [ZONE_RR] = sizeof(struct rr_record),
+    };
+    static const size_t expires_offsets[ZONE_MAPS] = {
+        [ZONE_A] = offsetof(struct a_record, expires),
+        [ZONE_AAAA] = offsetof(struct aaaa_record, expires),
+        [ZONE_RR] = offsetof(struct rr_record, expires),
+    };
+    struct timespec timeout = {0}, start;
+    sigset_t signal_mask;
+    int interval = 0;
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if (opt != 'i' || (interval = atoi(optarg)) <= 0)
+        {
+            return EINVAL;
+        }
+    }
+    if (optind != argc)
+    {
+        return EINVAL;
+    }
+
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+    timeout.tv_sec = interval;
+
+    do
+    {
+        uint64_t deleted[ZONE_MAPS] = {0};
+        uint64_t calls = 0;
+        uint64_t now;
+        int64_t pruned;
+        int fds[ZONE_MAPS];
+        int err = 0;
+
+        if (zone_open_active(fds) < 0)
+        {
+            return ENOENT;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        now = dns_now_boot_ns();
+        for (int i = 0; i < ZONE_MAPS && err >= 0; i++)
+        {
+            err = dns_map_sweep(fds[i], value_sizes[i], expires_offsets[i], now, &calls);
+            deleted[i] = err > 0 ? err : 0;
+        }
+        zone_close(fds);
+        if (err < 0)
+        {
+            printf("ERROR: Failed to sweep the record maps: %s\n", strerror(-err));
+            return EIO;
+        }
+        //The names of the swept RRsets, and of the snooped answers evicted meanwhile
+        pruned = zone_names_prune(&calls);
+        if (pruned < 0)
+        {
+            return EIO;
+        }
+        printf("Swept %llu A, %llu AAAA and %llu other expired RRsets and %lld names in %.3f s (%llu delete calls)\n",
+               (unsigned long long)deleted[ZONE_A], (unsigned long long)deleted[ZONE_AAAA],
+               (unsigned long long)deleted[ZONE_RR], (long long)pruned, seconds_since(&start),
+               (unsigned long long)calls);
+        fflush(stdout);
+    } while (interval && sigtimedwait(&signal_mask, NULL, &timeout) < 0 && errno == EAGAIN);
+
+    return 0;
+}
+
+//Read a record file for sync, a file with errors is not synced
+static int sync_load(const char *filename, struct dns_batch *batch, void *ctx)
+{
+    unsigned long errors = 0;
+    FILE *fp;
+    int err;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        printf("ERROR: Could not open %s: %s\n", filename, strerror(errno));
+        return -ENOENT;
+    }
+    err = load_lines(fp, filename, batch, &errors);
+    fclose(fp);
+    return err ? err : errors ? -EINVAL : 0;
+}
+
+//Control socket of serve. Clients send one request per line:
+//  add type name value [ttl [expiry]]  add a record to its RRset
+//  remove type name value      remove a record, an RRset left empty is deleted
+//  get type name               the records of an RRset as list prints them
+//  batch ... end               changes between batch and end are answered once, at end
+//Every request is answered by a line starting with OK or ERR, get prints its records first.
+//Changes are staged while input is waiting and written with one batched update per map,
+//add and remove are answered once their change is in the map.
+#define SERVE_CLIENTS_MAX 64
+#define SERVE_LINE_MAX 1024
+#define SERVE_READ_SIZE 65536
+//Stop reading from a client that does not read its answers
+#define SERVE_OUT_MAX (1 << 20)
+
+struct serve_client {
+    int fd;
+    char in[SERVE_READ_SIZE];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    size_t out_sent;
+    unsigned int acks;          //Changes staged for the next flush, answered after it
+    int in_batch;
+    unsigned long batch_records;
+    unsigned long batch_errors;
+    int batch_failed;
+    int closing;
+};
+
+struct serve {
+    int fds[ZONE_MAPS];
+    int slot;
+    struct dns_batch *batch;
+    unsigned long staged;
+    struct serve_client *clients[SERVE_CLIENTS_MAX];
+    int nclients;
+    unsigned long changes;
+    unsigned long flushes;
+};
+
+static void serve_append(struct serve_client *c, const char *data, size_t len)
+{
+    if (c->out_len + len > c->out_size)
+    {
+        size_t size = c->out_size ? c->out_size : 4096;
+        char *out;
+
+        while (size < c->out_len + len)
+            size *= 2;
+        out = realloc(c->out, size);
+        if (!out)
+        {
+            c->closing = 1;
+            return;
+        }
+        c->out = out;
+        c->out_size = size;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+//Answer the clients waiting for the staged changes with the result of their flush
+static void serve_answer(struct serve *s, int err)
+{
+    char line[128];
+
+    s->flushes++;
+    s->changes += s->staged;
+    s->staged = 0;
+
+    if (err)
+        snprintf(line, sizeof(line), "ERR %s\n", load_error(err));
+    else
+        snprintf(line, sizeof(line), "OK\n");
+    for (int i = 0; i < s->nclients; i++)
+    {
+        struct serve_client *c = s->clients[i];
+
+        for (; c->acks > 0; c->acks--)
+            serve_append(c, line, strlen(line));
+        if (err && c->in_batch)
+            c->batch_failed = 1;
+    }
+}
+
+//Write the staged changes and answer the clients waiting for them
+static void serve_flush(struct serve *s)
+{
+    if (s->staged > 0)
+        serve_answer(s, dns_batch_flush(s->batch));
+}
+
+//Answer a request, after the changes the client sent before it
+static void serve_reply(struct serve *s, struct serve_client *c, const char *fmt, ...)
+{
+    char line[SERVE_LINE_MAX];
+    va_list ap;
+    int len;
+
+    if (c->acks > 0)
+        serve_flush(s);
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(line))
+        len = sizeof(line) - 1;
+    serve_append(c, line, len);
+}
+
+static void serve_get(struct serve *s, struct serve_client *c, char *args)
+{
+    struct list_filter filter;
+    char dns_name[MAX_DNS_NAME_LENGTH];
+    char value[sizeof(struct rr_record)];
+    struct dns_key key;
+    char *type, *name, *end, *out = NULL;
+    size_t out_len = 0;
+    int map;
+
+    type = strtok_r(args, " \t", &end);
+    name = strtok_r(NULL, " \t", &end);
+    if (!type || !name || strtok_r(NULL, " \t", &end) || strnlen(name, DNS_NAME_TEXT_LENGTH) >= DNS_NAME_TEXT_LENGTH)
+    {
+        serve_reply(s, c, "ERR Usage: get type name\n");
+        return;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.class = DNS_CLASS_IN;
+    if (strcasecmp(type, "A") == 0)
+        key.record_type = A_RECORD_TYPE, map = ZONE_A;
+    else if (strcasecmp(type, "AAAA") == 0)
+        key.record_type = AAAA_RECORD_TYPE, map = ZONE_AAAA;
+    else if ((key.record_type = rr_type_from_name(type)) != 0)
+        map = ZONE_RR;
+    else
+    {
+        serve_reply(s, c, "ERR %s is not a DNS record type\n", type);
+        return;
+    }
+
+    memset(dns_name, 0, sizeof(dns_name));
+    if (replace_dots_with_length_octets(name, dns_name) < 0)
+    {
+        serve_reply(s, c, "ERR Invalid name %s\n", name);
+        return;
+    }
+    dns_name_tolower(dns_name);
+    key.name_hash = dns_name_hash(dns_name);
+
+    //Answer from the map, with every change received so far in it
+    serve_flush(s);
+
+    memset(&filter, 0, sizeof(filter));
+    filter.dns_name = dns_name;
+    filter.out = open_memstream(&out, &out_len);
+    if (!filter.out)
+    {
+        serve_reply(s, c, "ERR %s\n", strerror(errno));
+        return;
+    }
+    if (bpf_map_lookup_elem(s->fds[map], &key, value) == 0 &&
+        (map == ZONE_A ? ((struct a_record *)value)->name_check :
+         map == ZONE_AAAA ? ((struct aaaa_record *)value)->name_check :
+         ((struct rr_record *)value)->name_check) == dns_name_check(dns_name))
+    {
+        if (map == ZONE_A)
+            list_a(&key, value, &filter);
+        else if (map == ZONE_AAAA)
+            list_aaaa(&key, value, &filter);
+        else
+            list_rr(&key, value, &filter);
+    }
+    fclose(filter.out);
+    serve_append(c, out, out_len);
+    free(out);
+    serve_reply(s, c, "OK %lu\n", filter.records);
+}
+
+static void serve_change(struct serve *s, struct serve_client *c, int add, char *args)
+{
+    char *name, *value;
+    uint16_t type;
+    uint32_t ttl;
+    uint64_t expires;
+    uint16_t flags;
+    int err;
+
+    err = dns_record_split(args, &type, &name, &value, &ttl, &expires, &flags);
+    if (err == 0)
+        err = add ? dns_batch_add(s->batch, type, name, value, ttl, expires, flags) : dns_batch_remove(s->batch, type, name, value);
+
+    if (err == -EIO || err == -ENOMEM)
+    {
+        //A flush to make room failed, it wrote the changes staged before
+        serve_answer(s, err);
+    }
+    if (err)
+    {
+        if (c->in_batch)
+        {
+            c->batch_errors++;
+            serve_reply(s, c, "ERR %lu: %s\n", c->batch_records + c->batch_errors, load_error(err));
+        }
+        else
+        {
+            serve_reply(s, c, "ERR %s\n", load_error(err));
+        }
+        return;
+    }
+
+    s->staged++;
+    if (c->in_batch)
+        c->batch_records++;
+    else
+        c->acks++;
+}
+
+static void serve_line(struct serve *s, struct serve_client *c, char *line)
+{
+    char *cmd, *args;
+
+    line[strcspn(line, "\r")] = 0;
+    while (isspace((unsigned char)*line))
+        line++;
+    if (*line == 0 || *line == '#')
+        return;
+
+    cmd = line;
+    args = line + strcspn(line, " \t");
+    if (*args)
+        *args++ = 0;
+
+    if (strcasecmp(cmd, "add") == 0 || strcasecmp(cmd, "remove") == 0)
+    {
+        serve_change(s, c, strcasecmp(cmd, "add") == 0, args);
+    }
+    else if (strcasecmp(cmd, "get") == 0)
+    {
+        serve_get(s, c, args);
+    }
+    else if (strcasecmp(cmd, "batch") == 0 && !c->in_batch)
+    {
+        c->in_batch = 1;
+        c->batch_records = 0;
+        c->batch_errors = 0;
+        c->batch_failed = 0;
+    }
+    else if (strcasecmp(cmd, "end") == 0 && c->in_batch)
+    {
+        serve_flush(s);
+        c->in_batch = 0;
+        if (c->batch_failed)
+            serve_reply(s, c, "ERR Failed to write the records\n");
+        else if (c->batch_errors)
+            serve_reply(s, c, "ERR %lu of %lu records failed\n", c->batch_errors, c->batch_records + c->batch_errors);
+        else
+            serve_reply(s, c, "OK %lu\n", c->batch_records);
+    }
+    else
+    {
+        serve_reply(s, c, "ERR Unknown request %s\n", cmd);
+    }
+}
+
+static void serve_read(struct serve *s, struct serve_client *c)
+{
+    ssize_t n;
+    char *line, *nl;
+
+    n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            c->closing = 1;
+        return;
+    }
+    c->in_len += n;
+
+    line = c->in;
+    while ((nl = memchr(line, '\n', c->in + c->in_len - line)) != NULL)
+    {
+        *nl = 0;
+        if (nl - line >= SERVE_LINE_MAX)
+            serve_reply(s, c, "ERR Line too long\n");
+        else
+            serve_line(s, c, line);
+        line = nl + 1;
+    }
+    c->in_len -= line - c->in;
+    memmove(c->in, line, c->in_len);
+    if (c->in_len == sizeof(c->in))
+    {
+        serve_reply(s, c, "ERR Line too long\n");
+        c->closing = 1;
+    }
+}
+
+static void serve_write(struct serve_client *c)
+{
+    ssize_t n;
+
+    while (c->out_sent < c->out_len)
+    {
+        n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                c->out_sent = c->out_len = 0;
+                c->closing = 1;
+            }
+            return;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+}
+
+//Follow swaps and rollbacks, changes go to the zone that answers queries
+static int serve_open_zone(struct serve *s)
+{
+    int slot = zone_active_slot();
+
+    if (slot < 0)
+        return -1;
+    if (s->batch && slot == s->slot)
+        return 0;
+
+    dns_batch_free(s->batch);
+    s->batch = NULL;
+    zone_close(s->fds);
+    if (zone_open_active(s->fds) < 0)
+        return -1;
+    s->batch = dns_batch_new(s->fds[ZONE_A], s->fds[ZONE_AAAA], s->fds[ZONE_RR]);
+    if (!s->batch)
+    {
+        printf("ERROR: Failed to allocate memory\n");
+        return -1;
+    }
+    s->batch->merge = 1;
+    s->slot = slot;
+    return 0;
+}
+
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("ERROR: Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    //A socket left behind by a daemon that is gone refuses connections and is replaced,
+    //the socket of a running daemon is left alone
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        printf("ERROR: Failed to create the socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        printf("ERROR: Failed to listen on %s: %s, another serve is running\n", path, strerror(EADDRINUSE));
+        close(fd);
+        return -1;
+    }
+    if (errno == ECONNREFUSED)
+    {
+        unlink(path);
+    }
+    else if (errno != ENOENT)
+    {
+        printf("ERROR: Failed to check %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        printf("ERROR: Failed to create the socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        printf("ERROR: Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//Apply changes received on a Unix socket until SIGINT or SIGTERM
+static int serve_socket(const char *path)
+{
+    struct pollfd pfds[SERVE_CLIENTS_MAX + 2];
+    struct serve s;
+    sigset_t signal_mask;
+    int listen_fd, signal_fd;
+    int ret = 0, quit = 0;
+
+    memset(&s, 0, sizeof(s));
+    for (int i = 0; i < ZONE_MAPS; i++)
+        s.fds[i] = -1;
+    if (serve_open_zone(&s) < 0)
+    {
+        dns_batch_free(s.batch);
+        zone_close(s.fds);
+        return ENOENT;
+    }
+
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+    signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC);
+    listen_fd = serve_listen(path);
+    if (signal_fd < 0 || listen_fd < 0)
+    {
+        ret = EIO;
+        goto out;
+    }
+    printf("Serving record changes on %s\n", path);
+    fflush(stdout);
+
+    while (!quit)
+    {
+        int n = 0;
+
+        pfds[n++] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+        pfds[n++] = (struct pollfd){.fd = listen_fd, .events = s.nclients < SERVE_CLIENTS_MAX ? POLLIN : 0};
+        for (int i = 0; i < s.nclients; i++)
+        {
+            struct serve_client *c = s.clients[i];
+            pfds[n].fd = c->fd;
+            pfds[n].events = (c->out_len - c->out_sent < SERVE_OUT_MAX ? POLLIN : 0) |
+                             (c->out_sent < c->out_len ? POLLOUT : 0);
+            pfds[n++].revents = 0;
+        }
+
+        if (poll(pfds, n, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("ERROR: poll failed: %s\n", strerror(errno));
+            ret = EIO;
+            break;
+        }
+        if (pfds[0].revents & POLLIN)
+            quit = 1;
+
+        if (serve_open_zone(&s) < 0)
+        {
+            ret = ENOENT;
+            break;
+        }
+
+        //Read whatever is waiting on every client, then write it with one flush
+        for (int i = 0; i < s.nclients; i++)
+        {
+            if (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+                serve_read(&s, s.clients[i]);
+        }
+        serve_flush(&s);
+
+        for (int i = 0; i < s.nclients; i++)
+        {
+            struct serve_client *c = s.clients[i];
+
+            serve_write(c);
+            if (c->closing && c->out_sent == c->out_len)
+            {
+                close(c->fd);
+                free(c->out);
+                free(c);
+                s.clients[i--] = s.clients[--s.nclients];
+            }
+        }
+
+        if (pfds[1].revents & POLLIN)
+        {
+            int fd = accept(listen_fd, NULL, NULL);
+            struct serve_client *c;
+
+            if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+            if (fd >= 0)
             {
-                res = bpf_map_lookup_elem(aaaa_records_fd, &next_key, &value6);
-                if (res > -1)
+                c = calloc(1, sizeof(*c));
+                if (c)
+                {
+                    c->fd = fd;
+                    s.clients[s.nclients++] = c;
+                }
+                else
                 {
-                    char new_dns_name[strnlen(next_key.name, MAX_DNS_NAME_LENGTH)];
-                    char new_ip_buf[INET6_ADDRSTRLEN];
-                    replace_length_octets_with_dots(next_key.name, new_dns_name);
-                    inet_ntop(AF_INET6, &value6.ip_addr, new_ip_buf, sizeof(new_ip_buf));
-                    printf("AAAA %s %s %i\n", new_dns_name, new_ip_buf, value6.ttl);
+                    close(fd);
                 }
-                key = next_key;
             }
-            ret = 0;
         }
     }
-    else if (argc == 5 || argc == 6)
+
+    printf("Applied %lu changes in %lu flushes\n", s.changes, s.flushes);
+
+out:
+    for (int i = 0; i < s.nclients; i++)
+    {
+        close(s.clients[i]->fd);
+        free(s.clients[i]->out);
+        free(s.clients[i]);
+    }
+    if (listen_fd >= 0)
     {
+        close(listen_fd);
+        unlink(path);
+    }
+    if (signal_fd >= 0)
+        close(signal_fd);
+    dns_batch_free(s.batch);
+    zone_close(s.fds);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    //Return code
+    int ret = EINVAL;
+
+    //Zone swaps open the slots themselves
+    if (argc == 3 && strcmp(argv[1], "swap") == 0)
+        return swap_zone(argv[2]);
+    if (argc == 2 && strcmp(argv[1], "rollback") == 0)
+        return rollback_zone();
+    if (argc == 3 && strcmp(argv[1], "restore") == 0)
+        return restore_zone(argv[2]);
+    if (argc == 3 && strcmp(argv[1], "snapshot") == 0)
+        return snapshot_zone(argv[2]);
+    if (argc == 3 && strcmp(argv[1], "sync") == 0)
+        return dns_sync_watch(argv[2], sync_load, NULL) ? EIO : 0;
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "serve") == 0)
+        return serve_socket(argc == 3 ? argv[2] : SERVE_DEFAULT_SOCKET);
+    if (argc >= 2 && strcmp(argv[1], "sweep") == 0)
+    {
+        int ret = sweep_zone(argc - 1, argv + 1);
+        if (ret == EINVAL)
+            usage(argv[0]);
+        return ret;
+    }
+
+    //Everything else works on the record maps queries are answered from
+    int zone_fds[ZONE_MAPS];
+    if (zone_open_active(zone_fds) < 0)
+        return EXIT_FAILURE;
+    int a_records_fd = zone_fds[ZONE_A];
+    int aaaa_records_fd = zone_fds[ZONE_AAAA];
+    int rr_records_fd = zone_fds[ZONE_RR];
+
+    if (argc >= 2 && strcmp(argv[1], "list") == 0)
+    {
+        ret = list_records(argc - 1, argv + 1, a_records_fd, aaaa_records_fd, rr_records_fd);
+    }
+    else if (argc == 3 && strcmp(argv[1], "load") == 0)
+    {
+        ret = load_records(argv[2], a_records_fd, aaaa_records_fd, rr_records_fd);
+    }
+    else if (argc == 5 || argc == 6 || (argc == 7 && strcmp(argv[1], "add") == 0))
+    {
+        uint64_t expires = 0;
+        if (argc == 7 && dns_expiry_parse(argv[6], &expires) != 0)
+        {
+            printf("ERROR: Invalid expiry '%s', expected @unix_time or +seconds\n", argv[6]);
+            return EINVAL;
+        }
         if (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "remove") == 0)
         {
             struct in_addr ip_addr;
@@ -99,11 +1254,20 @@ int main(int argc, char **argv)
             char new_dns_name[MAX_DNS_NAME_LENGTH];
             //Zero fill the new_dns_name
             memset(&new_dns_name, 0, sizeof(new_dns_name));
-            replace_dots_with_length_octets(argv[3], new_dns_name);
+            if (replace_dots_with_length_octets(argv[3], new_dns_name) < 0)
+            {
+                printf("ERROR: Invalid name %s\n", argv[3]);
+                return EINVAL;
+            }
+            dns_name_tolower(new_dns_name);
 
-            struct dns_query dns;
+            //Records are keyed by the hash of the wire-format name, the value holds its check
+            //and the name itself goes into xdns_names
+            struct dns_key dns;
+            uint64_t name_check = dns_name_check(new_dns_name);
+            memset(&dns, 0, sizeof(dns));
             dns.class = DNS_CLASS_IN;
-            memcpy(dns.name, new_dns_name, sizeof(new_dns_name));
+            dns.name_hash = dns_name_hash(new_dns_name);
 
             //Check for 'A' record
             if (strcmp(argv[2], "a") == 0 || strcmp(argv[2], "A") == 0)
@@ -115,16 +1279,29 @@ int main(int argc, char **argv)
                     ret = EINVAL;
                     return ret;
                 }
-                if (strcmp(argv[1], "add") == 0)
+
+                //Addresses are added to or removed from the RRset of the name
+                struct a_record a;
+                int found = bpf_map_lookup_elem(a_records_fd, &dns, &a) == 0;
+                if (found && a.name_check != name_check)
                 {
-                    struct a_record a;
-                    a.ip_addr = ip_addr;
-                    if(argc == 5){
-                        a.ttl = 0;
-                    } else {
-                        a.ttl = (uint32_t)atoi(argv[5]);
+                    printf("ERROR: Name hash collides with an existing record\n");
+                    ret = EEXIST;
+                }
+                else if (strcmp(argv[1], "add") == 0)
+                {
+                    if (!found)
+                    {
+                        memset(&a, 0, sizeof(a));
+                        a.name_check = name_check;
+                    }
+                    a.expires = expires;
+                    if (a_rrset_add(&a, ip_addr, argc == 5 ? 0 : (uint32_t)atoi(argv[5])) < 0)
+                    {
+                        printf("ERROR: RRset already holds %d addresses\n", MAX_RRSET_SIZE);
+                        ret = ENOSPC;
                     }
-                    if (bpf_map_update_elem(a_records_fd, &dns, &a, BPF_ANY) < 0){
+                    else if (bpf_map_update_elem(a_records_fd, &dns, &a, BPF_ANY) < 0){
                         printf("ERROR: DNS record could not be added\n");
                         ret = EINVAL;
                     }
@@ -135,7 +1312,8 @@ int main(int argc, char **argv)
                 }
                 else if (strcmp(argv[1], "remove") == 0)
                 {
-                    if (bpf_map_delete_elem(a_records_fd, &dns) == 0)
+                    if (found && a_rrset_remove(&a, ip_addr) == 0 &&
+                        (a.count > 0 ? bpf_map_update_elem(a_records_fd, &dns, &a, BPF_EXIST) : bpf_map_delete_elem(a_records_fd, &dns)) == 0)
                     {
                         printf("DNS record removed\n");
                         ret = 0;
@@ -154,16 +1332,85 @@ int main(int argc, char **argv)
                     ret = EINVAL;
                     return ret;
                 }
-                if (strcmp(argv[1], "add") == 0)
+
+                struct aaaa_record a;
+                int found = bpf_map_lookup_elem(aaaa_records_fd, &dns, &a) == 0;
+                if (found && a.name_check != name_check)
+                {
+                    printf("ERROR: Name hash collides with an existing record\n");
+                    ret = EEXIST;
+                }
+                else if (strcmp(argv[1], "add") == 0)
+                {
+                    if (!found)
+                    {
+                        memset(&a, 0, sizeof(a));
+                        a.name_check = name_check;
+                    }
+                    a.expires = expires;
+                    if (aaaa_rrset_add(&a, ip6_addr, argc == 5 ? 0 : (uint32_t)atoi(argv[5])) < 0)
+                    {
+                        printf("ERROR: RRset already holds %d addresses\n", MAX_RRSET_SIZE);
+                        ret = ENOSPC;
+                    }
+                    else if (bpf_map_update_elem(aaaa_records_fd, &dns, &a, BPF_ANY) < 0){
+                        printf("ERROR: DNS record could not be added\n");
+                        ret = EINVAL;
+                    }
+                    else {
+                        printf("DNS record added\n");
+                        ret = 0;
+                    }
+                }
+                else if (strcmp(argv[1], "remove") == 0)
+                {
+                    if (found && aaaa_rrset_remove(&a, ip6_addr) == 0 &&
+                        (a.count > 0 ? bpf_map_update_elem(aaaa_records_fd, &dns, &a, BPF_EXIST) : bpf_map_delete_elem(aaaa_records_fd, &dns)) == 0)
+                    {
+                        printf("DNS record removed\n");
+                        ret = 0;
+                    }
+                    else
+                    {
+                        printf("DNS record not found\n");
+                        ret = ENOENT;
+                    }
+                }
+            } else if ((dns.record_type = rr_type_from_name(argv[2])) != 0) { //Check for a generic record type
+                char rdata[MAX_RR_DATA_LENGTH];
+                int rdata_len = rr_rdata_from_text(dns.record_type, argv[4], rdata, sizeof(rdata));
+                if (rdata_len < 0)
+                {
+                    printf("ERROR: Invalid %s record value '%s'\n", rr_type_to_name(dns.record_type), argv[4]);
+                    ret = EINVAL;
+                    return ret;
+                }
+
+                //Every RR of the name and type is kept pre-serialized in one value
+                struct rr_record r;
+                int found = bpf_map_lookup_elem(rr_records_fd, &dns, &r) == 0;
+                if (found && r.name_check != name_check)
+                {
+                    printf("ERROR: Name hash collides with an existing record\n");
+                    ret = EEXIST;
+                }
+                else if (strcmp(argv[1], "add") == 0)
                 {
-                    struct aaaa_record a;
-                    a.ip_addr = ip6_addr;
-                    if(argc == 5){
-                        a.ttl = 0;
-                    } else {
-                        a.ttl = (uint32_t)atoi(argv[5]);
+                    //A name has a single CNAME, adding one replaces the previous target
+                    if (!found || dns.record_type == CNAME_RECORD_TYPE)
+                    {
+                        uint16_t flags = found ? r.flags : 0;
+                        memset(&r, 0, sizeof(r));
+                        r.name_check = name_check;
+                        r.flags = flags;
+                    }
+                    r.expires = expires;
+                    if (rr_record_add(&r, dns.record_type, rdata, rdata_len, argc == 5 ? 0 : (uint32_t)atoi(argv[5])) < 0)
+                    {
+                        printf("ERROR: Records of %s exceed %d bytes\n", argv[3], MAX_RR_DATA_LENGTH);
+                        ret = ENOSPC;
                     }
-                    if (bpf_map_update_elem(aaaa_records_fd, &dns, &a, BPF_ANY) < 0){
+                    else if (bpf_map_update_elem(rr_records_fd, &dns, &r, BPF_ANY) < 0){
                         printf("ERROR: DNS record could not be added\n");
                         ret = EINVAL;
                     }
@@ -174,7 +1421,8 @@ int main(int argc, char **argv)
                 }
                 else if (strcmp(argv[1], "remove") == 0)
                 {
-                    if (bpf_map_delete_elem(aaaa_records_fd, &dns) == 0)
+                    if (found && rr_record_remove(&r, dns.record_type, rdata, rdata_len) == 0 &&
+                        (r.ans_count > 0 ? bpf_map_update_elem(rr_records_fd, &dns, &r, BPF_EXIST) : bpf_map_delete_elem(rr_records_fd, &dns)) == 0)
                     {
                         printf("DNS record removed\n");
                         ret = 0;
@@ -190,97 +1438,25 @@ int main(int argc, char **argv)
                 ret = EINVAL;   
                 return ret;
             }
-        }
-    }
 
-    if(ret != 0)
-        usage(argv[0]);
-
-    return ret;
-}
-
-//Calculate and insert length octets between DNS name labels. RFC1035 4.1.2
-void replace_dots_with_length_octets(char *dns_name, char *new_dns_name)
-{
-    uint16_t name_len = strnlen(dns_name, 255);
-    int i;
-    int cnt = 0;
-
-    for (i = 0; i <= name_len; i++)
-    {
-        //If dot character or end of string is detected
-        if (dns_name[i] == 46 || dns_name[i] == 0)
-        {
-            //Put length octet with value [cnt] at location [i-cnt]
-            new_dns_name[i - cnt] = cnt;
-
-            //Break loop if zero
-            if (dns_name[i] == 0)
+            //xdp_dns compares the question with the name before answering the record
+            if (ret == 0 && strcmp(argv[1], "add") == 0)
             {
-                cnt = i + 1;
-                break;
+                int names_fd = dns_names_open();
+                if (names_fd < 0 || dns_names_put(names_fd, new_dns_name) != 0)
+                {
+                    printf("ERROR: The name could not be added to xdns_names, the record is not answered: %s\n",
+                           strerror(errno));
+                    ret = EIO;
+                }
+                if (names_fd >= 0)
+                    close(names_fd);
             }
-
-            //Reset counter
-            cnt = -1;
         }
-
-        new_dns_name[i + 1] = dns_name[i];
-
-        //Count number of characters until the dot character
-        cnt++;
     }
 
-    new_dns_name[cnt] = 0;
-}
-
-void replace_length_octets_with_dots(char *dns_name, char *new_dns_name)
-{
-    uint16_t name_len = strnlen(dns_name, 255);
-
-    //Retrieve first label length octet
-    char label_length = dns_name[0];
-    int i;
-    //Loop through dns name, starting at 1 (as position 0 contains length octet)
-    for (i = 1; i <= name_len; i++)
-    {
-        //Break loop if zero
-        if (dns_name[i] == 0)
-        {
-            new_dns_name[i - 1] = 0;
-            break;
-        }
-        else if (label_length == 0)
-        {
-            new_dns_name[i - 1] = '.';
-            //Set label_length to current label length octet
-            label_length = dns_name[i];
-        }
-        else
-        {
-            new_dns_name[i - 1] = dns_name[i];
-            label_length--;
-        }
-    }
-}
+    if(ret != 0)
+        usage(argv[0]);
 
-int get_map_fd(const char *map_path)
-{
-    int fd = bpf_obj_get(map_path);
-    if (fd < 0)
-    {
-        if (errno == EACCES)
-        {
-            printf("ERROR: Permission denied while trying to access %s\n", map_path);
-        }
-        else if (errno == ENOENT)
-        {
-            printf("ERROR: Could not find BPF maps. Load XDP program with iproute2 first.\n");
-        }
-        else
-        {
-            printf("ERROR: BPF map error: %d (%s)\n", errno, strerror(errno));
-        }
-    }
-    return fd;
+    return ret;
 }
@@ -20,16 +20,102 @@
 #include <linux/if_link.h>
 #include <linux/limits.h>
 
+#include <arpa/inet.h>
 #include <linux/bpf.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
+#include "dns_util.h"
+#include "dns_zone.h"
+#include "rxq_stats.h"
+
+static int nr_cpus = 0;
+
+static const char *stat_names[XDNS_STAT_MAX] = {
+	[XDNS_STAT_NON_IP] = "non_ip",
+	[XDNS_STAT_NON_UDP] = "non_udp",
+	[XDNS_STAT_WRONG_PORT] = "wrong_port",
+	[XDNS_STAT_NOT_QUERY] = "not_query",
+	[XDNS_STAT_PARSE_FAIL] = "parse_fail",
+	[XDNS_STAT_ANSWER_FAIL] = "answer_fail",
+	[XDNS_STAT_ADJUST_TAIL_FAIL] = "adjust_tail_fail",
+	[XDNS_STAT_TX] = "tx",
+	[XDNS_STAT_EXPIRED] = "expired",
+	[XDNS_STAT_SNOOPED] = "snooped",
+	[XDNS_STAT_TRUNCATED] = "truncated",
+	[XDNS_STAT_NAME_MISMATCH] = "name_mismatch",
+};
+
+static const char *qtype_names[XDNS_QTYPE_MAX] = {
+	[XDNS_QTYPE_A] = "A",
+	[XDNS_QTYPE_NS] = "NS",
+	[XDNS_QTYPE_CNAME] = "CNAME",
+	[XDNS_QTYPE_PTR] = "PTR",
+	[XDNS_QTYPE_MX] = "MX",
+	[XDNS_QTYPE_TXT] = "TXT",
+	[XDNS_QTYPE_AAAA] = "AAAA",
+	[XDNS_QTYPE_SRV] = "SRV",
+	[XDNS_QTYPE_OTHER] = "other",
+};
+
 static int print_bpf_verifier(enum libbpf_print_level level,
 							const char *format, va_list args)
 {
 	return vfprintf(stdout, format, args);
 }
 
+//Sum the per-CPU counters of xdns_stats
+static int read_stats(int map_fd, struct xdns_stats *total)
+{
+	struct xdns_stats values[nr_cpus];
+	__u32 key = 0;
+
+	memset(total, 0, sizeof(*total));
+	if (bpf_map_lookup_elem(map_fd, &key, values)) {
+		fprintf(stderr, "Error: Failed to read xdns_stats: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		for (int i = 0; i < XDNS_STAT_MAX; i++)
+			total->counters[i] += values[cpu].counters[i];
+		for (int i = 0; i < XDNS_QTYPE_MAX; i++) {
+			total->hit[i] += values[cpu].hit[i];
+			total->miss[i] += values[cpu].miss[i];
+		}
+	}
+
+	return 0;
+}
+
+//Print the rate of every decision since the previous call on a single line
+static void print_stats(int map_fd, struct xdns_stats *prev, double interval)
+{
+	struct xdns_stats cur;
+	__u64 hits = 0, misses = 0;
+
+	if (read_stats(map_fd, &cur))
+		return;
+
+	for (int i = 0; i < XDNS_QTYPE_MAX; i++) {
+		hits += cur.hit[i] - prev->hit[i];
+		misses += cur.miss[i] - prev->miss[i];
+	}
+
+	printf("hit_ratio %.1f%%", hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+	for (int i = 0; i < XDNS_STAT_MAX; i++)
+		printf(" %s %.0f/s", stat_names[i], (cur.counters[i] - prev->counters[i]) / interval);
+	for (int i = 0; i < XDNS_QTYPE_MAX; i++) {
+		if (cur.hit[i] != prev->hit[i] || cur.miss[i] != prev->miss[i])
+			printf(" %s hit %.0f/s miss %.0f/s", qtype_names[i],
+				   (cur.hit[i] - prev->hit[i]) / interval, (cur.miss[i] - prev->miss[i]) / interval);
+	}
+	printf("\n");
+	fflush(stdout);
+
+	*prev = cur;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -43,13 +129,39 @@ int main(int argc, char *argv[])
 	int *interfaces_idx;
 	int ret = 0;
 
+	//Record map size (0 keeps the size from the BPF object) and preallocation
+	__u32 max_entries = 0;
+	int prealloc = 0;
+	//Seconds between two lines of statistics, 0 disables them
+	int stats_interval = 0;
+
 	int opt;
 	int interface_count = 0;
-	while ((opt = getopt(argc, argv, "")) != -1) {
+	while ((opt = getopt(argc, argv, "n:pi:")) != -1) {
 		switch (opt) {
+			case 'n':
+				max_entries = strtoul(optarg, NULL, 10);
+				if (max_entries == 0) {
+					fprintf(stderr, "Invalid number of entries '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				prealloc = 1;
+				break;
+			case 'i':
+				stats_interval = atoi(optarg);
+				if (stats_interval <= 0) {
+					fprintf(stderr, "Invalid statistics interval '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case '?':
 			default:
-				fprintf(stderr, "Usage: %s <interface_idx...>\n", argv[0]);
+				fprintf(stderr, "Usage: %s [-n max_entries] [-p] [-i seconds] <interface_idx...>\n", argv[0]);
+				fprintf(stderr, "  -n  maximum number of records per record type\n");
+				fprintf(stderr, "  -p  preallocate the record maps instead of allocating on insert\n");
+				fprintf(stderr, "  -i  print packet rates, hit ratio and pass reasons every <seconds>\n");
 				exit(EXIT_FAILURE);
 		}
 	}
@@ -70,6 +182,7 @@ int main(int argc, char *argv[])
 		interfaces_idx[i] = atoi(argv[optind]);
 	}
 	xdp_flags |= XDP_FLAGS_DRV_MODE;
+	nr_cpus = libbpf_num_possible_cpus();
 
 	snprintf(filename, sizeof(filename), "%s_kern.o", argv[0]);
 
@@ -91,11 +204,59 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	//The record maps of the first zone, also the template every later zone has to match
+	int zone_fds[ZONE_MAPS];
+	if (zone_create(max_entries ? max_entries : XDNS_DEFAULT_RECORDS, prealloc ? 0 : BPF_F_NO_PREALLOC, zone_fds))
+		return 1;
+	for (int i = 0; i < ZONE_MAPS; i++) {
+		struct bpf_map *map = bpf_object__find_map_by_name(obj, zone_outer_names[i]);
+		if (!map) {
+			fprintf(stderr, "Error: bpf_object__find_map_by_name failed for %s\n", zone_outer_names[i]);
+			return 1;
+		}
+		if (bpf_map__set_inner_map_fd(map, zone_fds[i])) {
+			fprintf(stderr, "Error: Failed to set the record map of %s\n", zone_outer_names[i]);
+			return 1;
+		}
+	}
+
+	//A name is kept once for all its records, in both zones and the snooped answers of tc_dns.
+	//It is allocated like the record maps, most of it is never used.
+	struct bpf_map *names = bpf_object__find_map_by_name(obj, "xdns_names");
+	if (!names ||
+	    bpf_map__set_max_entries(names, XDNS_ZONE_SLOTS * (max_entries ? max_entries : XDNS_DEFAULT_RECORDS) +
+					    XDNS_SNOOP_ENTRIES) ||
+	    bpf_map__set_map_flags(names, prealloc ? 0 : BPF_F_NO_PREALLOC)) {
+		fprintf(stderr, "Error: Failed to size xdns_names\n");
+		return 1;
+	}
+
 	err = bpf_object__load(obj);
 	if (err) {
 		fprintf(stderr, "Error: bpf_object__load failed\n");
+		fprintf(stderr, "If the maps are already pinned with a different size, remove /sys/fs/bpf/xdns_* first\n");
+		return 1;
+	}
+
+	//Pinned zones survive a restart, an empty active slot gets the new record maps
+	int outer_fds[ZONE_MAPS], active_fds[ZONE_MAPS];
+	__u32 active_key = 0, active_slot = 0;
+	int active_fd = bpf_object__find_map_fd_by_name(obj, zone_active_name);
+	for (int i = 0; i < ZONE_MAPS; i++)
+		outer_fds[i] = bpf_object__find_map_fd_by_name(obj, zone_outer_names[i]);
+	if (active_fd < 0 || bpf_map_lookup_elem(active_fd, &active_key, &active_slot)) {
+		fprintf(stderr, "Error: Failed to read %s\n", zone_active_name);
+		return 1;
+	}
+	active_slot &= XDNS_ZONE_SLOTS - 1;
+	if (zone_open(outer_fds, active_slot, active_fds) == 0) {
+		zone_close(active_fds);
+		if (max_entries || prealloc)
+			fprintf(stderr, "Keeping the pinned zone, remove /sys/fs/bpf/xdns_* to resize it\n");
+	} else if (zone_install(outer_fds, active_slot, zone_fds)) {
 		return 1;
 	}
+	zone_close(zone_fds);
 
 	prog = bpf_object__find_program_by_name(obj, "xdp_dns");
 	if (!prog) {
@@ -109,6 +270,18 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	int stats_fd = bpf_object__find_map_fd_by_name(obj, "xdns_stats");
+	if (stats_fd < 0) {
+		fprintf(stderr, "Error: Failed to find xdns_stats\n");
+		return 1;
+	}
+
+	int rxq_fd = bpf_object__find_map_fd_by_name(obj, "xdns_rxq");
+	if (rxq_fd < 0) {
+		fprintf(stderr, "Error: Failed to find xdns_rxq\n");
+		return 1;
+	}
+
 	for (int i = 0; i < interface_count; i++) {
 		if (bpf_set_link_xdp_fd(interfaces_idx[i], xdp_main_prog_fd, xdp_flags) < 0) {
 			fprintf(stderr, "Error: bpf_set_link_xdp_fd failed for interface %d\n", interfaces_idx[i]);
@@ -128,8 +301,35 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	struct xdns_stats prev_stats;
+	struct rxq_totals prev_rxq;
+	struct timespec prev_time, now;
+	if (stats_interval && (read_stats(stats_fd, &prev_stats) || rxq_read(rxq_fd, nr_cpus, &prev_rxq, NULL))) {
+		//The program keeps answering, only the periodic statistics are given up
+		fprintf(stderr, "Warning: Failed to read the statistics maps, -i %d is ignored\n", stats_interval);
+		stats_interval = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &prev_time);
+
 	while (!quit) {
-		err = sigwait(&signal_mask, &sig);
+		if (stats_interval) {
+			//Wake up every stats_interval seconds to print the statistics
+			struct timespec timeout = {stats_interval, 0};
+			sig = sigtimedwait(&signal_mask, NULL, &timeout);
+			if (sig < 0 && errno == EAGAIN) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				double elapsed = (now.tv_sec - prev_time.tv_sec) + (now.tv_nsec - prev_time.tv_nsec) / 1e9;
+				print_stats(stats_fd, &prev_stats, elapsed);
+				rxq_report(rxq_fd, nr_cpus, &prev_rxq, elapsed);
+				prev_time = now;
+				continue;
+			}
+			err = sig < 0 && errno != EINTR ? -1 : 0;
+			if (sig < 0 && !err)
+				continue;
+		} else {
+			err = sigwait(&signal_mask, &sig);
+		}
 		if (err != 0) {
 			fprintf(stderr, "Error: Failed to wait for signal\n");
 			exit(EXIT_FAILURE);
@@ -0,0 +1,541 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Warm-up curve of xdp_dns in front of xdp_dns_fill. A workload of queries is replayed
+ * through the program with BPF_PROG_TEST_RUN, on the pinned zone of xdp_dns, and every
+ * query the program passes up the stack is sent to xdp_dns_fill the way the stack would
+ * deliver it, waiting for its answer. Every interval of queries the hit rate,
+ * hits / (hits + misses) from the counters of xdns_stats, is printed, and falls into
+ * place as the fill writes the answers into the maps.
+ *
+ *   ./xdp_dns_stub -p 5353 &
+ *   sudo ./xdp_dns_fill -u 127.0.0.1#5353 -p 5300 -i 0 &
+ *   sudo ./xdp_dns_warmup -f 127.0.0.1#5300 -z 10000 -q 200000 -n 10000
+ *
+ * The zone maps must be pinned, by a running or earlier xdp_dns. The counters are a
+ * private copy of xdns_stats, so live traffic does not blur the curve. A workload file
+ * holds one query per line, a name and optionally its type (a or aaaa, default a).
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "common.h"
+#include "dns_util.h"
+#include "dns_zone.h"
+
+#define WARMUP_PKT_SIZE 1024
+#define WARMUP_DEFAULT_INTERVAL 1000
+#define WARMUP_DEFAULT_QUERIES 100000
+#define WARMUP_DEFAULT_SKEW 0.99
+#define WARMUP_TIMEOUT_MS 2000
+#define WARMUP_PIN_DIR "/sys/fs/bpf/"
+
+//Maps shared with xdp_dns and xdp_dns_fill
+static const char *warmup_shared_maps[] = {"xdns_a_zone", "xdns_aaaa_zone", "xdns_rr_zone", "xdns_zone_active",
+										   "xdns_snoop_a", "xdns_snoop_aaaa", "xdns_names"};
+
+//Maps kept away from a running xdp_dns, so its counters and events are left alone
+static const char *warmup_private_maps[] = {"xdns_stats", "xdns_lat", "xdns_lat_on", "xdns_config", "xdns_events",
+											"xdns_rxq"};
+
+struct warmup_query {
+	char *name;
+	uint16_t type;
+};
+
+struct warmup_workload {
+	struct warmup_query *queries;
+	size_t count;
+	size_t size;
+};
+
+struct warmup_totals {
+	uint64_t queries;
+	uint64_t answered;      //XDP_TX
+	uint64_t relayed;       //Passed and answered by xdp_dns_fill
+	uint64_t failed;        //Passed and not answered in time, or dropped
+	double miss_ms;         //Time spent waiting for xdp_dns_fill
+};
+
+static int nr_cpus;
+
+static int print_bpf_verifier(enum libbpf_print_level level,
+							const char *format, va_list args)
+{
+	if (level == LIBBPF_DEBUG)
+		return 0;
+	return vfprintf(stderr, format, args);
+}
+
+static int workload_add(struct warmup_workload *w, const char *name, uint16_t type)
+{
+	if (w->count == w->size) {
+		size_t size = w->size ? w->size * 2 : 1024;
+		struct warmup_query *queries = realloc(w->queries, size * sizeof(*queries));
+
+		if (!queries)
+			return -1;
+		w->queries = queries;
+		w->size = size;
+	}
+	w->queries[w->count].name = strdup(name);
+	w->queries[w->count].type = type;
+	if (!w->queries[w->count].name)
+		return -1;
+	w->count++;
+	return 0;
+}
+
+//Read one query per line, "name [a|aaaa]", from filename (- for stdin)
+static int workload_read(struct warmup_workload *w, const char *filename)
+{
+	char line[DNS_NAME_TEXT_LENGTH + 16], name[DNS_NAME_TEXT_LENGTH], type[8];
+	unsigned long line_number = 0;
+	FILE *fp;
+	int ret = 0;
+
+	fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Error: Could not open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		int fields;
+
+		line_number++;
+		fields = sscanf(line, "%1023s %7s", name, type);
+		if (fields < 1 || name[0] == '#')
+			continue;
+		if (fields == 2 && strcasecmp(type, "a") != 0 && strcasecmp(type, "aaaa") != 0) {
+			fprintf(stderr, "Error: %s:%lu: Unsupported type %s\n", filename, line_number, type);
+			ret = -1;
+			break;
+		}
+		if (workload_add(w, name, fields == 2 && strcasecmp(type, "aaaa") == 0 ? AAAA_RECORD_TYPE : A_RECORD_TYPE)) {
+			fprintf(stderr, "Error: failed to allocate memory\n");
+			ret = -1;
+			break;
+		}
+	}
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+//Draw count A queries for names name<i>.warmup.test from a Zipf distribution over names names
+static int workload_zipf(struct warmup_workload *w, int names, size_t count, double skew)
+{
+	double *cdf = malloc(names * sizeof(*cdf));
+	double sum = 0;
+	char name[64];
+
+	if (!cdf) {
+		fprintf(stderr, "Error: failed to allocate memory\n");
+		return -1;
+	}
+	for (int i = 0; i < names; i++) {
+		sum += 1.0 / pow(i + 1, skew);
+		cdf[i] = sum;
+	}
+	for (size_t n = 0; n < count; n++) {
+		double u = (double)random() / RAND_MAX * sum;
+		int lo = 0, hi = names - 1;
+
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		snprintf(name, sizeof(name), "name%d.warmup.test", lo);
+		if (workload_add(w, name, A_RECORD_TYPE)) {
+			fprintf(stderr, "Error: failed to allocate memory\n");
+			free(cdf);
+			return -1;
+		}
+	}
+	free(cdf);
+	return 0;
+}
+
+//Build an Ethernet/IPv4/UDP/DNS query for name into pkt like xdp_dns_bench does.
+//Returns its length, the DNS message starts at WARMUP_DNS_OFFSET.
+#define WARMUP_DNS_OFFSET (sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr))
+static int build_query(char *pkt, const char *name, uint16_t record_type, uint16_t id)
+{
+	char wire_name[MAX_DNS_NAME_LENGTH];
+	struct ethhdr *eth = (struct ethhdr *)pkt;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	struct dns_hdr *dns = (struct dns_hdr *)(udp + 1);
+	char *query = (char *)(dns + 1);
+	size_t name_len;
+	uint16_t val;
+
+	memset(pkt, 0, WARMUP_PKT_SIZE);
+	memset(wire_name, 0, sizeof(wire_name));
+	if (replace_dots_with_length_octets((char *)name, wire_name) < 0)
+		return -1;
+	name_len = strnlen(wire_name, sizeof(wire_name)) + 1;
+
+	memset(eth->h_dest, 0x02, ETH_ALEN);
+	memset(eth->h_source, 0x04, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	memcpy(query, wire_name, name_len);
+	val = htons(record_type);
+	memcpy(query + name_len, &val, sizeof(val));
+	val = htons(DNS_CLASS_IN);
+	memcpy(query + name_len + 2, &val, sizeof(val));
+
+	dns->transaction_id = htons(id);
+	dns->rd = 1;
+	dns->q_count = htons(1);
+
+	udp->source = htons(40000);
+	udp->dest = htons(53);
+	udp->len = htons(sizeof(*udp) + sizeof(*dns) + name_len + 4);
+
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->tot_len = htons(sizeof(*ip) + ntohs(udp->len));
+	ip->saddr = htonl(0x0a000001);
+	ip->daddr = htonl(0x0a000002);
+
+	return sizeof(*eth) + ntohs(ip->tot_len);
+}
+
+//Load the program on the pinned zone maps, with its own counters
+static struct bpf_object *load_object(const char *filename)
+{
+	struct bpf_object *obj;
+	struct bpf_map *map;
+
+	obj = bpf_object__open(filename);
+	if (!obj) {
+		fprintf(stderr, "Error: bpf_object__open failed for %s\n", filename);
+		return NULL;
+	}
+
+	for (int i = 0; i < sizeof(warmup_private_maps) / sizeof(warmup_private_maps[0]); i++) {
+		map = bpf_object__find_map_by_name(obj, warmup_private_maps[i]);
+		if (map)
+			bpf_map__set_pin_path(map, NULL);
+	}
+	for (int i = 0; i < sizeof(warmup_shared_maps) / sizeof(warmup_shared_maps[0]); i++) {
+		char path[64];
+		int fd;
+
+		snprintf(path, sizeof(path), WARMUP_PIN_DIR "%s", warmup_shared_maps[i]);
+		map = bpf_object__find_map_by_name(obj, warmup_shared_maps[i]);
+		fd = bpf_obj_get(path);
+		if (fd < 0) {
+			fprintf(stderr, "Error: %s is not pinned, start xdp_dns first\n", path);
+			bpf_object__close(obj);
+			return NULL;
+		}
+		if (!map || bpf_map__reuse_fd(map, fd)) {
+			fprintf(stderr, "Error: Failed to use %s\n", path);
+			close(fd);
+			bpf_object__close(obj);
+			return NULL;
+		}
+		close(fd);
+	}
+
+	if (bpf_object__load(obj)) {
+		fprintf(stderr, "Error: bpf_object__load failed for %s\n", filename);
+		bpf_object__close(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+static int open_fill(const char *fill)
+{
+	struct addrinfo hints, *ai;
+	char host[INET6_ADDRSTRLEN + 8], port[8] = "53";
+	char *sep;
+	int fd, err;
+
+	snprintf(host, sizeof(host), "%s", fill);
+	sep = strrchr(host, '#');
+	if (sep) {
+		*sep = 0;
+		snprintf(port, sizeof(port), "%s", sep + 1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	err = getaddrinfo(host, port, &hints, &ai);
+	if (err) {
+		fprintf(stderr, "Error: Invalid address %s: %s\n", fill, gai_strerror(err));
+		return -1;
+	}
+	fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		fprintf(stderr, "Error: Failed to connect to %s: %s\n", fill, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+//Send the DNS message of a passed query to xdp_dns_fill and wait for the answer to it
+static int ask_fill(int fd, const char *msg, size_t len, uint16_t id)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	char answer[WARMUP_PKT_SIZE];
+
+	if (send(fd, msg, len, 0) != len)
+		return -1;
+	while (poll(&pfd, 1, WARMUP_TIMEOUT_MS) > 0) {
+		int n = recv(fd, answer, sizeof(answer), 0);
+
+		//Late answers of earlier queries are skipped
+		if (n >= (int)sizeof(struct dns_hdr) && ((struct dns_hdr *)answer)->transaction_id == htons(id))
+			return 0;
+		if (n < 0)
+			return -1;
+	}
+	return -1;
+}
+
+static int read_stats(int map_fd, struct xdns_stats *total)
+{
+	struct xdns_stats values[nr_cpus];
+	__u32 key = 0;
+
+	memset(total, 0, sizeof(*total));
+	if (bpf_map_lookup_elem(map_fd, &key, values)) {
+		fprintf(stderr, "Error: Failed to read xdns_stats: %s\n", strerror(errno));
+		return -1;
+	}
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		for (int i = 0; i < XDNS_QTYPE_MAX; i++) {
+			total->hit[i] += values[cpu].hit[i];
+			total->miss[i] += values[cpu].miss[i];
+		}
+	}
+	return 0;
+}
+
+//Print the hit rate of the queries since the previous call and in total
+static void print_interval(int stats_fd, struct xdns_stats *prev, const struct warmup_totals *t,
+						   const struct warmup_totals *last)
+{
+	struct xdns_stats cur;
+	uint64_t hits = 0, misses = 0, total_hits = 0, total_misses = 0;
+	uint64_t relayed = t->relayed - last->relayed;
+
+	if (read_stats(stats_fd, &cur))
+		return;
+	for (int i = 0; i < XDNS_QTYPE_MAX; i++) {
+		hits += cur.hit[i] - prev->hit[i];
+		misses += cur.miss[i] - prev->miss[i];
+		total_hits += cur.hit[i];
+		total_misses += cur.miss[i];
+	}
+
+	printf("%10llu %10llu %10llu %9.1f%% %9.1f%% %10llu %8.0f %8llu\n",
+		   (unsigned long long)t->queries, (unsigned long long)hits, (unsigned long long)misses,
+		   hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+		   total_hits + total_misses ? 100.0 * total_hits / (total_hits + total_misses) : 0.0,
+		   (unsigned long long)relayed, relayed ? (t->miss_ms - last->miss_ms) * 1000 / relayed : 0.0,
+		   (unsigned long long)(t->failed - last->failed));
+	fflush(stdout);
+	*prev = cur;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s -f address[#port] [-n interval] [-o object] [-z names [-q queries] [-s skew] | workload]\n",
+			progname);
+	fprintf(stderr, "  -f  address xdp_dns_fill listens on, where the passed queries are sent\n");
+	fprintf(stderr, "  -n  queries between two lines of the curve (default %d)\n", WARMUP_DEFAULT_INTERVAL);
+	fprintf(stderr, "  -o  BPF object to run (default xdp_dns_kern.o)\n");
+	fprintf(stderr, "  -z  replay a Zipf workload over this many names instead of a file\n");
+	fprintf(stderr, "  -q  queries of the Zipf workload (default %d)\n", WARMUP_DEFAULT_QUERIES);
+	fprintf(stderr, "  -s  skew of the Zipf workload (default %.2f)\n", WARMUP_DEFAULT_SKEW);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	const char *object = "xdp_dns_kern.o", *fill = NULL;
+	struct warmup_workload w = {0};
+	struct warmup_totals t = {0}, last = {0};
+	struct xdns_stats prev;
+	struct bpf_object *obj;
+	struct bpf_program *prog;
+	size_t zipf_queries = WARMUP_DEFAULT_QUERIES;
+	double skew = WARMUP_DEFAULT_SKEW;
+	int interval = WARMUP_DEFAULT_INTERVAL, zipf_names = 0;
+	int opt, prog_fd, stats_fd, fill_fd, ret = 0;
+
+	while ((opt = getopt(argc, argv, "f:n:o:z:q:s:")) != -1) {
+		switch (opt) {
+			case 'f':
+				fill = optarg;
+				break;
+			case 'n':
+				interval = atoi(optarg);
+				break;
+			case 'o':
+				object = optarg;
+				break;
+			case 'z':
+				zipf_names = atoi(optarg);
+				break;
+			case 'q':
+				zipf_queries = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				skew = atof(optarg);
+				break;
+			case '?':
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (!fill || interval <= 0 || zipf_names < 0 || skew < 0 ||
+		(zipf_names ? optind != argc : optind != argc - 1)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zipf_names ? workload_zipf(&w, zipf_names, zipf_queries, skew) : workload_read(&w, argv[optind]))
+		return 1;
+	if (w.count == 0) {
+		fprintf(stderr, "Error: The workload holds no queries\n");
+		return 1;
+	}
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		perror("setrlimit failed");
+		return 1;
+	}
+	libbpf_set_print(print_bpf_verifier);
+	nr_cpus = libbpf_num_possible_cpus();
+
+	obj = load_object(object);
+	if (!obj)
+		return 1;
+	prog = bpf_object__find_program_by_name(obj, "xdp_dns");
+	prog_fd = prog ? bpf_program__fd(prog) : -1;
+	stats_fd = bpf_object__find_map_fd_by_name(obj, "xdns_stats");
+	if (prog_fd < 0 || stats_fd < 0) {
+		fprintf(stderr, "Error: Failed to get the program or xdns_stats of %s\n", object);
+		bpf_object__close(obj);
+		return 1;
+	}
+	fill_fd = open_fill(fill);
+	if (fill_fd < 0 || read_stats(stats_fd, &prev)) {
+		bpf_object__close(obj);
+		return 1;
+	}
+
+	printf("%10s %10s %10s %10s %10s %10s %8s %8s\n", "queries", "hits", "misses", "hit_rate", "total",
+		   "relayed", "us/miss", "failed");
+	for (size_t i = 0; i < w.count; i++) {
+		char pkt_in[WARMUP_PKT_SIZE], pkt_out[WARMUP_PKT_SIZE];
+		struct bpf_prog_test_run_attr attr;
+		uint16_t id = i & 0xffff;
+		int len = build_query(pkt_in, w.queries[i].name, w.queries[i].type, id);
+
+		if (len < 0) {
+			fprintf(stderr, "Error: Invalid name %s\n", w.queries[i].name);
+			ret = 1;
+			break;
+		}
+
+		memset(&attr, 0, sizeof(attr));
+		attr.prog_fd = prog_fd;
+		attr.repeat = 1;
+		attr.data_in = pkt_in;
+		attr.data_size_in = len;
+		attr.data_out = pkt_out;
+		attr.data_size_out = sizeof(pkt_out);
+		if (bpf_prog_test_run_xattr(&attr)) {
+			fprintf(stderr, "Error: BPF_PROG_TEST_RUN failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+
+		t.queries++;
+		if (attr.retval == XDP_TX) {
+			t.answered++;
+		} else if (attr.retval == XDP_PASS) {
+			struct timespec start, end;
+
+			//The stack would hand the UDP payload to the socket of xdp_dns_fill
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (ask_fill(fill_fd, pkt_in + WARMUP_DNS_OFFSET, len - WARMUP_DNS_OFFSET, id) == 0) {
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				t.miss_ms += (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+				t.relayed++;
+			} else {
+				t.failed++;
+			}
+		} else {
+			t.failed++;
+		}
+
+		if (t.queries % interval == 0 || i + 1 == w.count) {
+			print_interval(stats_fd, &prev, &t, &last);
+			last = t;
+		}
+	}
+
+	printf("%llu queries, %llu answered by XDP, %llu by xdp_dns_fill, %llu failed\n",
+		   (unsigned long long)t.queries, (unsigned long long)t.answered,
+		   (unsigned long long)t.relayed, (unsigned long long)t.failed);
+
+	close(fill_fd);
+	bpf_object__close(obj);
+	for (size_t i = 0; i < w.count; i++)
+		free(w.queries[i].name);
+	free(w.queries);
+	return ret;
+}
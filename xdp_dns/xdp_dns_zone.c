@@ -0,0 +1,599 @@
+/*
+SPDX-License-Identifier: GPL-2.0-or-later
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330
+*/
+
+/*
+ * Compiles an RFC 1035 master file into the record maps of a running xdp_dns.
+ * The file is mapped and parsed in a single pass; records go through the batched
+ * loader of xdp_dns_update, so memory use does not grow with the size of the file.
+ *
+ *   sudo ./xdp_dns_zone -o example.com example.com.zone       load into the active zone
+ *   sudo ./xdp_dns_zone -s example.com.zone                   build a new zone and swap it in
+ *   ./xdp_dns_zone -n example.com.zone                        parse only
+ *   sudo ./xdp_dns_zone -w example.com.zone                   keep the active zone in sync with the file
+ *
+ * Supported: $ORIGIN, $TTL, relative names and @, blank owners, parentheses, comments,
+ * TTL units (1h30m), the IN class and A, AAAA, CNAME, MX, NS, PTR, SRV and TXT records.
+ * Other types (SOA, DNSSEC, ...) are skipped, $INCLUDE is reported as an error.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/bpf.h>
+#include <bpf/bpf.h>
+
+#include "dns_util.h"
+#include "dns_batch.h"
+#include "dns_sync.h"
+#include "dns_zone.h"
+
+//Longest entry (all lines of a parenthesized record) and number of fields in one entry
+#define ZONE_ENTRY_MAX 4096
+#define ZONE_TOKENS_MAX 64
+//Pages behind the parser are dropped from the mapping every ZONE_DROP_BYTES
+#define ZONE_DROP_BYTES (64UL << 20)
+#define ZONE_DEFAULT_TTL 3600
+//Errors printed in full, the rest is only counted
+#define ZONE_ERRORS_SHOWN 20
+
+struct zone_parser {
+	const char *filename;
+	const char *base;
+	const char *pos;
+	const char *end;
+	const char *dropped;
+	unsigned long line;         //Line of the next character
+	unsigned long entry_line;   //First line of the current entry
+
+	char origin[DNS_NAME_TEXT_LENGTH];  //Dotted, without the final dot, empty for the root
+	char owner[DNS_NAME_TEXT_LENGTH];   //Owner of the previous record
+	uint32_t ttl;                       //$TTL, or the last TTL given explicitly before any $TTL
+	int ttl_directive;                  //A $TTL was seen, explicit TTLs only apply to their record
+	int owner_blank;
+
+	char buf[ZONE_ENTRY_MAX];
+	char *tokens[ZONE_TOKENS_MAX];
+	int ntokens;
+
+	struct dns_batch *batch;
+	unsigned long records;
+	unsigned long skipped;
+	unsigned long errors;
+};
+
+static void zone_error(struct zone_parser *p, const char *msg, const char *arg)
+{
+	if (p->errors++ < ZONE_ERRORS_SHOWN)
+		printf("ERROR: %s:%lu: %s%s%s\n", p->filename, p->entry_line, msg, arg ? " " : "", arg ? arg : "");
+}
+
+//Give the pages the parser has passed back, the mapping would otherwise grow to the whole file
+static void zone_drop_behind(struct zone_parser *p)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	const char *limit = p->base + ((p->pos - p->base) & ~(page_size - 1));
+
+	if (limit - p->dropped >= ZONE_DROP_BYTES) {
+		madvise((void *)p->dropped, limit - p->dropped, MADV_DONTNEED);
+		p->dropped = limit;
+	}
+}
+
+//Split the next entry into tokens. An entry ends at a newline outside of parentheses.
+//Returns the number of tokens, 0 at the end of the file and -1 for an entry that does not fit.
+static int zone_next_entry(struct zone_parser *p)
+{
+	size_t used = 0;
+	int depth = 0, overflow = 0;
+
+	p->ntokens = 0;
+	while (p->pos < p->end) {
+		p->entry_line = p->line;
+		p->owner_blank = *p->pos == ' ' || *p->pos == '\t';
+		depth = 0;
+
+		while (p->pos < p->end) {
+			char c = *p->pos;
+			char *token = p->buf + used;
+
+			if (c == '\n') {
+				p->pos++;
+				p->line++;
+				if (depth == 0)
+					break;
+			} else if (c == ' ' || c == '\t' || c == '\r') {
+				p->pos++;
+			} else if (c == ';') {
+				while (p->pos < p->end && *p->pos != '\n')
+					p->pos++;
+			} else if (c == '(') {
+				depth++;
+				p->pos++;
+			} else if (c == ')') {
+				depth -= depth > 0;
+				p->pos++;
+			} else {
+				int quoted = c == '"';
+
+				p->pos += quoted;
+				while (p->pos < p->end) {
+					c = *p->pos;
+					if (quoted ? c == '"' || c == '\n' :
+						c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == '(' || c == ')' || c == '"')
+						break;
+					p->pos++;
+					//A backslash escapes the next character or is followed by three decimal digits.
+					//Escapes are kept as they are, so an escaped dot stays inside its label when the
+					//name is converted to wire format.
+					if (c == '\\' && p->pos < p->end) {
+						if (used + 1 < sizeof(p->buf))
+							p->buf[used++] = c;
+						else
+							overflow = 1;
+						c = *p->pos++;
+					}
+					if (used + 1 < sizeof(p->buf))
+						p->buf[used++] = c;
+					else
+						overflow = 1;
+				}
+				if (quoted && p->pos < p->end && *p->pos == '"')
+					p->pos++;
+
+				if (used + 1 < sizeof(p->buf) && p->ntokens < ZONE_TOKENS_MAX) {
+					p->buf[used++] = 0;
+					p->tokens[p->ntokens++] = token;
+				} else {
+					overflow = 1;
+				}
+			}
+		}
+
+		if (overflow) {
+			p->ntokens = 0;
+			return -1;
+		}
+		if (p->ntokens > 0)
+			return p->ntokens;
+	}
+
+	return 0;
+}
+
+//A name ends with a dot that is not escaped by a backslash
+static int zone_is_absolute(const char *name, size_t len)
+{
+	size_t backslashes = 0;
+
+	if (len == 0 || name[len - 1] != '.')
+		return 0;
+	while (backslashes < len - 1 && name[len - 2 - backslashes] == '\\')
+		backslashes++;
+	return backslashes % 2 == 0;
+}
+
+//Make a name absolute: @ is the origin, names without a final dot are relative to it.
+//The result is dotted without the final dot and with the escapes of the file, as
+//replace_dots_with_length_octets expects. out holds DNS_NAME_TEXT_LENGTH characters.
+static int zone_qualify(const struct zone_parser *p, const char *name, char *out)
+{
+	char wire[MAX_DNS_NAME_LENGTH];
+	size_t len = strlen(name);
+	int n;
+
+	if (strcmp(name, "@") == 0)
+		n = snprintf(out, DNS_NAME_TEXT_LENGTH, "%s", p->origin);
+	else if (zone_is_absolute(name, len))
+		n = snprintf(out, DNS_NAME_TEXT_LENGTH, "%.*s", (int)len - 1, name);
+	else if (p->origin[0] == 0)
+		n = snprintf(out, DNS_NAME_TEXT_LENGTH, "%s", name);
+	else
+		n = snprintf(out, DNS_NAME_TEXT_LENGTH, "%s.%s", name, p->origin);
+
+	//Names are at most 255 octets in wire format, with labels of at most 63 octets
+	if (n < 0 || n >= DNS_NAME_TEXT_LENGTH)
+		return -1;
+	return replace_dots_with_length_octets(out, wire) < 0 ? -1 : 0;
+}
+
+//Parse a TTL, either plain seconds or a sequence of numbers with units (1w2d3h4m5s)
+static int zone_parse_ttl(const char *s, uint32_t *ttl)
+{
+	uint64_t total = 0;
+
+	if (!isdigit((unsigned char)*s))
+		return -1;
+	while (*s) {
+		char *end;
+		uint64_t value = strtoull(s, &end, 10);
+
+		if (end == s)
+			return -1;
+		switch (tolower((unsigned char)*end)) {
+			case 'w': value *= 7 * 86400; end++; break;
+			case 'd': value *= 86400; end++; break;
+			case 'h': value *= 3600; end++; break;
+			case 'm': value *= 60; end++; break;
+			case 's': end++; break;
+			case 0: break;
+			default: return -1;
+		}
+		total += value;
+		s = end;
+	}
+	if (total > UINT32_MAX)
+		return -1;
+	*ttl = total;
+	return 0;
+}
+
+static int zone_is_class(const char *s)
+{
+	return strcasecmp(s, "IN") == 0 || strcasecmp(s, "CH") == 0 || strcasecmp(s, "HS") == 0 ||
+		   strcasecmp(s, "CS") == 0 || strncasecmp(s, "CLASS", 5) == 0;
+}
+
+static void zone_directive(struct zone_parser *p)
+{
+	char **t = p->tokens;
+
+	if (strcasecmp(t[0], "$ORIGIN") == 0 && p->ntokens >= 2) {
+		char origin[DNS_NAME_TEXT_LENGTH];
+		if (zone_qualify(p, t[1], origin) < 0)
+			zone_error(p, "Invalid $ORIGIN", t[1]);
+		else
+			strcpy(p->origin, origin);
+	} else if (strcasecmp(t[0], "$TTL") == 0 && p->ntokens >= 2) {
+		if (zone_parse_ttl(t[1], &p->ttl) < 0)
+			zone_error(p, "Invalid $TTL", t[1]);
+		else
+			p->ttl_directive = 1;
+	} else {
+		zone_error(p, "Unsupported directive", t[0]);
+	}
+}
+
+//Turn the RDATA fields of a record into the presentation format of xdp_dns_update
+static int zone_value(struct zone_parser *p, uint16_t type, char **rdata, int n, char *value, size_t size)
+{
+	char name[DNS_NAME_TEXT_LENGTH];
+	size_t len = 0;
+
+	switch (type) {
+		case A_RECORD_TYPE:
+		case AAAA_RECORD_TYPE:
+			if (n != 1)
+				return -1;
+			snprintf(value, size, "%s", rdata[0]);
+			return 0;
+
+		case CNAME_RECORD_TYPE:
+		case NS_RECORD_TYPE:
+		case PTR_RECORD_TYPE:
+			if (n != 1 || zone_qualify(p, rdata[0], name) < 0)
+				return -1;
+			snprintf(value, size, "%s", name);
+			return 0;
+
+		case MX_RECORD_TYPE:
+			if (n != 2 || zone_qualify(p, rdata[1], name) < 0)
+				return -1;
+			snprintf(value, size, "%s %s", rdata[0], name);
+			return 0;
+
+		case SRV_RECORD_TYPE:
+			if (n != 4 || zone_qualify(p, rdata[3], name) < 0)
+				return -1;
+			snprintf(value, size, "%s %s %s %s", rdata[0], rdata[1], rdata[2], name);
+			return 0;
+
+		case TXT_RECORD_TYPE:
+			//Every field is a character-string of its own, quoted for rr_rdata_from_text.
+			//The escapes of the file are kept, so quotes within a string stay escaped.
+			for (int i = 0; i < n; i++) {
+				size_t l = strlen(rdata[i]);
+				if (len + l + 4 > size)
+					return -1;
+				if (i > 0)
+					value[len++] = ' ';
+				value[len++] = '"';
+				memcpy(value + len, rdata[i], l);
+				len += l;
+				value[len++] = '"';
+			}
+			value[len] = 0;
+			return n > 0 ? 0 : -1;
+	}
+	return -1;
+}
+
+static void zone_record(struct zone_parser *p)
+{
+	char **t = p->tokens;
+	char value[MAX_RR_DATA_LENGTH * 4];
+	uint32_t ttl = p->ttl;
+	uint16_t type = 0;
+	int i = 0, err;
+
+	if (!p->owner_blank) {
+		if (zone_qualify(p, t[i++], p->owner) < 0) {
+			p->owner[0] = 0;
+			zone_error(p, "Invalid owner name", t[0]);
+			return;
+		}
+	}
+	if (p->owner[0] == 0) {
+		zone_error(p, "Record without an owner name", NULL);
+		return;
+	}
+
+	//TTL and class come in either order before the type
+	for (; i < p->ntokens; i++) {
+		if (zone_parse_ttl(t[i], &ttl) == 0) {
+			if (!p->ttl_directive)
+				p->ttl = ttl;
+		} else if (zone_is_class(t[i])) {
+			if (strcasecmp(t[i], "IN") != 0) {
+				p->skipped++;
+				return;
+			}
+		} else {
+			break;
+		}
+	}
+	if (i == p->ntokens) {
+		zone_error(p, "Record without a type", NULL);
+		return;
+	}
+
+	if (strcasecmp(t[i], "A") == 0)
+		type = A_RECORD_TYPE;
+	else if (strcasecmp(t[i], "AAAA") == 0)
+		type = AAAA_RECORD_TYPE;
+	else
+		type = rr_type_from_name(t[i]);
+	if (type == 0) {
+		p->skipped++;
+		return;
+	}
+	i++;
+
+	if (zone_value(p, type, t + i, p->ntokens - i, value, sizeof(value)) < 0) {
+		zone_error(p, "Invalid record data for", t[i - 1]);
+		return;
+	}
+
+	p->records++;
+	if (!p->batch)
+		return;
+	err = dns_batch_add(p->batch, type, p->owner, value, ttl, 0, 0);
+	if (err == -EINVAL)
+		zone_error(p, "Invalid record data for", t[i - 1]);
+	else if (err == -ENOSPC)
+		zone_error(p, "RRset is full for", p->owner);
+	else if (err == -EEXIST)
+		zone_error(p, "Name hash collides with another record:", p->owner);
+	else if (err < 0)
+		zone_error(p, "Failed to write the records:", strerror(-err));
+}
+
+static int zone_compile(struct zone_parser *p)
+{
+	int n;
+
+	while ((n = zone_next_entry(p)) != 0) {
+		if (n < 0)
+			zone_error(p, "Entry too long", NULL);
+		else if (p->tokens[0][0] == '$' && !p->owner_blank)
+			zone_directive(p);
+		else
+			zone_record(p);
+		zone_drop_behind(p);
+	}
+
+	return p->batch ? dns_batch_flush(p->batch) : 0;
+}
+
+//Map filename and compile it into batch (no batch: parse only), starting from the origin and
+//TTL of defaults. Returns 0, -EINVAL if the file has errors, or the error of a flush.
+static int zone_load(const struct zone_parser *defaults, const char *filename, struct dns_batch *batch)
+{
+	struct zone_parser *p;
+	struct timespec start, end;
+	struct stat st;
+	int fd, err;
+
+	p = malloc(sizeof(*p));
+	if (!p) {
+		fprintf(stderr, "Error: failed to allocate memory\n");
+		return -ENOMEM;
+	}
+	*p = *defaults;
+	p->filename = filename;
+	p->batch = batch;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		err = -errno;
+		fprintf(stderr, "Error: Could not open %s: %s\n", filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		free(p);
+		return err;
+	}
+	if (st.st_size > 0) {
+		p->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p->base == MAP_FAILED) {
+			err = -errno;
+			fprintf(stderr, "Error: Could not map %s: %s\n", filename, strerror(errno));
+			close(fd);
+			free(p);
+			return err;
+		}
+		madvise((void *)p->base, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	p->pos = p->dropped = p->base;
+	p->end = p->base + st.st_size;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	err = zone_compile(p);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+	printf("%s: %lu lines, %lu records, %lu skipped, %lu errors in %.3f s (%.1f MB/s, %.0f records/s)\n",
+		   p->filename, p->line - 1, p->records, p->skipped, p->errors, elapsed,
+		   st.st_size / elapsed / 1e6, p->records / elapsed);
+
+	if (!err && p->errors)
+		err = -EINVAL;
+	if (p->base)
+		munmap((void *)p->base, st.st_size);
+	free(p);
+	return err;
+}
+
+static int zone_sync_load(const char *filename, struct dns_batch *batch, void *ctx)
+{
+	return zone_load(ctx, filename, batch);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-o origin] [-t ttl] [-s | -n | -w] zone_file\n", progname);
+	fprintf(stderr, "  -o  origin of the file until its first $ORIGIN (default: the root)\n");
+	fprintf(stderr, "  -t  TTL of records before the first $TTL or explicit TTL (default: %d)\n", ZONE_DEFAULT_TTL);
+	fprintf(stderr, "  -s  build a new zone from the file and swap it in, instead of adding to the active zone\n");
+	fprintf(stderr, "  -n  only parse the file\n");
+	fprintf(stderr, "  -w  make the active zone hold exactly the file, and sync the changes whenever it is saved\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct zone_parser *defaults;
+	struct zone_swap swap;
+	struct dns_batch *batch = NULL;
+	const char *filename;
+	int do_swap = 0, dry_run = 0, watch = 0;
+	int opt, err;
+	int ret = 1;
+
+	defaults = calloc(1, sizeof(*defaults));
+	if (!defaults) {
+		fprintf(stderr, "Error: failed to allocate memory\n");
+		return 1;
+	}
+	defaults->ttl = ZONE_DEFAULT_TTL;
+	defaults->line = 1;
+
+	while ((opt = getopt(argc, argv, "o:t:snw")) != -1) {
+		switch (opt) {
+			case 'o': {
+				//The origin is absolute, with or without the final dot
+				char wire[MAX_DNS_NAME_LENGTH];
+				size_t len = strlen(optarg);
+				if (zone_is_absolute(optarg, len))
+					optarg[--len] = 0;
+				if (len >= DNS_NAME_TEXT_LENGTH || replace_dots_with_length_octets(optarg, wire) < 0) {
+					fprintf(stderr, "Invalid origin '%s'\n", optarg);
+					return 1;
+				}
+				strcpy(defaults->origin, optarg);
+				break;
+			}
+			case 't':
+				if (zone_parse_ttl(optarg, &defaults->ttl) < 0) {
+					fprintf(stderr, "Invalid TTL '%s'\n", optarg);
+					return 1;
+				}
+				break;
+			case 's':
+				do_swap = 1;
+				break;
+			case 'n':
+				dry_run = 1;
+				break;
+			case 'w':
+				watch = 1;
+				break;
+			case '?':
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || do_swap + dry_run + watch > 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	filename = argv[optind];
+
+	if (watch) {
+		ret = dns_sync_watch(filename, zone_sync_load, defaults) ? 1 : 0;
+		free(defaults);
+		return ret;
+	}
+
+	//Records go to the active zone, or to a new zone in the other slot
+	int zone_fds[ZONE_MAPS];
+	if (do_swap) {
+		if (zone_swap_begin(&swap) < 0) {
+			zone_swap_end(&swap);
+			return 1;
+		}
+		memcpy(zone_fds, swap.fds, sizeof(zone_fds));
+	} else if (!dry_run && zone_open_active(zone_fds) < 0) {
+		return 1;
+	}
+	if (!dry_run) {
+		batch = dns_batch_new(zone_fds[ZONE_A], zone_fds[ZONE_AAAA], zone_fds[ZONE_RR]);
+		if (!batch) {
+			fprintf(stderr, "Error: failed to allocate memory\n");
+			return 1;
+		}
+	}
+
+	err = zone_load(defaults, filename, batch);
+	if (batch)
+		printf("%llu RRsets written in %llu update calls\n",
+			   (unsigned long long)batch->rrsets, (unsigned long long)batch->batches);
+
+	if (!err)
+		ret = 0;
+	if (do_swap) {
+		if (ret == 0 && zone_swap_commit(&swap) < 0)
+			ret = 1;
+		else if (ret != 0)
+			printf("ERROR: Zone not swapped, slot %d is still answering\n", swap.slot);
+		zone_swap_end(&swap);
+	}
+
+	dns_batch_free(batch);
+	free(defaults);
+	return ret;
+}
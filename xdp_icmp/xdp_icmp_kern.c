@@ -6,27 +6,55 @@
 #include <linux/tcp.h>
 #include <linux/icmp.h>
 #include "bpf_helpers.h"
+#include "latency.h"
+#include "rxq_stats.h"
+#include "parsing_helpers.h"
+#include "csum_helpers.h"
 
-SEC("xdp")
-int icmp_serv(struct xdp_md *ctx)
+/* Processing time histograms, recorded while xicmp_lat_on is set (see the latency tool) */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct latency_hist);
+	__uint(max_entries, 1);
+	__uint(pinning, 1);
+} xicmp_lat SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, 1);
+	__uint(pinning, 1);
+} xicmp_lat_on SEC(".maps");
+
+/* Packets and echo replies per RX queue (see xdp_icmp_user -i) */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct rxq_stats);
+	__uint(max_entries, MAX_RX_QUEUES);
+	__uint(pinning, 1);
+} xicmp_rxq SEC(".maps");
+
+static __always_inline int process_packet(struct xdp_md *ctx)
 {
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
-	struct ethhdr *eth = data;
-	struct iphdr *ip = data + sizeof(*eth);
-	void *transp = data + sizeof(*eth) + sizeof(*ip);
+	struct hdr_cursor nh = { .pos = data, .off = 0 };
+	struct ethhdr *eth;
+	struct iphdr *ip;
 	struct icmphdr *icmp;
-	char *payload;
 
-	if (ip + 1 > data_end)
+	/* VLAN tags and IP options are skipped by the parser, the reply keeps both */
+	if (parse_ethhdr(&nh, data_end, &eth) != bpf_htons(ETH_P_IP))
 		return XDP_PASS;
 
-	switch (ip->protocol) {
+	switch (parse_iphdr(&nh, data_end, &ip)) {
 		case IPPROTO_ICMP:
-			icmp = (struct icmphdr *) transp;
-			if (icmp + 1 > data_end)
+			/* Only echo requests are answered */
+			if (parse_icmphdr(&nh, data_end, &icmp) != ICMP_ECHO)
 				return XDP_PASS;
-			payload = transp + sizeof(*icmp);
 			break;
 		default:
 			return XDP_PASS;
@@ -42,16 +70,29 @@ int icmp_serv(struct xdp_md *ctx)
 	tmp_ip = ip->saddr;
 	ip->saddr = ip->daddr;
 	ip->daddr = tmp_ip;
-	// ip->check = compute_ip_checksum(ip);
+	/* Swapping the addresses leaves the IP checksum unchanged */
 
-	icmp->type = 0;
-	u16 csum = htons(icmp->checksum);
-	csum += 0x0800;
-	icmp->checksum = ntohs(csum);
+	/* Turn the request into an echo reply and patch the checksum
+	 * for the changed type/code word (RFC 1624) */
+	__u16 old_word = *(__u16 *)icmp;
+	icmp->type = ICMP_ECHOREPLY;
+	csum_replace2(&icmp->checksum, old_word, *(__u16 *)icmp);
 	#ifdef DEBUG
 	bpf_printk("Passing through XDP");
 	#endif
 	return XDP_TX;
 }
 
+SEC("xdp")
+int icmp_serv(struct xdp_md *ctx)
+{
+	__u64 start = latency_start(&xicmp_lat_on);
+	int action = process_packet(ctx);
+
+	/* Echo requests are answered, everything else is passed on */
+	latency_record(&xicmp_lat, start, action == XDP_TX ? LATENCY_HIT : LATENCY_PASS);
+	rxq_count(&xicmp_rxq, ctx, action == XDP_TX);
+	return action;
+}
+
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
@@ -24,6 +24,8 @@
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
+#include "rxq_stats.h"
+
 static int nr_cpus = 0;
 
 static int print_bpf_verifier(enum libbpf_print_level level,
@@ -44,14 +46,24 @@ int main(int argc, char *argv[])
 	__u32 xdp_flags = 0;
 	int *interfaces_idx;
 	int ret = 0;
+	/* Seconds between two reports of the RX queue load, 0 disables them */
+	int stats_interval = 0;
 
 	int opt;
 	int interface_count = 0;
-	while ((opt = getopt(argc, argv, "")) != -1) {
+	while ((opt = getopt(argc, argv, "i:")) != -1) {
 		switch (opt) {
+			case 'i':
+				stats_interval = atoi(optarg);
+				if (stats_interval <= 0) {
+					fprintf(stderr, "Invalid statistics interval '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case '?':
 			default:
-				fprintf(stderr, "Usage: %s <interface_idx...>\n", argv[0]);
+				fprintf(stderr, "Usage: %s [-i seconds] <interface_idx...>\n", argv[0]);
+				fprintf(stderr, "  -i  print the packet rate and skew of the RX queues every interval\n");
 				exit(EXIT_FAILURE);
 		}
 	}
@@ -112,6 +124,12 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	int rxq_fd = bpf_object__find_map_fd_by_name(obj, "xicmp_rxq");
+	if (rxq_fd < 0) {
+		fprintf(stderr, "Error: Failed to find xicmp_rxq\n");
+		return 1;
+	}
+
 	for (int i = 0; i < interface_count; i++) {
 		if (bpf_set_link_xdp_fd(interfaces_idx[i], xdp_main_prog_fd, xdp_flags) < 0) {
 			fprintf(stderr, "Error: bpf_set_link_xdp_fd failed for interface %d\n", interfaces_idx[i]);
@@ -131,8 +149,30 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	struct rxq_totals prev_rxq;
+	struct timespec prev_time, now;
+	if (stats_interval && rxq_read(rxq_fd, nr_cpus, &prev_rxq, NULL))
+		stats_interval = 0;
+	clock_gettime(CLOCK_MONOTONIC, &prev_time);
+
 	while (!quit) {
-		err = sigwait(&signal_mask, &sig);
+		if (stats_interval) {
+			/* Wake up every stats_interval seconds to report the queue load */
+			struct timespec timeout = {stats_interval, 0};
+			sig = sigtimedwait(&signal_mask, NULL, &timeout);
+			if (sig < 0 && errno == EAGAIN) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				rxq_report(rxq_fd, nr_cpus, &prev_rxq,
+						   (now.tv_sec - prev_time.tv_sec) + (now.tv_nsec - prev_time.tv_nsec) / 1e9);
+				prev_time = now;
+				continue;
+			}
+			err = sig < 0 && errno != EINTR ? -1 : 0;
+			if (sig < 0 && !err)
+				continue;
+		} else {
+			err = sigwait(&signal_mask, &sig);
+		}
 		if (err != 0) {
 			fprintf(stderr, "Error: Failed to wait for signal\n");
 			exit(EXIT_FAILURE);